@@ -0,0 +1,30 @@
+#!/bin/sh
+# Typing at the prompt under a full window of coloured ls -l output: 24
+# characters, one keystroke and one frame each, then 24 backspaces, and last
+# one repaint of the whole window for scale.  Each report gives the paint ops
+# and bytes for its batch.  No keystroke is timed: this shows how little is
+# redrawn per key, not how long a key takes to appear.
+# Run from the top of the tree after building with -O2:
+#
+#   gcc -O2 myTerm.c -o myTerm -lX11 && sh bench/keystroke.sh
+set -e
+MYTERM=${MYTERM:-./myTerm}
+script=$(mktemp)
+trap 'rm -f "$script"' EXIT
+
+{
+    echo "resize 1600 1000"
+    echo "# let the first prompt arrive before typing"
+    echo "idle"
+    echo "type ls -l --color=always /usr/lib/x86_64-linux-gnu"
+    echo "key Return"
+    echo "idle"
+    echo "report setup"
+    echo echoxquickbrownfoxjumpsx | fold -w 1 | sed 's/^/type /'
+    echo "report 24 keystrokes"
+    for i in $(seq 1 24); do echo "key BackSpace"; done
+    echo "report 24 backspaces"
+    echo "resize 1601 1000"
+    echo "report whole-window repaint"
+} > "$script"
+"$MYTERM" -H "$script"
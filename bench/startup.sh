@@ -0,0 +1,22 @@
+#!/bin/sh
+# Memory at startup and the cost of forking from the GUI process.
+# Run from the repository root with: sh bench/startup.sh
+# Set MYTERM to measure another build, e.g. one from before tabs were
+# allocated on demand (builds without the `spawn` command print only the
+# memory lines).
+# The BSS size comes from the binary; VmRSS and VmData are read while the
+# headless terminal sits at its first prompt.  The fork line is the time
+# the GUI spends in pty_spawn_shell(), which forks the whole process.
+MYTERM=${MYTERM:-./myTerm}
+script=$(mktemp)
+out=$(mktemp)
+trap 'rm -f "$script" "$out"' EXIT
+printf 'idle\nwait 1000\nspawn 50\n' > "$script"
+
+size "$MYTERM" | awk 'NR == 2 { print "bss: " $3 " bytes" }'
+"$MYTERM" -H "$script" > "$out" 2>&1 &
+pid=$!
+sleep 0.8
+grep -E '^(VmRSS|VmData)' "/proc/$pid/status"
+wait $pid
+grep '^spawn' "$out"
@@ -0,0 +1,40 @@
+#!/bin/sh
+# Output handling throughput on recorded streams.
+#
+# Records a few kinds of terminal output once, then passes each through
+# myTerm's escape-sequence parser alone (the headless `parse` command),
+# through the line splitting of ingest_text() into a scrollback (`ingest`)
+# and through the parser, screen and scrollback together (`feed`).  Each
+# prints the rate in MB/s.  Run from the top of the tree after building with -O2:
+#
+#   gcc -O2 myTerm.c -o myTerm -lX11 && sh bench/streams.sh
+#
+# The streams are kept in $STREAMS (default $TMPDIR/myterm-streams) and
+# reused by later runs; delete it to record them again.
+set -e
+MYTERM=${MYTERM:-./myTerm}
+STREAMS=${STREAMS:-${TMPDIR:-/tmp}/myterm-streams}
+mkdir -p "$STREAMS"
+
+record() {
+    name=$1; shift
+    [ -s "$STREAMS/$name" ] || "$@" > "$STREAMS/$name" 2>&1 || true
+}
+record ls-color.txt ls --color=always -lR /usr
+record git-log.txt git log -p --stat --color=always
+# One compile only gives a few hundred KB of diagnostics, so it is repeated
+if [ ! -s "$STREAMS/gcc-warnings.txt" ]; then
+    gcc -fsyntax-only -Wall -Wextra -Wconversion -fdiagnostics-color=always myTerm.c > "$STREAMS/gcc-1.txt" 2>&1 || true
+    for i in $(seq 1 20); do cat "$STREAMS/gcc-1.txt"; done > "$STREAMS/gcc-warnings.txt"
+    rm -f "$STREAMS/gcc-1.txt"
+fi
+record seq.txt seq 1 3000000
+
+script=$STREAMS/feed.myterm
+: > "$script"
+for f in ls-color.txt git-log.txt gcc-warnings.txt seq.txt; do
+    for i in 1 2 3; do echo "parse $STREAMS/$f" >> "$script"; done
+    for i in 1 2 3; do echo "ingest $STREAMS/$f" >> "$script"; done
+    for i in 1 2 3; do echo "feed $STREAMS/$f" >> "$script"; done
+done
+"$MYTERM" -H "$script"
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Tab switching: 20 tabs of coloured ls -l output, then 200 Ctrl+Tab presses
+# around them, reported as the first lap (each tab's back buffer is painted
+# once) and the 180 switches after it.  What it counts is the painting per
+# batch of switches, as frames, paint ops and bytes; the time printed for a
+# batch is mostly noise and says little about how quick a switch feels.
+# Run from the top of the tree after building with -O2:
+#
+#   gcc -O2 myTerm.c -o myTerm -lX11 && sh bench/tab_switch.sh
+set -e
+MYTERM=${MYTERM:-./myTerm}
+script=$(mktemp)
+trap 'rm -f "$script"' EXIT
+
+switches() {
+    for i in $(seq 1 "$1"); do echo "key ctrl+Tab"; done
+}
+{
+    echo "resize 1600 1000"
+    echo "idle"
+    for i in $(seq 1 20); do
+        [ "$i" -eq 1 ] || echo "key ctrl+t"
+        echo "type ls -l --color=always /usr/lib/x86_64-linux-gnu"
+        echo "key Return"
+        echo "idle"
+    done
+    echo "report setup"
+    switches 20
+    echo "report first 20 switches"
+    switches 180
+    echo "report next 180 switches"
+} > "$script"
+"$MYTERM" -H "$script"
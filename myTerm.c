@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <X11/Xlib.h>
 #include <X11/keysym.h>
 #include <X11/Xutil.h>
@@ -15,25 +16,41 @@
 #include <errno.h>
 #include <dirent.h>
 #include <sys/types.h>
+#include <stdint.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <malloc.h>
+#include <limits.h>
+#include <spawn.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define POSX 500
 #define POSY 500
 #define WIDTH 600
 #define HEIGHT 400
 #define BORDER 16
-#define MAX_LINES 1000
 #define VISIBLE_LINES 40
 #define MAX_LINE_LEN 256
-#define MAX_TABS 100
+#define DEFAULT_SCROLLBACK_LINES 100000
+#define SB_BLOCK_SIZE (64 * 1024)
 
 static int win_width = WIDTH;
 static int win_height = HEIGHT;
 
-#define MAX_HISTORY_SIZE 10000
 #define HISTORY_FILE ".myterm_history"
 
-static char history[MAX_HISTORY_SIZE][MAX_LINE_LEN];
-static int history_count = 0;
+static int history_count = 0;   // distinct commands
 static int history_current = 0;
 static int search_mode = 0;
 static char search_term[MAX_LINE_LEN] = "";
@@ -42,36 +59,686 @@ static int search_cursor = 0;
 static int selection_mode = 0;
 static char **selection_matches = NULL;
 static int selection_match_count = 0;
-static int original_line = 0;
+static unsigned long original_line = 0; // scrollback end before the match list
 static char original_command[MAX_LINE_LEN] = "";
 
 static Display *dpy;
 static int screen;
 static Window root;
 
+/* ---- Scrollback buffer ----
+ * Lines are packed back to back into large blocks and indexed through a ring
+ * of line records, so evicting the oldest line is O(1) and a line can be of
+ * any length.  A block is released once every line stored in it is gone.
+ *
+ * Blocks away from what is on screen go cold: when the event loop is idle
+ * (or a tab holds more than SB_HOT_BYTES of plain text) they are compressed
+ * with lz_pack() and the plain copy is freed.  Past the per-tab budget
+ * (scrollback_ram) the oldest compressed blocks move to a spill file that
+ * is mapped into memory, so the kernel can page them out.  sb_line()
+ * decompresses a cold block when it is drawn; that copy is dropped again
+ * once the view has moved away from it.
+ */
+#define LINE_COMMAND 0x01 // line was typed at the prompt
+#define LINE_ATTR    0x02 // text is followed by attribute runs (see screen_push_row)
+
+#define SB_HOT_BYTES (1024 * 1024)             // plain text a tab keeps while output streams in
+#define SB_DEFAULT_RAM (32 * 1024 * 1024)      // compressed bytes per tab before spilling
+#define SB_SPILL_SEGMENT (8 * 1024 * 1024)     // the spill file is mapped this much at a time
+
+typedef struct {
+    size_t used;
+    size_t size;
+    unsigned int live;  // lines still stored in this block
+    char *data;         // the text, or NULL while the block is only compressed
+    char *packed;       // compressed text (malloc'd, or in a spill segment), or NULL
+    size_t packed_len;
+    long spill;         // absolute spill segment holding packed, or -1
+} SbBlock;
+
+typedef struct {
+    unsigned int block; // absolute block number
+    unsigned int off;
+    unsigned int len;
+    unsigned int flags;
+} SbLine;
+
+// Compressed blocks moved out of the heap: segments of an unlinked file,
+// each mapped while it holds any block
+typedef struct {
+    int fd;                   // -1 until the first spill
+    char **maps;              // segment first + i
+    unsigned int *live;       // blocks stored in each
+    unsigned int count;
+    unsigned int cap;
+    long first;               // absolute number of maps[0]
+    size_t used;              // bytes taken in the newest segment
+} SbSpill;
+
+typedef struct {
+    SbLine *lines;            // ring of line records, oldest at head
+    unsigned int line_cap;    // power of two
+    unsigned int head;
+    unsigned int count;
+    unsigned int max_lines;
+    unsigned long first;      // absolute number of the oldest retained line
+    SbBlock **blocks;         // ring of text blocks, oldest at block_head
+    unsigned int block_cap;   // power of two
+    unsigned int block_head;
+    unsigned int block_count;
+    unsigned int block_first; // absolute number of the oldest block
+    size_t plain_bytes;       // in blocks' data
+    size_t packed_bytes;      // compressed text on the heap
+    SbSpill spill;
+} Scrollback;
+
+static unsigned int scrollback_lines = DEFAULT_SCROLLBACK_LINES;
+static size_t scrollback_ram = SB_DEFAULT_RAM;
+static int sb_cooling = 0;    // some block may be ready to compress (see scrollback_step)
+
+/* LZ77 in the style of LZ4: a token byte holds the literal count and the
+ * match length - 4 (15 meaning more bytes follow, 255 at a time), then the
+ * literals, then a 16-bit little-endian offset back into the output.  The
+ * last sequence has literals only.  Worst case the output is n + n / 255 + 16.
+ */
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+
+static unsigned char *lz_length(unsigned char *op, size_t n) {
+    for (; n >= 255; n -= 255) *op++ = 255;
+    *op++ = n;
+    return op;
+}
+
+static unsigned char *lz_sequence(unsigned char *op, const unsigned char *lit, size_t nlit,
+                                  size_t offset, size_t match) {
+    size_t m = match ? match - LZ_MIN_MATCH : 0;
+    *op++ = (nlit < 15 ? nlit : 15) << 4 | (m < 15 ? m : 15);
+    if (nlit >= 15) op = lz_length(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (!match) return op;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    if (m >= 15) op = lz_length(op, m - 15);
+    return op;
+}
+
+static size_t lz_pack(const unsigned char *src, size_t n, unsigned char *dst) {
+    uint32_t table[1 << LZ_HASH_BITS] = {0}; // position + 1 of the last 4 bytes with each hash
+    unsigned char *op = dst;
+    size_t anchor = 0, i = 0;
+    while (i + LZ_MIN_MATCH <= n) {
+        uint32_t seq, ref_seq;
+        memcpy(&seq, src + i, 4);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t ref = table[h];
+        table[h] = i + 1;
+        if (ref && i - (ref - 1) <= 0xffff) {
+            memcpy(&ref_seq, src + ref - 1, 4);
+            if (ref_seq == seq) {
+                size_t len = LZ_MIN_MATCH;
+                ref--;
+                while (i + len < n && src[ref + len] == src[i + len]) len++;
+                op = lz_sequence(op, src + anchor, i - anchor, i - ref, len);
+                i += len;
+                anchor = i;
+                continue;
+            }
+        }
+        i += 1 + ((i - anchor) >> 6); // stride ahead through incompressible text
+    }
+    return lz_sequence(op, src + anchor, n - anchor, 0, 0) - dst;
+}
+
+// Returns the size of the text, or -1 if src is not a valid stream for cap bytes
+static long lz_unpack(const unsigned char *src, size_t n, unsigned char *dst, size_t cap) {
+    const unsigned char *ip = src, *end = src + n;
+    unsigned char *op = dst, *oend = dst + cap;
+    while (ip < end) {
+        unsigned int token = *ip++;
+        size_t nlit = token >> 4, match = token & 15;
+        if (nlit == 15) {
+            unsigned int b;
+            do {
+                if (ip == end) return -1;
+                nlit += b = *ip++;
+            } while (b == 255);
+        }
+        if (nlit > (size_t)(end - ip) || nlit > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+        if (ip == end) break;
+
+        if (end - ip < 2) return -1;
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (match == 15) {
+            unsigned int b;
+            do {
+                if (ip == end) return -1;
+                match += b = *ip++;
+            } while (b == 255);
+        }
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - dst) || match > (size_t)(oend - op)) return -1;
+        // An offset shorter than the match repeats a pattern; each copy doubles what can be taken
+        const unsigned char *from = op - offset;
+        while (match > 0) {
+            size_t n = (size_t)(op - from) < match ? (size_t)(op - from) : match;
+            memcpy(op, from, n);
+            op += n;
+            match -= n;
+        }
+    }
+    return op - dst;
+}
+
+static void sb_init(Scrollback *sb, unsigned int max_lines) {
+    memset(sb, 0, sizeof(*sb));
+    sb->max_lines = max_lines > 0 ? max_lines : 1;
+    sb->spill.fd = -1;
+}
+
+static SbBlock *sb_block(const Scrollback *sb, unsigned int n) {
+    return sb->blocks[(sb->block_head + (n - sb->block_first)) & (sb->block_cap - 1)];
+}
+
+static SbBlock *sb_tail_block(const Scrollback *sb) {
+    if (sb->block_count == 0) return NULL;
+    return sb->blocks[(sb->block_head + sb->block_count - 1) & (sb->block_cap - 1)];
+}
+
+// A segment with no blocks left is unmapped and its pages given back
+static void sb_spill_release(SbSpill *sp, long seg) {
+    if (--sp->live[seg - sp->first] > 0) return;
+    while (sp->count > 1 && sp->live[0] == 0) {
+        munmap(sp->maps[0], SB_SPILL_SEGMENT);
+        fallocate(sp->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  (off_t)sp->first * SB_SPILL_SEGMENT, SB_SPILL_SEGMENT);
+        memmove(sp->maps, sp->maps + 1, (sp->count - 1) * sizeof(char *));
+        memmove(sp->live, sp->live + 1, (sp->count - 1) * sizeof(unsigned int));
+        sp->count--;
+        sp->first++;
+    }
+}
+
+// Let go of the compressed copy, wherever it is
+static void sb_drop_packed(Scrollback *sb, SbBlock *blk) {
+    if (!blk->packed) return;
+    if (blk->spill >= 0) {
+        sb_spill_release(&sb->spill, blk->spill);
+    } else {
+        free(blk->packed);
+        sb->packed_bytes -= blk->packed_len;
+    }
+    blk->packed = NULL;
+    blk->spill = -1;
+}
+
+static void sb_drop_data(Scrollback *sb, SbBlock *blk) {
+    if (!blk->data) return;
+    free(blk->data);
+    blk->data = NULL;
+    sb->plain_bytes -= blk->size;
+}
+
+static void sb_free_block(Scrollback *sb, SbBlock *blk) {
+    sb_drop_packed(sb, blk);
+    sb_drop_data(sb, blk);
+    free(blk);
+}
+
+static void sb_free(Scrollback *sb) {
+    for (unsigned int i = 0; i < sb->block_count; i++)
+        sb_free_block(sb, sb->blocks[(sb->block_head + i) & (sb->block_cap - 1)]);
+    for (unsigned int i = 0; i < sb->spill.count; i++)
+        munmap(sb->spill.maps[i], SB_SPILL_SEGMENT);
+    if (sb->spill.fd >= 0) close(sb->spill.fd);
+    free(sb->spill.maps);
+    free(sb->spill.live);
+    free(sb->blocks);
+    free(sb->lines);
+    memset(sb, 0, sizeof(*sb));
+    sb->spill.fd = -1;
+}
+
+// Give a cold block its text back; NULL if that fails
+static char *sb_thaw(Scrollback *sb, SbBlock *blk) {
+    if (blk->data) return blk->data;
+    char *data = malloc(blk->size);
+    if (!data) return NULL;
+    if (lz_unpack((const unsigned char *)blk->packed, blk->packed_len, (unsigned char *)data, blk->used) !=
+        (long)blk->used) {
+        free(data);
+        return NULL;
+    }
+    blk->data = data;
+    sb->plain_bytes += blk->size;
+    sb_cooling = 1;   // to be dropped again once it is off screen
+    return data;
+}
+
+// Absolute number one past the newest line; stable across evictions
+static unsigned long sb_end(const Scrollback *sb) {
+    return sb->first + sb->count;
+}
+
+static unsigned int sb_line_block(const Scrollback *sb, unsigned int i) {
+    return sb->lines[(sb->head + i) & (sb->line_cap - 1)].block;
+}
+
+// i counts from the oldest retained line.  A cold block is decompressed;
+// the text stays valid until the next scrollback_step().
+static const char *sb_line(Scrollback *sb, unsigned int i, size_t *len, unsigned int *flags) {
+    const SbLine *ln = &sb->lines[(sb->head + i) & (sb->line_cap - 1)];
+    const char *data = sb_thaw(sb, sb_block(sb, ln->block));
+    *len = data ? ln->len : 0;
+    if (flags) *flags = data ? ln->flags : 0;
+    return data ? data + ln->off : "";
+}
+
+static void sb_evict(Scrollback *sb) {
+    const SbLine *ln = &sb->lines[sb->head];
+    unsigned int live = --sb_block(sb, ln->block)->live;
+    sb->head = (sb->head + 1) & (sb->line_cap - 1);
+    sb->count--;
+    sb->first++;
+    if (live > 0) return;
+
+    // Release leading blocks with no lines left; the tail block is kept for appending
+    while (sb->block_count > 1 && sb->blocks[sb->block_head]->live == 0) {
+        sb_free_block(sb, sb->blocks[sb->block_head]);
+        sb->blocks[sb->block_head] = NULL;
+        sb->block_head = (sb->block_head + 1) & (sb->block_cap - 1);
+        sb->block_count--;
+        sb->block_first++;
+    }
+}
+
+static int sb_grow_lines(Scrollback *sb) {
+    unsigned int cap = sb->line_cap ? sb->line_cap * 2 : 256;
+    SbLine *lines = malloc(cap * sizeof(SbLine));
+    if (!lines) return -1;
+    for (unsigned int i = 0; i < sb->count; i++)
+        lines[i] = sb->lines[(sb->head + i) & (sb->line_cap - 1)];
+    free(sb->lines);
+    sb->lines = lines;
+    sb->line_cap = cap;
+    sb->head = 0;
+    return 0;
+}
+
+static SbBlock *sb_new_block(Scrollback *sb, size_t len) {
+    if (sb->block_count == sb->block_cap) {
+        unsigned int cap = sb->block_cap ? sb->block_cap * 2 : 16;
+        SbBlock **blocks = malloc(cap * sizeof(SbBlock *));
+        if (!blocks) return NULL;
+        for (unsigned int i = 0; i < sb->block_count; i++)
+            blocks[i] = sb->blocks[(sb->block_head + i) & (sb->block_cap - 1)];
+        free(sb->blocks);
+        sb->blocks = blocks;
+        sb->block_cap = cap;
+        sb->block_head = 0;
+    }
+
+    size_t size = len > SB_BLOCK_SIZE ? len : SB_BLOCK_SIZE;
+    SbBlock *blk = calloc(1, sizeof(SbBlock));
+    if (!blk) return NULL;
+    blk->data = malloc(size);
+    if (!blk->data) {
+        free(blk);
+        return NULL;
+    }
+    blk->size = size;
+    blk->spill = -1;
+    sb->plain_bytes += size;
+    sb->blocks[(sb->block_head + sb->block_count) & (sb->block_cap - 1)] = blk;
+    sb->block_count++;
+    if (sb->block_count > 1) sb_cooling = 1;   // the block before it is complete
+    return blk;
+}
+
+// Append a line, evicting the oldest one when full. Returns the number of lines evicted.
+static int sb_push(Scrollback *sb, const char *text, size_t len, unsigned int flags) {
+    int evicted = 0;
+    if (sb->count >= sb->max_lines) {
+        sb_evict(sb);
+        evicted = 1;
+    }
+    if (sb->count == sb->line_cap && sb_grow_lines(sb) < 0) return evicted;
+
+    SbBlock *blk = sb_tail_block(sb);
+    if (blk && blk->live == 0) blk->used = 0; // only ever the sole, empty block
+    if (!blk || !blk->data || blk->size - blk->used < len) {
+        if (blk && blk->live == 0) {
+            // Too small to reuse: drop it rather than leave an empty block behind
+            sb_free_block(sb, blk);
+            sb->block_count = 0;
+            sb->block_first++;
+        }
+        blk = sb_new_block(sb, len);
+        if (!blk) return evicted;
+    }
+
+    SbLine *ln = &sb->lines[(sb->head + sb->count) & (sb->line_cap - 1)];
+    ln->block = sb->block_first + sb->block_count - 1;
+    ln->off = blk->used;
+    ln->len = len;
+    ln->flags = flags;
+    memcpy(blk->data + blk->used, text, len);
+    blk->used += len;
+    blk->live++;
+    sb->count++;
+    return evicted;
+}
+
+// Drop the newest lines so that sb_end() == end
+static void sb_truncate(Scrollback *sb, unsigned long end) {
+    while (sb->count > 0 && sb_end(sb) > end) {
+        const SbLine *ln = &sb->lines[(sb->head + sb->count - 1) & (sb->line_cap - 1)];
+        SbBlock *blk = sb_tail_block(sb);
+        blk->live--;
+        blk->used = ln->off;
+        sb->count--;
+        if (blk->live == 0 && sb->block_count > 1) {
+            sb_free_block(sb, blk);
+            sb->block_count--;
+            // The block before becomes the one appended to, so it must be plain again
+            blk = sb_tail_block(sb);
+            if (sb_thaw(sb, blk)) sb_drop_packed(sb, blk);
+        }
+    }
+}
+
+// Copy a compressed block into the spill file; 0 if it was moved
+static int sb_spill(Scrollback *sb, SbBlock *blk) {
+    SbSpill *sp = &sb->spill;
+    if (blk->packed_len > SB_SPILL_SEGMENT) return -1;
+    if (sp->fd < 0) {
+        const char *dir = getenv("TMPDIR");
+        sp->fd = open(dir && *dir ? dir : "/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (sp->fd < 0) return -1;
+    }
+    if (sp->count == 0 || sp->used + blk->packed_len > SB_SPILL_SEGMENT) {
+        if (sp->count == sp->cap) {
+            unsigned int cap = sp->cap ? sp->cap * 2 : 8;
+            char **maps = realloc(sp->maps, cap * sizeof(char *));
+            if (maps) sp->maps = maps;
+            unsigned int *live = realloc(sp->live, cap * sizeof(unsigned int));
+            if (live) sp->live = live;
+            if (!maps || !live) return -1;
+            sp->cap = cap;
+        }
+        long seg = sp->first + sp->count;
+        off_t off = (off_t)seg * SB_SPILL_SEGMENT;
+        if (ftruncate(sp->fd, off + SB_SPILL_SEGMENT) < 0) return -1;
+        char *map = mmap(NULL, SB_SPILL_SEGMENT, PROT_READ | PROT_WRITE, MAP_SHARED, sp->fd, off);
+        if (map == MAP_FAILED) return -1;
+        sp->maps[sp->count] = map;
+        sp->live[sp->count] = 0;
+        sp->count++;
+        sp->used = 0;
+    }
+    char *dst = sp->maps[sp->count - 1] + sp->used;
+    memcpy(dst, blk->packed, blk->packed_len);
+    sp->used += blk->packed_len;
+    sp->live[sp->count - 1]++;
+    free(blk->packed);
+    sb->packed_bytes -= blk->packed_len;
+    blk->packed = dst;
+    blk->spill = sp->first + sp->count - 1;
+    return 0;
+}
+
+// Compress a block, keeping its plain text if compressing it fails
+static int sb_pack(Scrollback *sb, SbBlock *blk) {
+    if (!blk->packed) {
+        char *out = malloc(blk->used + blk->used / 255 + 16);
+        if (!out) return -1;
+        size_t n = lz_pack((const unsigned char *)blk->data, blk->used, (unsigned char *)out);
+        char *fit = realloc(out, n ? n : 1);
+        blk->packed = fit ? fit : out;
+        blk->packed_len = n;
+        sb->packed_bytes += n;
+    }
+    sb_drop_data(sb, blk);
+    return 0;
+}
+
+// One piece of cold-scrollback work: drop decompressed copies outside blocks
+// [keep_lo, keep_hi], compress the oldest plain block outside them, or spill
+// the oldest compressed block when over budget.  Returns 0 when nothing was
+// left to do.
+static int sb_cool(Scrollback *sb, unsigned int keep_lo, unsigned int keep_hi) {
+    if (sb->block_count < 2) return 0;
+    unsigned int tail = sb->block_first + sb->block_count - 1;
+    SbBlock *pack = NULL, *spill = NULL;
+    for (unsigned int n = sb->block_first; n < tail; n++) {
+        if (n >= keep_lo && n <= keep_hi) continue;
+        SbBlock *blk = sb_block(sb, n);
+        if (blk->data && blk->packed) sb_drop_data(sb, blk);
+        else if (blk->data && !pack) pack = blk;
+        else if (blk->packed && blk->spill < 0 && !spill) spill = blk;
+    }
+    if (pack) return sb_pack(sb, pack) == 0;
+    if (spill && sb->packed_bytes > scrollback_ram) return sb_spill(sb, spill) == 0;
+    return 0;
+}
+
+/* ---- Screen model ----
+ * Child output is interpreted by a VT100/xterm escape-sequence parser that
+ * writes into a grid of cells shown right below the scrollback.  Rows that
+ * scroll off the top of the grid move into the scrollback with their colours.
+ * Rows are kept in a ring (base), so scrolling the whole screen is O(1).
+ */
+typedef uint32_t Cell; // character in the low byte, attributes above
+
+#define ATTR_BOLD      0x0100
+#define ATTR_UNDERLINE 0x0200
+#define ATTR_REVERSE   0x0400
+#define ATTR_FG        0x1000 // palette index in bits 16-23 is the foreground
+#define ATTR_BG        0x2000 // palette index in bits 24-31 is the background
+#define ATTR_MASK      0xffffff00u
+#define BLANK_CELL     ((Cell)' ')
+
+#define VT_MAX_PARAMS 16
+#define VT_OSC_MAX 256
+#define PROMPT_OSC "777;myterm;prompt" // the shell's PS1 (see pty_spawn_shell)
+
+typedef struct {
+    Cell *cells;      // rows * cols, row r stored at slot (base + r) % rows
+    int *extent;      // per stored row: cells at or past this column are stale
+    Cell *alt_cells;  // primary screen while the alternate screen is shown
+    int *alt_extent;
+    int alt_base, alt_used;
+    int rows, cols;
+    int base;
+    int used;         // rows shown below the scrollback
+    int cx, cy;       // cursor
+    int wrap_pending; // a character was written to the last column
+    int top, bottom;  // scroll region
+    uint32_t attr;    // attributes for new characters
+    int saved_cx, saved_cy;
+    uint32_t saved_attr;
+    int alt;          // alternate screen is shown
+    int autowrap;
+    int newline_mode; // LF also returns the carriage
+    int discard;      // rows scrolled off the top are dropped (see script_parse)
+    unsigned char *scratch; // row encoding buffer for the scrollback
+
+    // parser state
+    unsigned char state;
+    int params[VT_MAX_PARAMS];
+    int nparams;
+    char private_marker;
+    char intermediate;
+    char osc[VT_OSC_MAX];
+    int osc_len;
+    uint32_t utf8_cp;
+    int utf8_left;
+} VtScreen;
+
+// Storage index of row r; base and r are both below rows
+static int screen_slot(const VtScreen *sc, int r) {
+    int i = sc->base + r;
+    return i >= sc->rows ? i - sc->rows : i;
+}
+
+static Cell *screen_row(const VtScreen *sc, int r) {
+    return sc->cells + (size_t)screen_slot(sc, r) * sc->cols;
+}
+
+static int *screen_extent(const VtScreen *sc, int r) {
+    return &sc->extent[screen_slot(sc, r)];
+}
+
+// Length of row r without trailing blanks
+static int screen_row_len(const VtScreen *sc, int r) {
+    const Cell *c = screen_row(sc, r);
+    int n = *screen_extent(sc, r);
+    while (n > 0 && c[n - 1] == BLANK_CELL) n--;
+    return n;
+}
+
+// Most output is plain ASCII, so it is scanned and copied 16 bytes at a time
+#ifdef __SSE2__
+// Number of leading bytes in 0x20..0x7e
+static size_t printable_run(const unsigned char *s, size_t n) {
+    const __m128i lo = _mm_set1_epi8(0x1f), hi = _mm_set1_epi8(0x7f);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        // Signed compares: bytes >= 0x80 are negative and fail the first test
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+        unsigned mask = _mm_movemask_epi8(ok);
+        if (mask != 0xffff) return i + __builtin_ctz(~mask);
+    }
+    while (i < n && s[i] >= 0x20 && s[i] < 0x7f) i++;
+    return i;
+}
+
+// Widen n bytes into cells carrying attr
+static void fill_cells(Cell *c, const unsigned char *s, size_t n, uint32_t attr) {
+    const __m128i zero = _mm_setzero_si128(), a = _mm_set1_epi32(attr);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i w0 = _mm_unpacklo_epi8(v, zero), w1 = _mm_unpackhi_epi8(v, zero);
+        _mm_storeu_si128((__m128i *)(c + i), _mm_or_si128(_mm_unpacklo_epi16(w0, zero), a));
+        _mm_storeu_si128((__m128i *)(c + i + 4), _mm_or_si128(_mm_unpackhi_epi16(w0, zero), a));
+        _mm_storeu_si128((__m128i *)(c + i + 8), _mm_or_si128(_mm_unpacklo_epi16(w1, zero), a));
+        _mm_storeu_si128((__m128i *)(c + i + 12), _mm_or_si128(_mm_unpackhi_epi16(w1, zero), a));
+    }
+    for (; i < n; i++) c[i] = attr | s[i];
+}
+
+// Narrow n cells to their characters; returns the OR of all cells
+static uint32_t cells_to_bytes(unsigned char *out, const Cell *c, size_t n) {
+    const __m128i low = _mm_set1_epi32(0xff);
+    __m128i any = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(c + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(c + i + 4));
+        __m128i d = _mm_loadu_si128((const __m128i *)(c + i + 8));
+        __m128i e = _mm_loadu_si128((const __m128i *)(c + i + 12));
+        any = _mm_or_si128(any, _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(d, e)));
+        __m128i w0 = _mm_packs_epi32(_mm_and_si128(a, low), _mm_and_si128(b, low));
+        __m128i w1 = _mm_packs_epi32(_mm_and_si128(d, low), _mm_and_si128(e, low));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(w0, w1));
+    }
+    any = _mm_or_si128(any, _mm_shuffle_epi32(any, _MM_SHUFFLE(1, 0, 3, 2)));
+    any = _mm_or_si128(any, _mm_shuffle_epi32(any, _MM_SHUFFLE(2, 3, 0, 1)));
+    uint32_t acc = _mm_cvtsi128_si32(any);
+    for (; i < n; i++) {
+        out[i] = c[i] & 0xff;
+        acc |= c[i];
+    }
+    return acc;
+}
+#else
+static size_t printable_run(const unsigned char *s, size_t n) {
+    size_t i = 0;
+    while (i < n && s[i] >= 0x20 && s[i] < 0x7f) i++;
+    return i;
+}
+
+static void fill_cells(Cell *c, const unsigned char *s, size_t n, uint32_t attr) {
+    for (size_t i = 0; i < n; i++) c[i] = attr | s[i];
+}
+
+static uint32_t cells_to_bytes(unsigned char *out, const Cell *c, size_t n) {
+    uint32_t acc = 0;
+    for (size_t i = 0; i < n; i++) {
+        out[i] = c[i] & 0xff;
+        acc |= c[i];
+    }
+    return acc;
+}
+#endif
+
 /* ---- Tab structure ---- */
+struct Tab;
+typedef struct Watch Watch;
+
+// What a descriptor in the event loop's epoll set belongs to
 typedef struct {
+    int kind;                 // SRC_* (see the Event loop section)
+    struct Tab *tab;
+    int index;
+} EventSource;
+
+// A tab's rendered window and what it holds (see Back buffer)
+typedef struct {
+    Pixmap pixmap;            // None until first painted, and after surface_evict
+    char *cells;              // without X: a text grid instead (see Headless mode)
+    int cols, rows;
+    struct Tab *tab;          // tab whose rows it holds; NULL repaints everything
+    Watch *watch;             // multiWatch whose panes it holds
+    unsigned long top;        // absolute row at the top of the view
+    int scroll_x;
+    int alt;
+    int width, height;
+    int total_tabs, current_tab;
+    unsigned long shown;      // window_clock when it was last put in the window
+} Surface;
+
+typedef struct Tab {
     pid_t shell_pid;
-    int pipefd[2];
-    char lines[MAX_LINES][MAX_LINE_LEN];
-    int isCommand[MAX_LINES];
-    int current_line;
+    int pty;                  // master side of the shell's terminal, or -1
+    EventSource pty_src;
+    char *pty_out;            // input the shell has not taken yet (see tab_pty_write)
+    size_t pty_out_len, pty_out_cap;
+    int pty_waiting;          // EPOLLOUT is armed
+    int echo;                 // terminal echo is on (only while a command runs)
+    Scrollback sb;
+    char input[MAX_LINE_LEN]; // line being edited below the scrollback
+    int input_is_command;     // input is shown after the prompt
+    VtScreen screen;          // output of the running command
+    int busy;                 // a command is running; its screen replaces the input row
     int cursor_pos;
     char command[1000];
     int scroll_y; // <--- vertical scroll offset (in lines)
     int scroll_x; // <--- horizontal scroll offset (in characters)
     char selection_input[10];
     int selection_input_pos;
+    // Damage: absolute row numbers (scrollback lines, then the input row) needing repaint
+    unsigned long dirty_first;
+    unsigned long dirty_last;
+    char drawn_input[MAX_LINE_LEN]; // input line as last painted
+    int drawn_input_is_command;
+    unsigned long drawn_input_row;
+    Watch *watch;             // multiWatch running in this tab, or NULL
+    Surface surface;
 } Tab;
 
-static Tab tabs[MAX_TABS];
+static Tab **tabs = NULL;   // the open tabs, each allocated on its own (see create_new_tab)
+static int tabs_cap = 0;
 static int current_tab = 0;
-static int total_tabs = 1;
-
-volatile sig_atomic_t current_child_pid = -1;
+static int total_tabs = 0;
 
-pid_t background_jobs[100];
-int bg_count = 0;
 
 static int cursor_visible = 1;
 static time_t last_cursor_blink = 0;
@@ -96,801 +763,4001 @@ static GC create_gc(Window win) {
     values.foreground = BlackPixel(dpy, screen);
     values.background = WhitePixel(dpy, screen);
     values.line_width = 2;
-    unsigned long mask = GCForeground | GCBackground | GCLineWidth;
+    values.graphics_exposures = False; // XCopyArea from the back buffer never needs them
+    unsigned long mask = GCForeground | GCBackground | GCLineWidth | GCGraphicsExposures;
     return XCreateGC(dpy, win, mask, &values);
 }
 
-static void draw_tabs(Window win, GC gc) {
-    // Get font metrics to calculate proper sizes
-    XFontStruct *font = XQueryFont(dpy, XGContextFromGC(gc));
-    int font_height = 15; // default fallback
-    int char_width = 8;   // default fallback
-    
-    if (font) {
-        font_height = font->ascent + font->descent;
-        char_width = font->max_bounds.width;
-    }
-    
-    int x = 10, y = 15 + font_height; // Position tabs lower to account for taller font
-    int tab_width = char_width * 8;   // Adjust tab width based on font
-    int tab_height = font_height + 4; // Add some padding
-    
-    for (int i = 0; i < total_tabs; i++) {
-        char label[20];
-        sprintf(label, "[Tab %d]", i + 1);
-        
-        if (i == current_tab) {
-            // Draw rectangle around current tab - adjust size for font
-            XDrawRectangle(dpy, win, gc, x - 5, y - font_height - 2, 
-                          tab_width, tab_height);
-        }
-        
-        XDrawString(dpy, win, gc, x, y, label, strlen(label));
-        x += tab_width + 10; // Add spacing between tabs
-    }
+/* ---- Font metrics ----
+ * Resolved once when the font is loaded; all layout works from these values,
+ * so painting never has to ask the server about the font.
+ */
+#define DEFAULT_FONT "10x20"
+
+typedef struct {
+    XFontStruct *font;
+    int ascent;
+    int descent;
+    int line_height;  // ascent + descent
+    int char_width;   // cell advance used for the text grid
+    int advance[256]; // per-glyph advance
+    int tab_width;    // width of a tab label in the tab bar
+} FontMetrics;
+
+static FontMetrics fm;
+
+static void invalidate_window(void);
+
+static int text_width(const char *s, int len) {
+    int w = 0;
+    for (int i = 0; i < len; i++) w += fm.advance[(unsigned char)s[i]];
+    return w;
 }
 
-static void draw_text(Window win, GC gc, Tab *tab) {
-    XClearWindow(dpy, win);
-    draw_tabs(win, gc);
+// Load a font into gc and recompute the metrics; falls back to "fixed"
+static int load_font(GC gc, const char *name) {
+    XFontStruct *font = XLoadQueryFont(dpy, name);
+    if (!font) font = XLoadQueryFont(dpy, "fixed");
+    if (!font) return -1;
 
-    int y_start = 40;
-    int line_height = 20;
-    int visible_lines = (win_height - y_start) / line_height - 1;
+    if (fm.font) XFreeFont(dpy, fm.font);
+    fm.font = font;
+    XSetFont(dpy, gc, font->fid);
 
-    int first_line = tab->scroll_y;
-    int last_line = tab->scroll_y + visible_lines;
-    if (last_line > tab->current_line) last_line = tab->current_line;
+    fm.ascent = font->ascent;
+    fm.descent = font->descent;
+    fm.line_height = font->ascent + font->descent;
+    fm.char_width = font->max_bounds.width > 0 ? font->max_bounds.width : 1;
+    for (int c = 0; c < 256; c++) {
+        fm.advance[c] = fm.char_width;
+        if (font->per_char && c >= (int)font->min_char_or_byte2 && c <= (int)font->max_char_or_byte2)
+            fm.advance[c] = font->per_char[c - font->min_char_or_byte2].width;
+    }
+    fm.tab_width = text_width("[Tab 00]", 8);
 
-    // Calculate maximum characters that can fit horizontally
-    int char_width = 8; // Approximate character width
-    int max_chars = (win_width - 20) / char_width; // 20px margin
+    invalidate_window();
+    return 0;
+}
 
-    for (int i = first_line; i <= last_line; i++) {
-        char display_line[MAX_LINE_LEN + 40];
-        if (tab->isCommand[i])
-            snprintf(display_line, sizeof(display_line), "user@myterm> %s", tab->lines[i]);
-        else
-            snprintf(display_line, sizeof(display_line), "%s", tab->lines[i]);
+// Without a display: fixed-width cells the size of the default font
+static void fixed_metrics(void) {
+    fm.ascent = 16;
+    fm.descent = 4;
+    fm.line_height = 20;
+    fm.char_width = 10;
+    for (int c = 0; c < 256; c++) fm.advance[c] = fm.char_width;
+    fm.tab_width = text_width("[Tab 00]", 8);
+}
 
-        int len = strlen(display_line);
-        
-        // Handle horizontal scrolling and truncation if needed
-        char *display_start = display_line + tab->scroll_x;
-        int display_len = len - tab->scroll_x;
-        
-        // Truncate if too long for window
-        if (display_len > max_chars) {
-            display_len = max_chars;
-        }
-        
-        if (display_len > 0) {
-            XDrawString(dpy, win, gc, 10, y_start + (i - first_line + 1) * line_height,
-                        display_start, display_len);
+/* ---- Colours ----
+ * The xterm 256-colour palette; a pixel is allocated the first time an index
+ * is used and kept for the life of the program.
+ */
+static unsigned long color_pixel(int idx) {
+    static const unsigned char base16[16][3] = {
+        {0, 0, 0}, {205, 0, 0}, {0, 205, 0}, {205, 205, 0},
+        {0, 0, 238}, {205, 0, 205}, {0, 205, 205}, {229, 229, 229},
+        {127, 127, 127}, {255, 0, 0}, {0, 255, 0}, {255, 255, 0},
+        {92, 92, 255}, {255, 0, 255}, {0, 255, 255}, {255, 255, 255},
+    };
+    static unsigned long pixel[256];
+    static unsigned char loaded[256];
+
+    if (!loaded[idx]) {
+        int r, g, b;
+        if (idx < 16) {
+            r = base16[idx][0]; g = base16[idx][1]; b = base16[idx][2];
+        } else if (idx < 232) {
+            // 6x6x6 colour cube
+            int i = idx - 16;
+            r = i / 36 ? i / 36 * 40 + 55 : 0;
+            g = i / 6 % 6 ? i / 6 % 6 * 40 + 55 : 0;
+            b = i % 6 ? i % 6 * 40 + 55 : 0;
+        } else {
+            r = g = b = (idx - 232) * 10 + 8; // grey ramp
         }
+        XColor xc;
+        xc.red = r * 257;
+        xc.green = g * 257;
+        xc.blue = b * 257;
+        xc.flags = DoRed | DoGreen | DoBlue;
+        pixel[idx] = XAllocColor(dpy, DefaultColormap(dpy, screen), &xc) ? xc.pixel : BlackPixel(dpy, screen);
+        loaded[idx] = 1;
     }
+    return pixel[idx];
+}
 
-    XFlush(dpy);
+/* ---- Layout ---- */
+// Baseline of the tab labels; the text area starts below the tab bar
+static int tab_bar_baseline(void) {
+    return 15 + fm.line_height; // Position tabs lower to account for taller font
 }
 
-/* ---- Tab / Shell initialization ---- */
-static void init_tab(Tab *tab) {
-    memset(tab, 0, sizeof(Tab));
-    for (int i = 0; i < MAX_LINES; i++) tab->isCommand[i] = 1;
-
-    pipe(tab->pipefd);
-    tab->shell_pid = fork();
-    if (tab->shell_pid == 0) {
-        dup2(tab->pipefd[1], STDOUT_FILENO);
-        dup2(tab->pipefd[1], STDERR_FILENO);
-        close(tab->pipefd[0]);
-        execlp("sh", "sh", NULL);
-        exit(1);
-    }
-    close(tab->pipefd[1]);
-    tab->scroll_y = 0;
-    tab->scroll_x = 0;
-    
-    // Initialize selection state
-    tab->selection_input[0] = '\0';
-    tab->selection_input_pos = 0;
+static int tab_bar_height(void) {
+    return tab_bar_baseline() + fm.descent + 1;
 }
-/* ---- Output handling ---- */
-static void draw_output(Window win, GC gc, Tab *tab, const char *output) {
-    if (!output || !*output) return;
 
-    char *buf = strdup(output);
-    if (!buf) return;
+// Characters that fit across the window
+static int text_columns(void) {
+    return (win_width - 20) / fm.char_width; // 20px margin
+}
+
+// Number of rows below the top one that fit in the window
+static int view_lines(void) {
+    return (win_height - tab_bar_height()) / fm.line_height - 1;
+}
+
+// Index of the tab whose label is at (x, y), or -1
+static int tab_at(int x, int y) {
+    if (y >= tab_bar_height()) return -1;
+    int i = (x - 5) / (fm.tab_width + 10);
+    return (x >= 5 && i < total_tabs) ? i : -1;
+}
+
+/* ---- Damage tracking ----
+ * Rows are addressed by absolute number (sb.first + index, the input row
+ * being sb_end()), which stays valid when old lines are evicted.  draw_text()
+ * repaints only damaged rows unless the view itself moved or the tab's
+ * surface holds something else, in which case all of it is redrawn.
+ */
+static int surfaces_stale = 0; // a background tab has damage to paint (see surface_step)
+
+/* ---- Frame scheduling ----
+ * Child output can arrive far faster than the screen can usefully change, so
+ * it is taken into the scrollback as it comes and painted at most once per
+ * FRAME_INTERVAL_MS; the frames in between are simply skipped.
+ */
+#define FRAME_INTERVAL_MS 16
+
+static int frame_pending = 0;
+static long long last_frame_ms = 0;
+static int input_batch = 0;   // handling queued input: draw_text() only marks a frame (see input_end)
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
 
-    char *saveptr = NULL;
-    char *line = strtok_r(buf, "\n", &saveptr);
-    int idx = tab->current_line;
+// Milliseconds until the pending frame is due, or -1 if nothing is waiting
+static int frame_timeout(void) {
+    if (!frame_pending) return -1;
+    long long due = last_frame_ms + FRAME_INTERVAL_MS - now_ms();
+    return due > 0 ? (int)due : 0;
+}
 
-    while (line && idx < MAX_LINES - 1) {
-        idx++;
-        strncpy(tab->lines[idx], line, MAX_LINE_LEN - 1);
-        tab->lines[idx][MAX_LINE_LEN - 1] = '\0';
-        tab->isCommand[idx] = 0;
-        line = strtok_r(NULL, "\n", &saveptr);
+static void tab_damage(Tab *tab, unsigned long first, unsigned long last) {
+    if (total_tabs && tab != tabs[current_tab]) surfaces_stale = 1;
+    if (tab->dirty_first > tab->dirty_last) {
+        tab->dirty_first = first;
+        tab->dirty_last = last;
+        return;
     }
+    if (first < tab->dirty_first) tab->dirty_first = first;
+    if (last > tab->dirty_last) tab->dirty_last = last;
+}
 
-    tab->current_line = idx;
-    tab->isCommand[tab->current_line + 1] = 1;
-    draw_text(win, gc, tab);
-    free(buf);
+static void tab_clear_damage(Tab *tab) {
+    tab->dirty_first = 1;
+    tab->dirty_last = 0;
 }
 
-void create_new_tab(int *tab_count, Tab tabs[], int *current_tab) {
-    if (*tab_count >= MAX_TABS) return; // avoid overflow
+#define NO_ROW ((unsigned long)-1)
 
-    (*tab_count)++;
-    *current_tab = *tab_count - 1;
+// Rows after the scrollback: the running command's screen, otherwise the input line
+static int tab_tail_rows(const Tab *tab) {
+    return tab->busy ? tab->screen.used : 1;
+}
 
-    Tab *new_tab = &tabs[*current_tab];
-    memset(new_tab, 0, sizeof(Tab));
-    new_tab->current_line = 0;
-    new_tab->cursor_pos = 0;
-    new_tab->isCommand[0] = 1;
+static int tab_rows(const Tab *tab) {
+    return tab->sb.count + tab_tail_rows(tab);
 }
-// Execute a piped command string like "ls | wc -l | sort"
-void execute_piped_command(char *full_command)
-{
-    char *commands[20];
-    int num_cmds = 0;
-    char *saveptr;
 
-    // Split by '|'
-    char *token = strtok_r(full_command, "|", &saveptr);
-    while (token && num_cmds < 20)
-    {
-        while (*token == ' ') token++; // trim leading spaces
-        commands[num_cmds++] = token;
-        token = strtok_r(NULL, "|", &saveptr);
-    }
+// The last row is within view + 1 rows from the top of the view
+static int tab_follows(const Tab *tab, int view) {
+    int last = tab_rows(tab) - 1;
+    return last >= tab->scroll_y && last <= tab->scroll_y + view;
+}
 
-    int pipefd[2 * (num_cmds - 1)];
+// The last row is on screen, so new output should keep it there
+static int tab_following(const Tab *tab) {
+    return tab_follows(tab, view_lines());
+}
 
-    // Create required pipes
-    for (int i = 0; i < num_cmds - 1; i++)
-    {
-        if (pipe(pipefd + i * 2) < 0)
-        {
-            perror("pipe");
-            exit(1);
-        }
-    }
+static void tab_follow(Tab *tab) {
+    int last = tab_rows(tab) - 1;
+    if (last > tab->scroll_y + view_lines())
+        tab->scroll_y = last - view_lines();
+}
 
-    // Fork for each command
-    for (int i = 0; i < num_cmds; i++)
-    {
-        pid_t pid = fork();
-        if (pid == 0)
-        {
-            // --- Input redirection for intermediate commands ---
-            if (i > 0)
-            {
-                dup2(pipefd[(i - 1) * 2], STDIN_FILENO);
-            }
+// Cold-scrollback work for a tab (see sb_cool).  The blocks on screen and a
+// screenful either side stay plain, so scrolling never waits for them.
+static int tab_cool(Tab *tab) {
+    Scrollback *sb = &tab->sb;
+    if (sb->count == 0) return 0;
+    int lo = tab->scroll_y - view_lines() - 1, hi = tab->scroll_y + 2 * view_lines() + 1;
+    if (hi > (int)sb->count - 1) hi = sb->count - 1;
+    if (lo > hi) lo = hi;
+    if (lo < 0) lo = 0;
+    return sb_cool(sb, sb_line_block(sb, lo), sb_line_block(sb, hi));
+}
 
-            // --- Output redirection for intermediate commands ---
-            if (i < num_cmds - 1)
-            {
-                dup2(pipefd[i * 2 + 1], STDOUT_FILENO);
-            }
+// Idle work: a step for every tab; 0 once none has anything left to do.
+// The freed blocks are scattered through the heap, so the pages they held
+// are handed back to the kernel at the end.
+static int scrollback_step(void) {
+    int more = 0;
+    for (int i = 0; i < total_tabs; i++) more |= tab_cool(tabs[i]);
+    if (!more) malloc_trim(0);
+    return more;
+}
 
-            // Close all pipes in child
-            for (int j = 0; j < 2 * (num_cmds - 1); j++)
-                close(pipefd[j]);
+/* ---- Back buffer ----
+ * Everything is rendered into a server-side Pixmap and copied to the window,
+ * so the window never shows a cleared-but-not-yet-drawn state, scrolling is a
+ * XCopyArea of rows already drawn, and Expose is answered with a blit.
+ *
+ * Every tab has its own Surface.  Output in a background tab is painted into
+ * it when the event loop is idle (see surface_step), so switching tabs only
+ * repaints the tab bar and copies the surface to the window.  Pixmaps past
+ * SURFACE_CACHE_BYTES are freed, least recently shown first, and painted
+ * again in full when their tab is shown.  A session front end has a single
+ * back buffer, so in a session daemon all tabs share one Surface.
+ */
+#define SURFACE_CACHE_BYTES (64 * 1024 * 1024)
+
+static Pixmap backbuf = None;           // the pixmap painted into (see use_surface)
+static GC clear_gc;                     // fills with the background colour
+static Surface *target = NULL;          // the surface painted into
+static Surface shared_surface;          // in a session daemon and its front end
+static Surface *window_surface = NULL;  // the surface the window shows
+static unsigned long window_clock = 0;
+
+/* ---- Paint primitives ----
+ * Everything that reaches the back buffer or the window goes through these.
+ * In a session daemon (see Sessions) there is no X connection: each call is
+ * encoded as a PaintOp and sent to the attached front end, which replays it
+ * on its own back buffer with the same functions.  Text travels with its
+ * attributes, so colours are resolved where the pixels are.  In headless
+ * mode (see Headless mode) the ops are applied to in-memory text grids.
+ */
+enum {
+    PAINT_TEXT, PAINT_CLEAR, PAINT_COPY, PAINT_FRAME, PAINT_LINE, PAINT_PRESENT, PAINT_FLUSH,
+    SESSION_EXIT, SESSION_DETACH,                                  // daemon to front end
+    SESSION_HELLO, SESSION_KEY, SESSION_BUTTON, SESSION_RESIZE,   // front end to daemon
+};
 
-            // Execute the command
-            execlp("sh", "sh", "-c", commands[i], NULL);
-            perror("execlp");
-            exit(1);
-        }
+typedef struct {
+    uint16_t op;
+    uint16_t len;      // bytes of payload after the header
+    int16_t a[6];      // coordinates, or for SESSION_KEY a[0] = modifier state
+    uint32_t attr;     // PAINT_TEXT attributes, SESSION_KEY keysym
+} PaintOp;
+
+#define SESSION_BACKLOG (256 * 1024) // unsent paint bytes at which frames are held back
+
+#define HEADLESS_SESSION 1   // session daemon: paint into session_out
+#define HEADLESS_SCRIPT 2    // myTerm -H: paint into text grids
+
+static int headless = 0;           // no X connection: HEADLESS_SESSION or HEADLESS_SCRIPT
+static int session_fd = -1;        // attached front end, or -1
+static char *session_out = NULL;   // paint ops not yet sent to it
+static size_t session_out_len = 0, session_out_cap = 0;
+
+static void session_send(void);
+static void surface_apply(const PaintOp *m, const char *data);
+
+static void session_op(int op, int a0, int a1, int a2, int a3, int a4, int a5, uint32_t attr,
+                       const void *data, size_t len) {
+    PaintOp m = { op, len, { a0, a1, a2, a3, a4, a5 }, attr };
+    if (headless == HEADLESS_SCRIPT) {
+        surface_apply(&m, data);
+        return;
     }
+    if (session_fd < 0) return;
+    if (session_out_len + sizeof(m) + len > session_out_cap) {
+        size_t cap = session_out_cap ? session_out_cap : 64 * 1024;
+        while (session_out_len + sizeof(m) + len > cap) cap *= 2;
+        char *grown = realloc(session_out, cap);
+        if (!grown) return;
+        session_out = grown;
+        session_out_cap = cap;
+    }
+    memcpy(session_out + session_out_len, &m, sizeof(m));
+    if (len) memcpy(session_out + session_out_len + sizeof(m), data, len);
+    session_out_len += sizeof(m) + len;
+}
 
-    // Close all pipes in parent
-    for (int i = 0; i < 2 * (num_cmds - 1); i++)
-        close(pipefd[i]);
+// Nobody to paint for, or the front end is still behind; damage is kept
+// and the next frame paints it
+static int paint_held(void) {
+    return headless == HEADLESS_SESSION && (session_fd < 0 || session_out_len >= SESSION_BACKLOG);
+}
 
-    // Wait for all children
-    for (int i = 0; i < num_cmds; i++)
-        wait(NULL);
+static void paint_clear(int x, int y, int w, int h) {
+    if (headless) session_op(PAINT_CLEAR, x, y, w, h, 0, 0, 0, NULL, 0);
+    else XFillRectangle(dpy, backbuf, clear_gc, x, y, w, h);
 }
-// Globals for signal handling
-static volatile sig_atomic_t stop_multiwatch = 0;
 
-void handle_sigint_multiwatch(int signo) {
-    stop_multiwatch = 1;
+static void paint_copy(GC gc, int sx, int sy, int w, int h, int dx, int dy) {
+    if (headless) session_op(PAINT_COPY, sx, sy, w, h, dx, dy, 0, NULL, 0);
+    else XCopyArea(dpy, backbuf, backbuf, gc, sx, sy, w, h, dx, dy);
 }
 
+static void paint_frame(Drawable d, GC gc, int x, int y, int w, int h) {
+    if (headless) session_op(PAINT_FRAME, x, y, w, h, 0, 0, 0, NULL, 0);
+    else XDrawRectangle(dpy, d, gc, x, y, w, h);
+}
 
-void multiWatch(Tab *tab, Window win, GC gc, const char *input_line) {
-    #define MAX_CMDS 16
-    const int REFRESH_INTERVAL = 2; // seconds
+static void paint_line(Drawable d, GC gc, int x1, int y1, int x2, int y2) {
+    if (headless) session_op(PAINT_LINE, x1, y1, x2, y2, 0, 0, 0, NULL, 0);
+    else XDrawLine(dpy, d, gc, x1, y1, x2, y2);
+}
 
-    char cmds[MAX_CMDS][512];
-    int n = 0;
+// Copy a changed area of the back buffer to the window
+static void paint_present(Window win, GC gc, int x, int y, int w, int h) {
+    if (headless) session_op(PAINT_PRESENT, x, y, w, h, 0, 0, 0, NULL, 0);
+    else XCopyArea(dpy, backbuf, win, gc, x, y, w, h, x, y);
+}
 
-    // Parse commands from input: multiWatch ["cmd1", "cmd2"]
-    const char *start = strchr(input_line, '[');
-    const char *end = strrchr(input_line, ']');
-    if (!start || !end || start >= end) {
-        draw_output(win, gc, tab, "Invalid format. Use: multiWatch [\"cmd1\", \"cmd2\"]\n");
-        return;
+static void paint_flush(void) {
+    if (!headless) {
+        XFlush(dpy);
+    } else if (session_out_len) {
+        session_op(PAINT_FLUSH, 0, 0, 0, 0, 0, 0, 0, NULL, 0);
+        session_send();
     }
+}
+
+static Surface *tab_surface(Tab *tab) {
+    return headless == HEADLESS_SESSION ? &shared_surface : &tab->surface;
+}
 
-    char buf[1024];
-    size_t lenbuf = (size_t)(end - (start + 1));
-    if (lenbuf >= sizeof(buf)) lenbuf = sizeof(buf) - 1;
-    memcpy(buf, start + 1, lenbuf);
-    buf[lenbuf] = '\0';
+static void surface_free(Surface *s) {
+    if (s->pixmap != None) XFreePixmap(dpy, s->pixmap);
+    s->pixmap = None;
+    free(s->cells);
+    s->cells = NULL;
+    s->tab = NULL;
+    if (window_surface == s) window_surface = NULL;
+}
 
-    // Parse comma-separated quoted commands
-    char *tok = strtok(buf, ",");
-    while (tok && n < MAX_CMDS) {
-        // Trim spaces and quotes
-        while (*tok == ' ' || *tok == '\t' || *tok == '\"') tok++;
-        char *p = tok + strlen(tok) - 1;
-        while (p >= tok && (*p == ' ' || *p == '\t' || *p == '\"')) { 
-            *p = '\0'; 
-            p--; 
+// Free the least recently shown pixmaps until the rest fit the cache; keep
+// is the one about to be painted
+static void surface_evict(Surface *keep) {
+    for (;;) {
+        size_t bytes = 0;
+        Surface *oldest = NULL;
+        for (int i = 0; i < total_tabs; i++) {
+            Surface *s = &tabs[i]->surface;
+            if (s->pixmap == None) continue;
+            bytes += (size_t)s->width * s->height * 4;
+            if (s != keep && s != window_surface && (!oldest || s->shown < oldest->shown)) oldest = s;
         }
-        if (*tok) {
-            strncpy(cmds[n], tok, sizeof(cmds[n]) - 1);
-            cmds[n][sizeof(cmds[n]) - 1] = '\0';
-            n++;
-        }
-        tok = strtok(NULL, ",");
-    }
-
-    if (n == 0) {
-        draw_output(win, gc, tab, "No valid commands provided to multiWatch\n");
-        return;
+        if (bytes <= SURFACE_CACHE_BYTES || !oldest) return;
+        surface_free(oldest);
     }
+}
 
-    draw_output(win, gc, tab, "Starting multiWatch. Press Ctrl+C to stop...\n");
-
-    int xfd = ConnectionNumber(dpy);
-    int running = 1;
-    struct sigaction sa_old, sa_new;
-
-    // Setup signal handler for Ctrl+C
-    sa_new.sa_handler = handle_sigint_multiwatch;
-    sigemptyset(&sa_new.sa_mask);
-    sa_new.sa_flags = 0;
-    sigaction(SIGINT, &sa_new, &sa_old);
+// Forget what every surface holds so the next draw_text() repaints everything
+static void invalidate_window(void) {
+    shared_surface.tab = NULL;
+    for (int i = 0; i < total_tabs; i++) tabs[i]->surface.tab = NULL;
+    window_surface = NULL;
+}
 
-    // Reset the stop flag
-    stop_multiwatch = 0;
+// Paint into s from now on, sized to the window; a new size means a full repaint
+static void use_surface(Surface *s) {
+    target = s;
+    if (s->width != win_width || s->height != win_height) {
+        s->tab = NULL;
+        if (s->pixmap != None) XFreePixmap(dpy, s->pixmap);
+        s->pixmap = None;
+        s->width = win_width;
+        s->height = win_height;
+    }
+    // Without X the text grid follows the size by itself (see surface_fit)
+    if (headless) return;
+    if (s->pixmap == None) {
+        s->pixmap = XCreatePixmap(dpy, root, win_width, win_height, DefaultDepth(dpy, screen));
+        s->tab = NULL;
+        surface_evict(s);
+    }
+    backbuf = s->pixmap;
+    if (!clear_gc) {
+        XGCValues values;
+        values.foreground = WhitePixel(dpy, screen);
+        values.graphics_exposures = False;
+        clear_gc = XCreateGC(dpy, root, GCForeground | GCGraphicsExposures, &values);
+    }
+}
 
-    // Move pids and pipefds declaration outside the loop so they're accessible in cleanup
-    pid_t pids[MAX_CMDS] = {0};
-    int pipefds[MAX_CMDS][2] = {{-1, -1}};
+// Draw n characters with one set of attributes; plain text needs no GC changes
+static void draw_segment(Drawable win, GC gc, int x, int y, const char *s, int n, uint32_t attr) {
+    if (headless) {
+        session_op(PAINT_TEXT, x, y, 0, 0, 0, 0, attr, s, n);
+        return;
+    }
+    if (!attr) {
+        XDrawString(dpy, win, gc, x, y, s, n);
+        return;
+    }
+    unsigned long fg = (attr & ATTR_FG) ? color_pixel(attr >> 16 & 0xff) : BlackPixel(dpy, screen);
+    unsigned long bg = (attr & ATTR_BG) ? color_pixel(attr >> 24) : WhitePixel(dpy, screen);
+    if (attr & ATTR_REVERSE) {
+        unsigned long t = fg;
+        fg = bg;
+        bg = t;
+    }
+    int w = text_width(s, n);
+    if (bg != WhitePixel(dpy, screen)) {
+        XSetForeground(dpy, gc, bg);
+        XFillRectangle(dpy, win, gc, x, y - fm.ascent, w, fm.line_height);
+    }
+    XSetForeground(dpy, gc, fg);
+    XDrawString(dpy, win, gc, x, y, s, n);
+    if (attr & ATTR_BOLD) XDrawString(dpy, win, gc, x + 1, y, s, n);
+    if (attr & ATTR_UNDERLINE) XDrawLine(dpy, win, gc, x, y + 1, x + w - 1, y + 1);
+    XSetForeground(dpy, gc, BlackPixel(dpy, screen));
+}
 
-    while (running && !stop_multiwatch) {
-        int any_child_running = 0;
+static void draw_tabs(Drawable win, GC gc) {
+    int x = 10, y = tab_bar_baseline();
+    
+    for (int i = 0; i < total_tabs; i++) {
+        char label[20];
+        sprintf(label, "[Tab %d]", i + 1);
         
-        // Create pipes and fork processes
-        for (int i = 0; i < n; i++) {
-            if (pipe(pipefds[i]) < 0) {
-                perror("pipe");
-                // Cleanup previous pipes
-                for (int j = 0; j < i; j++) {
-                    close(pipefds[j][0]);
-                    close(pipefds[j][1]);
-                }
-                goto cleanup;
-            }
-
-            pids[i] = fork();
-            if (pids[i] == 0) {
-                // Child process - set new process group
-                setpgid(0, 0);
-                
-                close(pipefds[i][0]); // Close read end
-                
-                // Redirect stdout and stderr to pipe
-                dup2(pipefds[i][1], STDOUT_FILENO);
-                dup2(pipefds[i][1], STDERR_FILENO);
-                close(pipefds[i][1]);
-                
-                // Execute command
-                execlp("sh", "sh", "-c", cmds[i], NULL);
-                perror("execlp");
-                _exit(127);
-            } else if (pids[i] < 0) {
-                perror("fork");
-                close(pipefds[i][0]);
-                close(pipefds[i][1]);
-                // Cleanup previous
-                for (int j = 0; j < i; j++) {
-                    close(pipefds[j][0]);
-                    if (pids[j] > 0) kill(pids[j], SIGTERM);
-                }
-                goto cleanup;
-            } else {
-                // Parent process
-                any_child_running = 1;
-                close(pipefds[i][1]); // Close write end
-                // Set non-blocking
-                int flags = fcntl(pipefds[i][0], F_GETFL, 0);
-                fcntl(pipefds[i][0], F_SETFL, flags | O_NONBLOCK);
-            }
+        if (i == current_tab) {
+            // Draw rectangle around current tab
+            paint_frame(win, gc, x - 5, y - fm.line_height - 2,
+                        fm.tab_width, fm.line_height + 4);
         }
+        
+        draw_segment(win, gc, x, y, label, strlen(label), 0);
+        x += fm.tab_width + 10; // Add spacing between tabs
+    }
+}
 
-        if (!any_child_running) {
-            goto cleanup;
+static void draw_row(Drawable win, GC gc, Tab *tab, int row, int y) {
+    int max_chars = text_columns();
+
+    static const char prompt[] = "user@myterm> ";
+    const int prompt_len = sizeof(prompt) - 1;
+
+    // A row is scrollback text (optionally with attribute runs), screen cells or the input line
+    const char *text = NULL;
+    const unsigned char *runs = NULL;
+    const Cell *cells = NULL;
+    size_t text_len;
+    int nruns = 0;
+    int is_command = 0;
+    if (row < (int)tab->sb.count) {
+        unsigned int flags;
+        text = sb_line(&tab->sb, row, &text_len, &flags);
+        is_command = flags & LINE_COMMAND;
+        if (flags & LINE_ATTR) {
+            const unsigned char *end = (const unsigned char *)text + text_len;
+            nruns = end[-2] | end[-1] << 8;
+            text_len -= 2 + 5 * nruns;
+            runs = (const unsigned char *)text + text_len;
         }
+    } else if (tab->busy) {
+        int r = row - tab->sb.count;
+        cells = screen_row(&tab->screen, r);
+        text_len = screen_row_len(&tab->screen, r);
+    } else {
+        text = tab->input;
+        text_len = strlen(tab->input);
+        is_command = tab->input_is_command;
+    }
 
-        // Setup poll structure
-        struct pollfd *pfds = malloc((n + 1) * sizeof(struct pollfd));
-        if (!pfds) {
-            for (int i = 0; i < n; i++) {
-                if (pipefds[i][0] >= 0) close(pipefds[i][0]);
-                if (pids[i] > 0) kill(pids[i], SIGTERM);
-            }
-            goto cleanup;
+    // Build only the horizontally visible slice of prompt + text
+    char display_line[1024];
+    uint32_t display_attr[1024];
+    int cap = max_chars < (int)sizeof(display_line) ? max_chars : (int)sizeof(display_line);
+    int display_len = 0;
+    int plain = 1;
+    size_t skip = tab->scroll_x;
+    if (is_command) {
+        if (skip < (size_t)prompt_len) {
+            int n = prompt_len - skip;
+            if (n > cap) n = cap;
+            memcpy(display_line, prompt + skip, n);
+            memset(display_attr, 0, n * sizeof(uint32_t));
+            display_len = n;
+            skip = 0;
+        } else {
+            skip -= prompt_len;
         }
-
-        for (int i = 0; i < n; i++) {
-            pfds[i].fd = pipefds[i][0];
-            pfds[i].events = POLLIN;
-            pfds[i].revents = 0;
-        }
-        pfds[n].fd = xfd;
-        pfds[n].events = POLLIN;
-        pfds[n].revents = 0;
-
-        time_t cycle_start = time(NULL);
-        int data_received = 0;
-
-        while (running && !stop_multiwatch) {
-            int timeout_ms = (REFRESH_INTERVAL - (time(NULL) - cycle_start)) * 1000/6;
-            if (timeout_ms <= 0) break;
-
-            int rc = poll(pfds, n + 1, timeout_ms);
-            if (rc < 0) {
-                if (errno == EINTR) {
-                    if (stop_multiwatch) break;
-                    continue;
-                }
-                perror("poll");
-                break;
+    }
+    if (skip < text_len && display_len < cap) {
+        size_t n = text_len - skip;
+        if (n > (size_t)(cap - display_len)) n = cap - display_len;
+        if (cells) {
+            for (size_t i = 0; i < n; i++) {
+                Cell c = cells[skip + i];
+                display_line[display_len + i] = (char)(c & 0xff);
+                display_attr[display_len + i] = c & ATTR_MASK;
+                plain &= !(c & ATTR_MASK);
             }
-
-            if (rc == 0) break; // Timeout
-
-            // Check for X events (Ctrl+C)
-            if (pfds[n].revents & POLLIN) {
-                while (XPending(dpy) && running && !stop_multiwatch) {
-                    XEvent ev;
-                    XNextEvent(dpy, &ev);
-                    if (ev.type == KeyPress) {
-                        KeySym ks;
-                        char kb[32];
-                        XLookupString(&ev.xkey, kb, sizeof(kb), &ks, NULL);
-                        if ((ev.xkey.state & ControlMask) && (ks == XK_c || ks == XK_C)) {
-                            stop_multiwatch = 1;
-                            running = 0;
-                            break;
-                        }
-                    }
-                }
-                if (!running) break;
+        } else {
+            memcpy(display_line + display_len, text + skip, n);
+            memset(display_attr + display_len, 0, n * sizeof(uint32_t));
+            // Expand the runs that overlap the visible slice
+            size_t pos = 0;
+            for (int r = 0; r < nruns && pos < skip + n; r++, runs += 5) {
+                size_t run_len = runs[0] | runs[1] << 8;
+                uint32_t attr = (uint32_t)runs[2] << 8 | (uint32_t)runs[3] << 16 | (uint32_t)runs[4] << 24;
+                for (size_t i = pos > skip ? pos : skip; i < pos + run_len && i < skip + n; i++)
+                    display_attr[display_len + i - skip] = attr;
+                plain &= !attr;
+                pos += run_len;
             }
+        }
+        display_len += n;
+    }
 
-            // Check for data from commands
-            for (int i = 0; i < n; i++) {
-                if (pfds[i].revents & POLLIN) {
-                    char buffer[4096];
-                    ssize_t bytes_read;
-                    
-                    while ((bytes_read = read(pipefds[i][0], buffer, sizeof(buffer) - 1)) > 0) {
-                        data_received = 1;
-                        buffer[bytes_read] = '\0';
-                        
-                        // Format output with timestamp and command name
-                        time_t now = time(NULL);
-                        char time_str[64];
-                        strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", localtime(&now));
-                        
-                        char formatted[5000];
-                        snprintf(formatted, sizeof(formatted),
-                                 "\n\"%s\", %s:\n"
-                                 "----------------------------------------------------\n"
-                                 "%s"
-                                 "----------------------------------------------------\n",
-                                 cmds[i], time_str, buffer);
-                        
-                        draw_output(win, gc, tab, formatted);
-                    }
-                    
-                    if (bytes_read == 0) {
-                        // EOF - command finished
-                        close(pipefds[i][0]);
-                        pipefds[i][0] = -1;
-                        pfds[i].fd = -1;
-                    } else if (bytes_read < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-                        close(pipefds[i][0]);
-                        pipefds[i][0] = -1;
-                        pfds[i].fd = -1;
-                    }
-                }
-            }
-        }
+    if (plain) {
+        if (display_len > 0)
+            draw_segment(win, gc, 10, y, display_line, display_len, 0);
+        return;
+    }
+    for (int start = 0, end; start < display_len; start = end) {
+        for (end = start + 1; end < display_len && display_attr[end] == display_attr[start]; end++) {}
+        draw_segment(win, gc, 10 + text_width(display_line, start), y,
+                     display_line + start, end - start, display_attr[start]);
+    }
+}
 
-        // Cleanup for this cycle
-        free(pfds);
-        
-        // Kill any remaining child processes for this cycle
-        for (int i = 0; i < n; i++) {
-            if (pids[i] > 0) {
-                kill(pids[i], SIGTERM);
-                waitpid(pids[i], NULL, 0);
-                pids[i] = 0;
-            }
-            if (pipefds[i][0] >= 0) {
-                close(pipefds[i][0]);
-                pipefds[i][0] = -1;
-            }
+static int draw_panes(Window win, GC gc, Tab *tab, Surface *s, int present);
+
+// Paint the tab's rows into its surface, s; present copies what changed to the window
+static void draw_rows(Window win, GC gc, Tab *tab, Surface *s, int present) {
+    int y_start = tab_bar_height();
+    int line_height = fm.line_height;
+    int visible_lines = view_lines();
+    int rows = visible_lines + 1;
+
+    // Rows are the scrollback lines followed by the command's screen or the input line;
+    // the alternate screen is shown on its own
+    int alt = tab->busy && tab->screen.alt;
+    int first_line = alt ? (int)tab->sb.count : tab->scroll_y;
+    int last_line = first_line + visible_lines;
+    if (last_line > tab_rows(tab) - 1) last_line = tab_rows(tab) - 1;
+
+    unsigned long top = tab->sb.first + first_line;
+    unsigned long input_abs = tab->busy ? NO_ROW : sb_end(&tab->sb);
+    long shift = (long)(top - s->top); // rows the view moved down since the last paint
+    int full = tab != s->tab || tab->scroll_x != s->scroll_x || labs(shift) >= rows ||
+               alt != s->alt || s->watch;
+
+    // Pixel rows of the back buffer that changed and must reach the window
+    int area_top = y_start + line_height - fm.ascent;
+    int copy_top = win_height, copy_bottom = 0;
+
+    if (full) {
+        paint_clear(0, 0, win_width, win_height);
+        draw_tabs(backbuf, gc);
+        copy_top = 0;
+        copy_bottom = win_height;
+    } else {
+        if (total_tabs != s->total_tabs || current_tab != s->current_tab) {
+            paint_clear(0, 0, win_width, y_start);
+            draw_tabs(backbuf, gc);
+            copy_top = 0;
+            copy_bottom = y_start;
+        }
+        if (shift != 0) {
+            // Move the rows still on screen and damage only the ones scrolled in
+            int kept = rows - labs(shift);
+            int src = shift > 0 ? area_top + shift * line_height : area_top;
+            int dst = shift > 0 ? area_top : area_top - shift * line_height;
+            paint_copy(gc, 0, src, win_width, kept * line_height, 0, dst);
+            if (shift > 0)
+                tab_damage(tab, top + kept, top + rows - 1);
+            else
+                tab_damage(tab, top, top + labs(shift) - 1);
+            if (area_top < copy_top) copy_top = area_top;
+            copy_bottom = area_top + rows * line_height;
         }
+        // An edited input line is damaged wherever it was and wherever it is now
+        if (tab->drawn_input_row != input_abs || tab->drawn_input_is_command != tab->input_is_command ||
+            strcmp(tab->drawn_input, tab->input) != 0) {
+            if (tab->drawn_input_row != NO_ROW)
+                tab_damage(tab, tab->drawn_input_row, tab->drawn_input_row);
+            if (input_abs != NO_ROW)
+                tab_damage(tab, input_abs, input_abs);
+        }
+    }
 
-        // If we're stopping, break out
-        if (stop_multiwatch) break;
+    for (int i = first_line; i <= first_line + visible_lines; i++) {
+        unsigned long abs_row = tab->sb.first + i;
+        if (!full && (abs_row < tab->dirty_first || abs_row > tab->dirty_last)) continue;
 
-        // Only continue if not stopped
-        if (running) {
-            sleep(REFRESH_INTERVAL/4);
+        int y = y_start + (i - first_line + 1) * line_height;
+        int band = y - fm.ascent;
+        if (!full) {
+            paint_clear(0, band, win_width, line_height);
+            if (band < copy_top) copy_top = band;
+            if (band + line_height > copy_bottom) copy_bottom = band + line_height;
         }
+        if (i <= last_line)
+            draw_row(backbuf, gc, tab, i, y);
     }
 
-cleanup:
-    // Restore original signal handler
-    sigaction(SIGINT, &sa_old, NULL);
+    if (present && copy_bottom > copy_top)
+        paint_present(win, gc, 0, copy_top, win_width, copy_bottom - copy_top);
+
+    tab_clear_damage(tab);
+    strcpy(tab->drawn_input, tab->input);
+    tab->drawn_input_is_command = tab->input_is_command;
+    tab->drawn_input_row = input_abs;
+    s->tab = tab;
+    s->watch = NULL;
+    s->top = top;
+    s->scroll_x = tab->scroll_x;
+    s->alt = alt;
+    s->total_tabs = total_tabs;
+    s->current_tab = current_tab;
+}
 
-    // Kill any remaining processes
-    for (int i = 0; i < n; i++) {
-        if (pids[i] > 0) {
-            kill(pids[i], SIGTERM);
-            waitpid(pids[i], NULL, 0);
-        }
-        if (pipefds[i][0] >= 0) {
-            close(pipefds[i][0]);
-        }
-        if (pipefds[i][1] >= 0) {
-            close(pipefds[i][1]);
-        }
+// Bring the tab's surface up to date and show it.  A surface that was not
+// in the window before goes there whole, in one copy.
+static void draw_text(Window win, GC gc, Tab *tab) {
+    if (input_batch) {
+        frame_pending = 1;
+        return;
     }
+    if (paint_held()) {
+        frame_pending = 0;
+        return;
+    }
+    Surface *s = tab_surface(tab);
+    use_surface(s);
+    int switched = s != window_surface;
+    if (!draw_panes(win, gc, tab, s, !switched)) draw_rows(win, gc, tab, s, !switched);
+    if (switched) {
+        paint_present(win, gc, 0, 0, win_width, win_height);
+        window_surface = s;
+    }
+    s->shown = ++window_clock;
 
-    draw_output(win, gc, tab, "\nmultiWatch stopped.\n");
-    
-    // Reset terminal state properly
-    tab->current_line++;
-    tab->isCommand[tab->current_line] = 1;
-    tab->cursor_pos = 0;
-    tab->scroll_y = tab->current_line; // Scroll to show the new prompt
-    tab->scroll_x = 0;
-    
-    // Clear any partial command
-    tab->command[0] = '\0';
-    //tab->lines[tab->current_line][0] = '\0';
+    paint_flush();
+    frame_pending = 0;
+    last_frame_ms = now_ms();
+}
 
-    for(int i=tab->current_line;i<MAX_LINES;i++)
-    {
-        if(tab->lines[i][0]!='\0')
-            tab->lines[i][0]='\0';
-        //else
-        //    break;
+static int watch_dirty(const Watch *w);
+
+// Idle work: paint a background tab's damage into its surface, so that
+// showing it again is a copy.  Tabs whose pixmap was evicted wait until
+// they are shown.  Returns 0 once none is left.
+static int surface_step(Window win, GC gc) {
+    if (headless == HEADLESS_SESSION) return 0;
+    for (int i = 0; i < total_tabs; i++) {
+        Tab *tab = tabs[i];
+        Surface *s = &tab->surface;
+        if (i == current_tab || (s->pixmap == None && !s->cells)) continue;
+        if (tab->dirty_first > tab->dirty_last && !(tab->watch && watch_dirty(tab->watch))) continue;
+        use_surface(s);
+        if (!draw_panes(win, gc, tab, s, 0)) draw_rows(win, gc, tab, s, 0);
+        return 1;
     }
-    
-    draw_text(win, gc, tab);
-    
-    // Reset the stop flag for next use
-    stop_multiwatch = 0;
+    return 0;
 }
 
-void sigint_handler(int signo) {
-    if (current_child_pid > 0) {
-        kill(current_child_pid, SIGINT);  // Interrupt the running child
+// Serve an Expose from the back buffer without re-rendering any text
+static void expose_window(Window win, GC gc, Tab *tab, const XExposeEvent *xe) {
+    Surface *s = tab_surface(tab);
+    if (s != window_surface || s->tab != tab || s->width != win_width || s->height != win_height) {
+        if (xe->count == 0) draw_text(win, gc, tab);
+        return;
     }
-    // Don’t exit the shell itself
+    XCopyArea(dpy, s->pixmap, win, gc, xe->x, xe->y, xe->width, xe->height, xe->x, xe->y);
+    if (xe->count == 0) XFlush(dpy);
 }
-static void handle_child_and_events(pid_t child, int read_fd, Window win, GC gc, Tab *tab) {
-    current_child_pid = child;
 
-    // set pipe read end non-blocking
-    int flags = fcntl(read_fd, F_GETFL, 0);
-    fcntl(read_fd, F_SETFL, flags | O_NONBLOCK);
+// Ask for a repaint; it happens now if a frame is due, otherwise on a later frame_tick()
+static void request_frame(Window win, GC gc, Tab *tab) {
+    frame_pending = 1;
+    if (frame_timeout() == 0) draw_text(win, gc, tab);
+}
 
-    int xfd = ConnectionNumber(dpy);
-    char buf[4096];
-    int child_status = 0;
+static void frame_tick(Window win, GC gc, Tab *tab) {
+    if (frame_pending && frame_timeout() == 0) draw_text(win, gc, tab);
+}
 
-    while (1) {
-        // 1) check for child exit first (non-blocking)
-        pid_t r = waitpid(child, &child_status, WNOHANG);
-        if (r == -1) {
-            // error - break
-            break;
-        } else if (r > 0) {
-            // child exited
-            break;
-        }
+// Input that is already queued (held keys, a paste, a burst from a session
+// front end) is handled as one batch: the handlers change state and the
+// window is repainted once, at input_end().
+static void input_begin(void) {
+    input_batch = 1;
+}
 
-        // 2) prepare fdsets for select: X connection fd and pipe read fd
-        fd_set rfds;
-        FD_ZERO(&rfds);
-        if (read_fd >= 0) FD_SET(read_fd, &rfds);
-        FD_SET(xfd, &rfds);
-        int nf = (xfd > read_fd ? xfd : read_fd) + 1;
+static void input_end(Window win, GC gc) {
+    input_batch = 0;
+    if (frame_pending && total_tabs) draw_text(win, gc, tabs[current_tab]);
+}
 
-        // small timeout so we remain responsive
-        struct timeval tv;
-        tv.tv_sec = 0;
-        tv.tv_usec = 200 * 1000; // 200 ms
+/* ---- Event loop ----
+ * Everything the GUI waits for goes through one epoll set: the X connection,
+ * every tab's pty, multiWatch pipes and timers, a signalfd for SIGCHLD and
+ * SIGINT, a timerfd for the next frame and the inotify fds of the directory
+ * cache and the PATH index.  Each fd is registered with an EventSource, so a
+ * wakeup goes straight to its handler (see wait_for_input).  Background work
+ * (reading PATH directories) runs when a wakeup finds nothing to do.
+ */
+enum {
+    SRC_X, SRC_SIGNAL, SRC_FRAME, SRC_PTY, SRC_WATCH_OUT, SRC_WATCH_TIMER, SRC_INOTIFY, SRC_PATHINDEX,
+    SRC_SESSION_LISTEN, SRC_SESSION,
+};
+
+#define INGEST_BUDGET (256 * 1024) // pty bytes parsed per wakeup, split among ready tabs
+#define INGEST_MIN (16 * 1024)     // but at least this much for each
+#define EVENT_BATCH 256             // queued X events taken before a repaint (see run)
+
+static int epfd = -1;
+static int signal_fd = -1;
+static int frame_timer = -1;
+static EventSource x_src = { .kind = SRC_X }, signal_src = { .kind = SRC_SIGNAL }, frame_src = { .kind = SRC_FRAME };
+
+static int reactor_add(int fd, EventSource *src) {
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.ptr = src;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
 
-        int sel = select(nf, &rfds, NULL, NULL, &tv);
-        if (sel < 0) {
-            if (errno == EINTR) continue;
-            perror("select");
-            break;
-        }
+// SIGCHLD and SIGINT are blocked and read from signal_fd; children are
+// started with an empty signal mask (see pty_spawn_shell, spawn_pipeline)
+static void reactor_init(int xfd) {
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) err(1, "epoll_create1");
+    if (xfd >= 0) reactor_add(xfd, &x_src);
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd >= 0) reactor_add(signal_fd, &signal_src);
+
+    frame_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (frame_timer >= 0) reactor_add(frame_timer, &frame_src);
+}
 
-        // 3) If X fd ready, process all pending X events
-        if (FD_ISSET(xfd, &rfds)) {
-            while (XPending(dpy)) {
-                XEvent ev;
-                XNextEvent(dpy, &ev);
-                if (ev.type == KeyPress) {
-                    KeySym ks;
-                    char kb[32];
-                    XLookupString(&ev.xkey, kb, sizeof(kb), &ks, NULL);
-                    if ((ev.xkey.state & ControlMask) && (ks == XK_C || ks == XK_c)) {
-                        if (current_child_pid > 0) {
-                            // send SIGINT to the child's process group
-                            kill(-current_child_pid, SIGINT);
-                        }
-                    } else {
-                        // For other keys during child execution you might want to ignore or queue them.
-                        // We ignore other keys here to keep behavior simple while a child runs.
-                    }
-                } else {
-                    // keep other event handling minimal; user Expose etc. will redraw next loop
-                    if (ev.type == Expose) draw_text(win, gc, tab);
-                }
-            }
-        }
+// Make frame_timer fire when the pending frame is due
+static void frame_arm(void) {
+    int ms = frame_timeout();
+    if (ms < 0 || frame_timer < 0) return;
+    struct itimerspec its = {0};
+    its.it_value.tv_sec = ms / 1000;
+    its.it_value.tv_nsec = (ms % 1000) * 1000000L + 1; // an all-zero value disarms
+    timerfd_settime(frame_timer, 0, &its, NULL);
+}
 
-        // 4) If pipe has data, read and forward it to draw_output
-        if (read_fd >= 0 && FD_ISSET(read_fd, &rfds)) {
-            ssize_t rr;
-            while ((rr = read(read_fd, buf, sizeof(buf) - 1)) > 0) {
-                buf[rr] = '\0';
-                draw_output(win, gc, tab, buf);
-            }
-            if (rr == 0) {
-                // EOF from child stdout/stderr: close read fd
-                close(read_fd);
-                read_fd = -1;
-            } else if (rr < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-                // serious read error
-                close(read_fd);
-                read_fd = -1;
-            }
+// Append a line to the scrollback, keeping the view on the same content.
+// If the last row was on screen the view follows it, so output stays visible.
+// This runs for every line of output, so the view height is worked out once.
+static void tab_sb_push(Tab *tab, const char *text, size_t len, unsigned int flags) {
+    int view = view_lines();
+    int following = tab_follows(tab, view);
+    if (sb_push(&tab->sb, text, len, flags) && tab->scroll_y > 0)
+        tab->scroll_y--;
+    int last = tab_rows(tab) - 1;
+    if (following && last > tab->scroll_y + view) tab->scroll_y = last - view;
+}
+
+// Insert a finished line above the rows that follow the scrollback
+static void tab_push_line(Tab *tab, const char *text, size_t len, unsigned int flags) {
+    unsigned long row = sb_end(&tab->sb);
+    tab_sb_push(tab, text, len, flags);
+    // The new line takes the input row's place and the rows below move down
+    tab_damage(tab, row, sb_end(&tab->sb) + tab_tail_rows(tab) - 1);
+}
+
+// Move the input line into the scrollback and start an empty prompt
+static void commit_input(Tab *tab) {
+    tab_push_line(tab, tab->input, strlen(tab->input), tab->input_is_command ? LINE_COMMAND : 0);
+    tab->input[0] = '\0';
+    tab->input_is_command = 1;
+    tab->cursor_pos = 0;
+}
+
+/* ---- Screen operations ----
+ * Rows of the screen are addressed from 0 at its top; on the primary screen
+ * row r is absolute row sb_end() + r, which is what the damage range uses.
+ */
+static void screen_damage(Tab *tab, int first, int last) {
+    unsigned long end = sb_end(&tab->sb);
+    tab_damage(tab, end + first, end + last);
+}
+
+// Rows are cleared lazily: blank the stale cells of row r up to column to
+static void screen_touch(VtScreen *sc, int r, int to) {
+    int *extent = screen_extent(sc, r);
+    if (*extent >= to) return;
+    Cell *c = screen_row(sc, r);
+    for (int i = *extent; i < to; i++) c[i] = BLANK_CELL;
+    *extent = to;
+}
+
+// Blank columns [from, to) of row r; blanks keep the current background
+static void screen_erase(VtScreen *sc, int r, int from, int to) {
+    Cell *c = screen_row(sc, r);
+    int *extent = screen_extent(sc, r);
+    Cell blank = BLANK_CELL | (sc->attr & (ATTR_BG | 0xff000000u));
+    if (blank == BLANK_CELL) {
+        if (to >= *extent) {
+            if (from < *extent) *extent = from;
+            return;
         }
+        for (int i = from; i < to; i++) c[i] = BLANK_CELL;
+    } else {
+        screen_touch(sc, r, from);
+        for (int i = from; i < to; i++) c[i] = blank;
+        if (to > *extent) *extent = to;
+    }
+}
+
+static void screen_clear_row(VtScreen *sc, int r) {
+    *screen_extent(sc, r) = 0;
+}
+
+static void screen_copy_row(VtScreen *sc, int dst, int src) {
+    memcpy(screen_row(sc, dst), screen_row(sc, src), sc->cols * sizeof(Cell));
+    *screen_extent(sc, dst) = *screen_extent(sc, src);
+}
+
+// Encode row r for the scrollback: the text, then if any cell has attributes,
+// runs of (length, attributes) and the run count (LINE_ATTR).  Returns the length.
+static size_t screen_encode_row(VtScreen *sc, int r, unsigned int *flags) {
+    const Cell *c = screen_row(sc, r);
+    int len = screen_row_len(sc, r);
+    unsigned char *out = sc->scratch;
+    *flags = 0;
+    if (!(cells_to_bytes(out, c, len) & ATTR_MASK)) return len;
+    size_t n = len;
+    int nruns = 0;
+    for (int i = 0, j; i < len; i = j) {
+        uint32_t attr = c[i] & ATTR_MASK;
+        for (j = i + 1; j < len && (c[j] & ATTR_MASK) == attr; j++) {}
+        out[n++] = (j - i) & 0xff;
+        out[n++] = (j - i) >> 8;
+        out[n++] = attr >> 8;
+        out[n++] = attr >> 16;
+        out[n++] = attr >> 24;
+        nruns++;
     }
+    out[n++] = nruns & 0xff;
+    out[n++] = nruns >> 8;
+    *flags = LINE_ATTR;
+    return n;
+}
+
+static void screen_push_row(Tab *tab, int r) {
+    unsigned int flags;
+    size_t len = screen_encode_row(&tab->screen, r, &flags);
+    tab_sb_push(tab, (const char *)tab->screen.scratch, len, flags);
+}
+
+// Cursor row grew past the rows shown so far
+static void screen_show_row(Tab *tab, int r) {
+    VtScreen *sc = &tab->screen;
+    if (r < sc->used) return;
+    int following = tab_following(tab);
+    int old = sc->used;
+    sc->used = r + 1;
+    if (following) tab_follow(tab);
+    screen_damage(tab, old, r);
+}
 
-    // final drain of any remaining data (non-blocking)
-    if (read_fd >= 0) {
-        ssize_t rr;
-        while ((rr = read(read_fd, buf, sizeof(buf) - 1)) > 0) {
-            buf[rr] = '\0';
-            draw_output(win, gc, tab, buf);
+static void screen_scroll_up(Tab *tab, int top, int bottom, int n) {
+    VtScreen *sc = &tab->screen;
+    if (n > bottom - top + 1) n = bottom - top + 1;
+    if (n <= 0) return;
+    if (top == 0 && bottom == sc->rows - 1) {
+        // Whole screen: rotate the ring; the primary screen hands its top rows to the scrollback
+        int old_used = sc->used;
+        for (int i = 0; i < n; i++) {
+            if (!sc->alt && !sc->discard) screen_push_row(tab, 0);
+            if (++sc->base == sc->rows) sc->base = 0;
+            screen_clear_row(sc, sc->rows - 1);
+        }
+        if (sc->alt) {
+            screen_damage(tab, 0, sc->rows - 1);
+        } else {
+            // Rows that moved up keep their absolute number and need no repaint
+            if (old_used < sc->rows) {
+                int following = tab_following(tab);
+                sc->used = sc->rows;
+                if (following) tab_follow(tab);
+            }
+            screen_damage(tab, old_used - n > 0 ? old_used - n : 0, sc->rows - 1);
         }
-        if (read_fd >= 0) close(read_fd);
+        return;
     }
+    for (int r = top; r + n <= bottom; r++) screen_copy_row(sc, r, r + n);
+    for (int r = bottom - n + 1; r <= bottom; r++) screen_clear_row(sc, r);
+    screen_damage(tab, top, bottom);
+}
+
+static void screen_scroll_down(Tab *tab, int top, int bottom, int n) {
+    VtScreen *sc = &tab->screen;
+    if (n > bottom - top + 1) n = bottom - top + 1;
+    if (n <= 0) return;
+    for (int r = bottom; r - n >= top; r--) screen_copy_row(sc, r, r - n);
+    for (int r = top; r < top + n; r++) screen_clear_row(sc, r);
+    screen_show_row(tab, bottom);
+    screen_damage(tab, top, bottom);
+}
 
-    current_child_pid = -1;
+// IND: move down, scrolling at the bottom margin
+static void screen_index(Tab *tab) {
+    VtScreen *sc = &tab->screen;
+    sc->wrap_pending = 0;
+    if (sc->cy == sc->bottom)
+        screen_scroll_up(tab, sc->top, sc->bottom, 1);
+    else if (sc->cy < sc->rows - 1)
+        screen_show_row(tab, ++sc->cy);
+}
 
-    // reap any other children if necessary
-    while (waitpid(-1, NULL, WNOHANG) > 0) {}
+static void screen_linefeed(Tab *tab) {
+    screen_index(tab);
+    if (tab->screen.newline_mode) tab->screen.cx = 0;
 }
 
-/* ---- History file handling ---- */
-static void load_history() {
-    FILE *file = fopen(HISTORY_FILE, "r");
-    if (!file) return;
-    
-    char line[MAX_LINE_LEN];
-    while (fgets(line, sizeof(line), file) && history_count < MAX_HISTORY_SIZE) {
-        // Remove newline
-        line[strcspn(line, "\n")] = '\0';
-        if (strlen(line) > 0) {
-            strncpy(history[history_count], line, MAX_LINE_LEN - 1);
-            history[history_count][MAX_LINE_LEN - 1] = '\0';
-            history_count++;
+static void screen_move(Tab *tab, int x, int y) {
+    VtScreen *sc = &tab->screen;
+    sc->cx = x < 0 ? 0 : x >= sc->cols ? sc->cols - 1 : x;
+    sc->cy = y < 0 ? 0 : y >= sc->rows ? sc->rows - 1 : y;
+    sc->wrap_pending = 0;
+    screen_show_row(tab, sc->cy);
+}
+
+// Write characters at the cursor, wrapping at the right margin
+static void screen_put_run(Tab *tab, const unsigned char *s, size_t n) {
+    VtScreen *sc = &tab->screen;
+    while (n > 0) {
+        if (sc->wrap_pending && sc->autowrap) {
+            sc->cx = 0;
+            screen_index(tab);
+        }
+        sc->wrap_pending = 0;
+        size_t space = sc->cols - sc->cx;
+        size_t k = n < space ? n : space;
+        Cell *row = screen_row(sc, sc->cy);
+        screen_touch(sc, sc->cy, sc->cx);
+        fill_cells(row + sc->cx, s, k, sc->attr);
+        if (!sc->autowrap && n > space) {
+            // Without wrapping the rest overwrites the last column
+            row[sc->cols - 1] = sc->attr | s[n - 1];
+            k = n;
+        }
+        int end = sc->cx + (k < space ? k : space);
+        int *extent = screen_extent(sc, sc->cy);
+        if (end > *extent) *extent = end;
+        screen_damage(tab, sc->cy, sc->cy);
+        s += k;
+        n -= k;
+        if (end == sc->cols) {
+            sc->cx = sc->cols - 1;
+            sc->wrap_pending = 1;
+        } else {
+            sc->cx = end;
         }
     }
-    fclose(file);
-    history_current = history_count;
 }
 
-static void save_history() {
-    FILE *file = fopen(HISTORY_FILE, "w");
-    if (!file) return;
-    
-    for (int i = 0; i < history_count; i++) {
-        fprintf(file, "%s\n", history[i]);
+// Characters outside Latin-1 that have an obvious stand-in
+static unsigned char unicode_fallback(uint32_t cp) {
+    if (cp < 0x100) return cp;
+    switch (cp) {
+    case 0x2018: case 0x2019: return '\'';
+    case 0x201c: case 0x201d: return '"';
+    case 0x2010: case 0x2013: case 0x2014: case 0x2500: return '-';
+    case 0x2502: return '|';
+    case 0x2022: return 0xb7;
     }
-    fclose(file);
+    if (cp >= 0x2500 && cp < 0x2580) return '+'; // other box drawing
+    return '?';
 }
 
-static void add_to_history(const char *command) {
-    // Don't add empty commands or duplicates of the last command
-    if (strlen(command) == 0 || 
-        (history_count > 0 && strcmp(history[history_count - 1], command) == 0)) {
+// UTF-8 is decoded into single-byte cells
+static void screen_print(Tab *tab, unsigned char c) {
+    VtScreen *sc = &tab->screen;
+    unsigned char out;
+    if (c >= 0x80 && c < 0xc0 && sc->utf8_left) {
+        sc->utf8_cp = sc->utf8_cp << 6 | (c & 0x3f);
+        if (--sc->utf8_left) return;
+        out = unicode_fallback(sc->utf8_cp);
+        screen_put_run(tab, &out, 1);
         return;
     }
-    
-    if (history_count < MAX_HISTORY_SIZE) {
-        strncpy(history[history_count], command, MAX_LINE_LEN - 1);
-        history[history_count][MAX_LINE_LEN - 1] = '\0';
-        history_count++;
+    if (sc->utf8_left) {
+        // Truncated sequence
+        sc->utf8_left = 0;
+        out = '?';
+        screen_put_run(tab, &out, 1);
+    }
+    if (c < 0x80) {
+        screen_put_run(tab, &c, 1);
+    } else if (c >= 0xc2 && c < 0xe0) {
+        sc->utf8_cp = c & 0x1f;
+        sc->utf8_left = 1;
+    } else if (c >= 0xe0 && c < 0xf0) {
+        sc->utf8_cp = c & 0x0f;
+        sc->utf8_left = 2;
+    } else if (c >= 0xf0 && c < 0xf5) {
+        sc->utf8_cp = c & 0x07;
+        sc->utf8_left = 3;
     } else {
-        // Shift history down to make room
-        for (int i = 1; i < MAX_HISTORY_SIZE; i++) {
-            strncpy(history[i-1], history[i], MAX_LINE_LEN - 1);
-            history[i-1][MAX_LINE_LEN - 1] = '\0';
+        out = '?';
+        screen_put_run(tab, &out, 1);
+    }
+}
+
+static void screen_reset(Tab *tab) {
+    VtScreen *sc = &tab->screen;
+    for (int r = 0; r < sc->rows; r++) screen_clear_row(sc, r);
+    sc->cx = sc->cy = 0;
+    sc->wrap_pending = 0;
+    sc->top = 0;
+    sc->bottom = sc->rows - 1;
+    sc->attr = 0;
+    sc->saved_cx = sc->saved_cy = 0;
+    sc->saved_attr = 0;
+    sc->autowrap = 1;
+    sc->state = 0;
+    sc->utf8_left = 0;
+    screen_damage(tab, 0, sc->used - 1);
+}
+
+static void screen_set_alt(Tab *tab, int on) {
+    VtScreen *sc = &tab->screen;
+    if (on == sc->alt) return;
+    Cell *cells = sc->cells;
+    int *extent = sc->extent;
+    int base = sc->base, used = sc->used;
+    if (!sc->alt_cells) {
+        sc->alt_cells = malloc((size_t)sc->rows * sc->cols * sizeof(Cell));
+        sc->alt_extent = calloc(sc->rows, sizeof(int));
+        if (!sc->alt_cells || !sc->alt_extent) return;
+        for (size_t i = 0; i < (size_t)sc->rows * sc->cols; i++) sc->alt_cells[i] = BLANK_CELL;
+        sc->alt_base = 0;
+    }
+    sc->cells = sc->alt_cells;
+    sc->extent = sc->alt_extent;
+    sc->base = sc->alt_base;
+    sc->used = on ? sc->rows : sc->alt_used;
+    sc->alt_cells = cells;
+    sc->alt_extent = extent;
+    sc->alt_base = base;
+    sc->alt_used = used;
+    sc->alt = on;
+    if (on)
+        for (int r = 0; r < sc->rows; r++) screen_clear_row(sc, r);
+    sc->top = 0;
+    sc->bottom = sc->rows - 1;
+    screen_damage(tab, 0, sc->rows - 1);
+}
+
+/* ---- Escape-sequence parser ----
+ * A table-driven state machine after the DEC VT500 parser: each state maps
+ * every byte to an action and a next state.  Runs of printable ASCII in the
+ * ground state bypass the table and are copied into the screen in bulk.
+ */
+enum { VT_GROUND, VT_ESCAPE, VT_ESC_INTER, VT_CSI_ENTRY, VT_CSI_PARAM, VT_CSI_INTER,
+       VT_CSI_IGNORE, VT_OSC, VT_STRING, VT_STATES };
+enum { VA_NONE, VA_PRINT, VA_EXECUTE, VA_CLEAR, VA_COLLECT, VA_PARAM,
+       VA_ESC_DISPATCH, VA_CSI_DISPATCH, VA_OSC_PUT, VA_OSC_END };
+
+static unsigned char vt_table[VT_STATES][256]; // next state << 4 | action
+
+static void vt_set(int state, int from, int to, int action, int next) {
+    for (int c = from; c <= to; c++) vt_table[state][c] = next << 4 | action;
+}
+
+static void vt_init_table(void) {
+    for (int s = 0; s < VT_STATES; s++) {
+        vt_set(s, 0x00, 0xff, VA_NONE, s);
+        if (s != VT_OSC && s != VT_STRING) {
+            vt_set(s, 0x00, 0x1f, VA_EXECUTE, s);
+            vt_set(s, 0x80, 0xff, VA_NONE, s);
         }
-        strncpy(history[MAX_HISTORY_SIZE - 1], command, MAX_LINE_LEN - 1);
-        history[MAX_HISTORY_SIZE - 1][MAX_LINE_LEN - 1] = '\0';
     }
-    history_current = history_count;
-    save_history();
+    vt_set(VT_GROUND, 0x20, 0x7e, VA_PRINT, VT_GROUND);
+    vt_set(VT_GROUND, 0x80, 0xff, VA_PRINT, VT_GROUND);
+
+    vt_set(VT_ESCAPE, 0x20, 0x2f, VA_COLLECT, VT_ESC_INTER);
+    vt_set(VT_ESCAPE, 0x30, 0x7e, VA_ESC_DISPATCH, VT_GROUND);
+    vt_set(VT_ESCAPE, '[', '[', VA_CLEAR, VT_CSI_ENTRY);
+    vt_set(VT_ESCAPE, ']', ']', VA_CLEAR, VT_OSC);
+    vt_set(VT_ESCAPE, 'P', 'P', VA_NONE, VT_STRING);
+    vt_set(VT_ESCAPE, 'X', 'X', VA_NONE, VT_STRING);
+    vt_set(VT_ESCAPE, '^', '_', VA_NONE, VT_STRING);
+    vt_set(VT_ESC_INTER, 0x20, 0x2f, VA_COLLECT, VT_ESC_INTER);
+    vt_set(VT_ESC_INTER, 0x30, 0x7e, VA_ESC_DISPATCH, VT_GROUND);
+
+    vt_set(VT_CSI_ENTRY, 0x20, 0x2f, VA_COLLECT, VT_CSI_INTER);
+    vt_set(VT_CSI_ENTRY, 0x30, 0x3b, VA_PARAM, VT_CSI_PARAM);
+    vt_set(VT_CSI_ENTRY, 0x3c, 0x3f, VA_COLLECT, VT_CSI_PARAM);
+    vt_set(VT_CSI_ENTRY, 0x40, 0x7e, VA_CSI_DISPATCH, VT_GROUND);
+    vt_set(VT_CSI_PARAM, 0x20, 0x2f, VA_COLLECT, VT_CSI_INTER);
+    vt_set(VT_CSI_PARAM, 0x30, 0x3b, VA_PARAM, VT_CSI_PARAM);
+    vt_set(VT_CSI_PARAM, 0x3c, 0x3f, VA_NONE, VT_CSI_IGNORE);
+    vt_set(VT_CSI_PARAM, 0x40, 0x7e, VA_CSI_DISPATCH, VT_GROUND);
+    vt_set(VT_CSI_INTER, 0x20, 0x2f, VA_COLLECT, VT_CSI_INTER);
+    vt_set(VT_CSI_INTER, 0x30, 0x3f, VA_NONE, VT_CSI_IGNORE);
+    vt_set(VT_CSI_INTER, 0x40, 0x7e, VA_CSI_DISPATCH, VT_GROUND);
+    vt_set(VT_CSI_IGNORE, 0x40, 0x7e, VA_NONE, VT_GROUND);
+
+    vt_set(VT_OSC, 0x20, 0xff, VA_OSC_PUT, VT_OSC);
+    vt_set(VT_OSC, 0x07, 0x07, VA_OSC_END, VT_GROUND);
+    vt_set(VT_OSC, 0x1b, 0x1b, VA_OSC_END, VT_ESCAPE);
+    vt_set(VT_STRING, 0x07, 0x07, VA_NONE, VT_GROUND);
+    vt_set(VT_STRING, 0x1b, 0x1b, VA_NONE, VT_ESCAPE);
+
+    // Valid from any state: CAN and SUB abort a sequence, ESC starts a new one
+    for (int s = 0; s < VT_STATES; s++) {
+        vt_set(s, 0x18, 0x18, VA_EXECUTE, VT_GROUND);
+        vt_set(s, 0x1a, 0x1a, VA_EXECUTE, VT_GROUND);
+        if (s != VT_OSC) vt_set(s, 0x1b, 0x1b, VA_CLEAR, VT_ESCAPE);
+    }
 }
 
-/* ---- History search functions ---- */
-static int longest_common_substring(const char *str1, const char *str2) {
-    int len1 = strlen(str1);
-    int len2 = strlen(str2);
-    int max_len = 0;
-    
-    for (int i = 0; i < len1; i++) {
-        for (int j = 0; j < len2; j++) {
-            int len = 0;
-            while (i + len < len1 && j + len < len2 && str1[i + len] == str2[j + len]) {
-                len++;
+static int vt_param(const VtScreen *sc, int i, int def) {
+    return i < sc->nparams && sc->params[i] > 0 ? sc->params[i] : def;
+}
+
+static void vt_execute(Tab *tab, unsigned char c) {
+    VtScreen *sc = &tab->screen;
+    switch (c) {
+    case '\b':
+        if (sc->cx > 0) sc->cx--;
+        sc->wrap_pending = 0;
+        break;
+    case '\t': {
+        int x = (sc->cx / 8 + 1) * 8;
+        sc->cx = x < sc->cols ? x : sc->cols - 1;
+        sc->wrap_pending = 0;
+        break;
+    }
+    case '\n': case '\v': case '\f':
+        screen_linefeed(tab);
+        break;
+    case '\r':
+        sc->cx = 0;
+        sc->wrap_pending = 0;
+        break;
+    }
+}
+
+static void vt_esc_dispatch(Tab *tab, unsigned char c) {
+    VtScreen *sc = &tab->screen;
+    if (sc->intermediate) return; // character set designations
+    switch (c) {
+    case '7':
+        sc->saved_cx = sc->cx;
+        sc->saved_cy = sc->cy;
+        sc->saved_attr = sc->attr;
+        break;
+    case '8':
+        screen_move(tab, sc->saved_cx, sc->saved_cy);
+        sc->attr = sc->saved_attr;
+        break;
+    case 'D':
+        screen_index(tab);
+        break;
+    case 'E':
+        sc->cx = 0;
+        screen_index(tab);
+        break;
+    case 'M':
+        if (sc->cy == sc->top)
+            screen_scroll_down(tab, sc->top, sc->bottom, 1);
+        else if (sc->cy > 0)
+            sc->cy--;
+        sc->wrap_pending = 0;
+        break;
+    case 'c':
+        screen_set_alt(tab, 0);
+        screen_reset(tab);
+        break;
+    }
+}
+
+static void vt_sgr(VtScreen *sc) {
+    if (sc->nparams == 0) {
+        sc->attr = 0;
+        return;
+    }
+    for (int i = 0; i < sc->nparams; i++) {
+        int p = sc->params[i];
+        if (p == 0) sc->attr = 0;
+        else if (p == 1) sc->attr |= ATTR_BOLD;
+        else if (p == 4) sc->attr |= ATTR_UNDERLINE;
+        else if (p == 7) sc->attr |= ATTR_REVERSE;
+        else if (p == 22) sc->attr &= ~ATTR_BOLD;
+        else if (p == 24) sc->attr &= ~ATTR_UNDERLINE;
+        else if (p == 27) sc->attr &= ~ATTR_REVERSE;
+        else if (p >= 30 && p <= 37) sc->attr = (sc->attr & 0xff00ffffu) | ATTR_FG | (uint32_t)(p - 30) << 16;
+        else if (p == 39) sc->attr &= ~(ATTR_FG | 0x00ff0000u);
+        else if (p >= 40 && p <= 47) sc->attr = (sc->attr & 0x00ffffffu) | ATTR_BG | (uint32_t)(p - 40) << 24;
+        else if (p == 49) sc->attr &= ~(ATTR_BG | 0xff000000u);
+        else if (p >= 90 && p <= 97) sc->attr = (sc->attr & 0xff00ffffu) | ATTR_FG | (uint32_t)(p - 90 + 8) << 16;
+        else if (p >= 100 && p <= 107) sc->attr = (sc->attr & 0x00ffffffu) | ATTR_BG | (uint32_t)(p - 100 + 8) << 24;
+        else if ((p == 38 || p == 48) && i + 1 < sc->nparams) {
+            // 256-colour index, or 24-bit colour mapped to the nearest cube entry
+            uint32_t idx;
+            if (sc->params[i + 1] == 5 && i + 2 < sc->nparams) {
+                idx = sc->params[i + 2] & 0xff;
+                i += 2;
+            } else if (sc->params[i + 1] == 2 && i + 4 < sc->nparams) {
+                int r = sc->params[i + 2], g = sc->params[i + 3], b = sc->params[i + 4];
+                idx = 16 + 36 * ((r > 255 ? 255 : r) * 5 / 255) + 6 * ((g > 255 ? 255 : g) * 5 / 255) +
+                      (b > 255 ? 255 : b) * 5 / 255;
+                i += 4;
+            } else {
+                break;
             }
-            if (len > max_len) {
-                max_len = len;
+            if (p == 38) sc->attr = (sc->attr & 0xff00ffffu) | ATTR_FG | idx << 16;
+            else sc->attr = (sc->attr & 0x00ffffffu) | ATTR_BG | idx << 24;
+        }
+    }
+}
+
+static void vt_set_mode(Tab *tab, int on) {
+    VtScreen *sc = &tab->screen;
+    for (int i = 0; i < sc->nparams; i++) {
+        int p = sc->params[i];
+        if (sc->private_marker == '?') {
+            if (p == 7) {
+                sc->autowrap = on;
+            } else if (p == 47 || p == 1047 || p == 1049) {
+                if (p == 1049 && on) {
+                    sc->saved_cx = sc->cx;
+                    sc->saved_cy = sc->cy;
+                    sc->saved_attr = sc->attr;
+                }
+                screen_set_alt(tab, on);
+                if (p == 1049 && !on) {
+                    screen_move(tab, sc->saved_cx, sc->saved_cy);
+                    sc->attr = sc->saved_attr;
+                }
             }
+        } else if (!sc->private_marker && p == 20) {
+            sc->newline_mode = on;
         }
     }
-    return max_len;
 }
 
-static void search_history(Tab *tab, Window win, GC gc) {
-    if (strlen(search_term) == 0) {
-        draw_output(win, gc, tab, "No search term entered\n");
+static void vt_csi_dispatch(Tab *tab, unsigned char c) {
+    VtScreen *sc = &tab->screen;
+    if (c == 'h' || c == 'l') {
+        vt_set_mode(tab, c == 'h');
         return;
     }
-    
-    // First try exact match
-    for (int i = history_count - 1; i >= 0; i--) {
-        if (strcmp(history[i], search_term) == 0) {
-            char result[MAX_LINE_LEN + 50];
-            snprintf(result, sizeof(result), "Found: %s\n", history[i]);
-            draw_output(win, gc, tab, result);
-            return;
+    if (sc->private_marker || sc->intermediate) return;
+
+    int n = vt_param(sc, 0, 1);
+    switch (c) {
+    case 'A': screen_move(tab, sc->cx, sc->cy - n); break;
+    case 'B': case 'e': screen_move(tab, sc->cx, sc->cy + n); break;
+    case 'C': case 'a': screen_move(tab, sc->cx + n, sc->cy); break;
+    case 'D': screen_move(tab, sc->cx - n, sc->cy); break;
+    case 'E': screen_move(tab, 0, sc->cy + n); break;
+    case 'F': screen_move(tab, 0, sc->cy - n); break;
+    case 'G': case '`': screen_move(tab, n - 1, sc->cy); break;
+    case 'd': screen_move(tab, sc->cx, n - 1); break;
+    case 'H': case 'f': screen_move(tab, vt_param(sc, 1, 1) - 1, n - 1); break;
+    case 'J': {
+        int mode = vt_param(sc, 0, 0);
+        int from = mode == 0 ? sc->cy + 1 : 0;
+        int to = mode == 1 ? sc->cy : sc->rows;
+        if (mode == 0) screen_erase(sc, sc->cy, sc->cx, sc->cols);
+        if (mode == 1) screen_erase(sc, sc->cy, 0, sc->cx + 1);
+        for (int r = from; r < to; r++) screen_erase(sc, r, 0, sc->cols);
+        screen_damage(tab, 0, sc->rows - 1);
+        break;
+    }
+    case 'K': {
+        int mode = vt_param(sc, 0, 0);
+        screen_erase(sc, sc->cy, mode == 0 ? sc->cx : 0, mode == 1 ? sc->cx + 1 : sc->cols);
+        screen_damage(tab, sc->cy, sc->cy);
+        break;
+    }
+    case 'X': {
+        int to = sc->cx + n < sc->cols ? sc->cx + n : sc->cols;
+        screen_erase(sc, sc->cy, sc->cx, to);
+        screen_damage(tab, sc->cy, sc->cy);
+        break;
+    }
+    case '@': case 'P': {
+        // Insert or delete characters, shifting the rest of the row
+        Cell *row = screen_row(sc, sc->cy);
+        screen_touch(sc, sc->cy, sc->cols);
+        if (n > sc->cols - sc->cx) n = sc->cols - sc->cx;
+        int keep = sc->cols - sc->cx - n;
+        if (c == '@') {
+            memmove(row + sc->cx + n, row + sc->cx, keep * sizeof(Cell));
+            for (int i = sc->cx; i < sc->cx + n; i++) row[i] = BLANK_CELL;
+        } else {
+            memmove(row + sc->cx, row + sc->cx + n, keep * sizeof(Cell));
+            for (int i = sc->cols - n; i < sc->cols; i++) row[i] = BLANK_CELL;
         }
+        sc->wrap_pending = 0;
+        screen_damage(tab, sc->cy, sc->cy);
+        break;
     }
-    
-    // If no exact match, find best substring match
-    int best_match_index = -1;
-    int best_match_length = 0;
-    
-    for (int i = history_count - 1; i >= 0; i--) {
-        int match_len = longest_common_substring(search_term, history[i]);
-        if (match_len > best_match_length && match_len > 2) {
-            best_match_length = match_len;
-            best_match_index = i;
+    case 'L': case 'M':
+        // Lines are inserted or deleted inside the scroll region only
+        if (sc->cy >= sc->top && sc->cy <= sc->bottom) {
+            if (c == 'L') screen_scroll_down(tab, sc->cy, sc->bottom, n);
+            else if (sc->cy > 0 || sc->bottom < sc->rows - 1 || sc->alt) screen_scroll_up(tab, sc->cy, sc->bottom, n);
+            else {
+                // Deleted lines do not belong in the scrollback
+                for (int r = 0; r + n <= sc->bottom; r++) screen_copy_row(sc, r, r + n);
+                for (int r = sc->bottom - n + 1; r <= sc->bottom; r++) if (r >= 0) screen_clear_row(sc, r);
+                screen_damage(tab, 0, sc->bottom);
+            }
+            sc->cx = 0;
+            sc->wrap_pending = 0;
+        }
+        break;
+    case 'S': screen_scroll_up(tab, sc->top, sc->bottom, n); break;
+    case 'T': screen_scroll_down(tab, sc->top, sc->bottom, n); break;
+    case 'm': vt_sgr(sc); break;
+    case 'r': {
+        int top = vt_param(sc, 0, 1) - 1, bottom = vt_param(sc, 1, sc->rows) - 1;
+        if (bottom >= sc->rows) bottom = sc->rows - 1;
+        if (top < bottom) {
+            sc->top = top;
+            sc->bottom = bottom;
+            screen_move(tab, 0, 0);
         }
+        break;
     }
-    
-    if (best_match_index != -1) {
-        char result[MAX_LINE_LEN + 100];
-        snprintf(result, sizeof(result), "Closest match (substring length %d): %s\n", 
-                 best_match_length, history[best_match_index]);
-        draw_output(win, gc, tab, result);
-    } else {
-        draw_output(win, gc, tab, "No match for search term in history\n");
+    case 'c':
+    case 'n': {
+        // Device attributes and status reports are answered through the pty
+        char reply[32];
+        if (c == 'c')
+            strcpy(reply, "\033[?6c");
+        else if (vt_param(sc, 0, 0) == 6)
+            snprintf(reply, sizeof(reply), "\033[%d;%dR", sc->cy + 1, sc->cx + 1);
+        else if (vt_param(sc, 0, 0) == 5)
+            strcpy(reply, "\033[0n");
+        else
+            break;
+        if (tab->pty >= 0 && write(tab->pty, reply, strlen(reply)) < 0) {}
+        break;
+    }
+    case 's':
+        sc->saved_cx = sc->cx;
+        sc->saved_cy = sc->cy;
+        sc->saved_attr = sc->attr;
+        break;
+    case 'u':
+        screen_move(tab, sc->saved_cx, sc->saved_cy);
+        sc->attr = sc->saved_attr;
+        break;
     }
 }
 
-/* ---- History command ---- */
-static void show_history(Tab *tab, Window win, GC gc) {
-    int start = (history_count > 1000) ? history_count - 1000 : 0;
-    
-    for (int i = start; i < history_count; i++) {
-        char line[MAX_LINE_LEN + 20];
-        snprintf(line, sizeof(line), "%5d  %s\n", i + 1, history[i]);
-        draw_output(win, gc, tab, line);
+static void tab_prompt(Tab *tab);
+
+// Interpret n bytes of child output
+static void vt_feed(Tab *tab, const unsigned char *s, size_t n) {
+    VtScreen *sc = &tab->screen;
+    size_t i = 0;
+    while (i < n) {
+        if (sc->state == VT_GROUND && !sc->utf8_left) {
+            size_t run = printable_run(s + i, n - i);
+            if (run) {
+                screen_put_run(tab, s + i, run);
+                i += run;
+                if (i == n) break;
+            }
+            // Line ends are by far the commonest controls
+            if (s[i] == '\n') {
+                screen_linefeed(tab);
+                i++;
+                continue;
+            }
+            if (s[i] == '\r') {
+                sc->cx = 0;
+                sc->wrap_pending = 0;
+                i++;
+                continue;
+            }
+        }
+        unsigned char c = s[i++];
+        unsigned char t = vt_table[sc->state][c];
+        switch (t & 0x0f) {
+        case VA_PRINT:
+            screen_print(tab, c);
+            break;
+        case VA_EXECUTE:
+            vt_execute(tab, c);
+            break;
+        case VA_CLEAR:
+            sc->nparams = 0;
+            sc->private_marker = 0;
+            sc->intermediate = 0;
+            sc->osc_len = 0;
+            break;
+        case VA_COLLECT:
+            if (c >= 0x3c) sc->private_marker = c;
+            else sc->intermediate = c;
+            break;
+        case VA_PARAM:
+            if (sc->nparams == 0) sc->params[sc->nparams++] = 0;
+            if (c == ';' || c == ':') {
+                if (sc->nparams < VT_MAX_PARAMS) sc->params[sc->nparams++] = 0;
+            } else if (sc->params[sc->nparams - 1] < 10000) {
+                sc->params[sc->nparams - 1] = sc->params[sc->nparams - 1] * 10 + (c - '0');
+            }
+            break;
+        case VA_ESC_DISPATCH:
+            vt_esc_dispatch(tab, c);
+            break;
+        case VA_CSI_DISPATCH:
+            vt_csi_dispatch(tab, c);
+            break;
+        case VA_OSC_PUT:
+            if (sc->osc_len < VT_OSC_MAX - 1) sc->osc[sc->osc_len++] = c;
+            break;
+        case VA_OSC_END:
+            // Window titles and the like are not used
+            sc->osc[sc->osc_len] = '\0';
+            if (strcmp(sc->osc, PROMPT_OSC) == 0) tab_prompt(tab);
+            break;
+        }
+        sc->state = t >> 4;
     }
 }
-/* ---- Auto-complete functions ---- */
-static char* find_common_prefix(char **strings, int count) {
-    if (count == 0) return NULL;
-    
-    static char prefix[MAX_LINE_LEN];
-    strncpy(prefix, strings[0], MAX_LINE_LEN - 1);
-    prefix[MAX_LINE_LEN - 1] = '\0';
-    
-    for (int i = 1; i < count; i++) {
-        int j = 0;
-        while (prefix[j] && strings[i][j] && prefix[j] == strings[i][j]) {
-            j++;
-        }
-        prefix[j] = '\0';
-        if (j == 0) break;
+
+/* ---- Screen lifetime ---- */
+static int screen_alloc(VtScreen *sc, int rows, int cols) {
+    sc->cells = malloc((size_t)rows * cols * sizeof(Cell));
+    sc->extent = calloc(rows, sizeof(int));
+    sc->scratch = malloc((size_t)cols * 6 + 2);
+    if (!sc->cells || !sc->extent || !sc->scratch) return -1;
+    for (size_t i = 0; i < (size_t)rows * cols; i++) sc->cells[i] = BLANK_CELL;
+    sc->rows = rows;
+    sc->cols = cols;
+    sc->base = 0;
+    return 0;
+}
+
+static void screen_free(VtScreen *sc) {
+    free(sc->cells);
+    free(sc->extent);
+    free(sc->alt_cells);
+    free(sc->alt_extent);
+    free(sc->scratch);
+    sc->cells = sc->alt_cells = NULL;
+    sc->extent = sc->alt_extent = NULL;
+    sc->scratch = NULL;
+}
+
+// Grid size for the current window
+static void screen_size(int *rows, int *cols) {
+    *rows = view_lines() + 1;
+    *cols = text_columns();
+    if (*rows < 1) *rows = 1;
+    if (*cols < 2) *cols = 2;
+}
+
+static void screen_init(Tab *tab) {
+    VtScreen *sc = &tab->screen;
+    int rows, cols;
+    screen_size(&rows, &cols);
+    if (screen_alloc(sc, rows, cols) < 0) errx(1, "Out of memory");
+    sc->used = 1;
+    screen_reset(tab);
+}
+
+// Start a command on a clean screen
+static void screen_begin(Tab *tab) {
+    screen_reset(tab);
+    tab->screen.used = 1;
+    tab->busy = 1;
+    tab_damage(tab, sb_end(&tab->sb), sb_end(&tab->sb));
+}
+
+// The command has finished: its rows become scrollback lines and the input line returns
+static void screen_finish(Tab *tab) {
+    VtScreen *sc = &tab->screen;
+    if (!tab->busy) return;
+    screen_set_alt(tab, 0);
+    int n = sc->used;
+    // An empty row the cursor went down to is not part of the output
+    if (n > 0 && sc->cy == n - 1 && screen_row_len(sc, n - 1) == 0) n--;
+    unsigned long first = sb_end(&tab->sb);
+    int following = tab_following(tab);
+    for (int r = 0; r < n; r++) {
+        // The rows are already counted in the view, so only eviction moves it
+        unsigned int flags;
+        size_t len = screen_encode_row(sc, r, &flags);
+        if (sb_push(&tab->sb, (const char *)sc->scratch, len, flags) && tab->scroll_y > 0)
+            tab->scroll_y--;
     }
-    return prefix;
+    int old_used = sc->used;
+    tab->busy = 0;
+    screen_reset(tab);
+    sc->used = 1;
+    if (following) tab_follow(tab);
+    // Rows keep their absolute number; only the input row and whatever was below it change
+    tab_damage(tab, sb_end(&tab->sb), first + old_used);
 }
 
-static void get_files_starting_with(const char *prefix, char ***matches, int *match_count) {
-    DIR *dir = opendir(".");
-    if (!dir) return;
-    
-    struct dirent *entry;
-    *matches = NULL;
-    *match_count = 0;
-    
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip hidden files and directories
-        if (entry->d_name[0] == '.') continue;
-        
-        if (strncmp(entry->d_name, prefix, strlen(prefix)) == 0) {
-            *matches = realloc(*matches, (*match_count + 1) * sizeof(char*));
-            (*matches)[*match_count] = strdup(entry->d_name);
-            (*match_count)++;
+// Fit the screen to a new window size; rows that no longer fit go to the scrollback.
+// old_view is view_lines() before the size changed: a tab that showed its
+// last row then still shows it.
+static void screen_resize(Tab *tab, int old_view) {
+    VtScreen *sc = &tab->screen;
+    int rows, cols;
+    screen_size(&rows, &cols);
+    if (rows == sc->rows && cols == sc->cols) return;
+
+    int following = tab_follows(tab, old_view);
+    int alt = sc->alt;
+    if (tab->busy) screen_set_alt(tab, 0);
+    int drop = 0;
+    if (tab->busy && sc->used > rows) {
+        drop = sc->used - rows;
+        for (int r = 0; r < drop; r++) {
+            unsigned int flags;
+            size_t len = screen_encode_row(sc, r, &flags);
+            if (sb_push(&tab->sb, (const char *)sc->scratch, len, flags) && tab->scroll_y > 0)
+                tab->scroll_y--;
         }
+    } else if (!tab->busy) {
+        sc->used = 1;
     }
-    closedir(dir);
+
+    VtScreen old = *sc;
+    if (screen_alloc(sc, rows, cols) < 0) errx(1, "Out of memory");
+    int w = old.cols < cols ? old.cols : cols;
+    for (int r = 0; r + drop < old.rows && r < rows; r++) {
+        memcpy(screen_row(sc, r), screen_row(&old, r + drop), w * sizeof(Cell));
+        int e = *screen_extent(&old, r + drop);
+        *screen_extent(sc, r) = e < w ? e : w;
+    }
+    screen_free(&old);
+    sc->alt_cells = NULL;
+    sc->alt_extent = NULL;
+
+    sc->used = old.used - drop;
+    if (sc->used > rows) sc->used = rows;
+    if (sc->used < 1) sc->used = 1;
+    sc->cy -= drop;
+    sc->saved_cy -= drop;
+    if (sc->cy < 0) sc->cy = 0;
+    if (sc->cy >= rows) sc->cy = rows - 1;
+    if (sc->cx >= cols) sc->cx = cols - 1;
+    sc->wrap_pending = 0;
+    sc->top = 0;
+    sc->bottom = rows - 1;
+    // The alternate screen's contents are lost; the program redraws on resize
+    if (alt) screen_set_alt(tab, 1);
+
+    if (following) {
+        int last = tab_rows(tab) - 1;
+        tab->scroll_y = last > view_lines() ? last - view_lines() : 0;
+    }
+    if (tab->scroll_y > tab_rows(tab) - 1) tab->scroll_y = tab_rows(tab) - 1;
 }
 
-static void auto_complete(Tab *tab, Window win, GC gc) {
-    // If we're already in selection mode, don't auto-complete again
-    if (selection_mode) return;
-    
-    char *line = tab->lines[tab->current_line];
-    int line_len = strlen(line);
-    
-    // Find the last word in the line (for completion)
-    int word_start = line_len - 1;
-    while (word_start >= 0 && line[word_start] != ' ' && line[word_start] != '\t') {
-        word_start--;
+/* ---- Output handling ----
+ * Text is split into lines where it lies, with memchr, and each line is
+ * copied once, into the scrollback.  Nothing is allocated per chunk.  A line
+ * is only complete at its '\n': readers that get output in pieces keep the
+ * unfinished end until the rest arrives (the screen of a tab's pty, the
+ * buffer of a multiWatch command).
+ */
+// Add len bytes of text to the scrollback without painting; a last line
+// without '\n' is still a line, and empty lines are kept
+static void ingest_text(Tab *tab, const char *text, size_t len) {
+    const char *end = text + len;
+    while (text < end) {
+        const char *nl = memchr(text, '\n', end - text);
+        const char *stop = nl ? nl : end;
+        tab_push_line(tab, text, stop - text, 0);
+        text = stop + 1;
     }
-    word_start++; // Move to start of word
-    
-    char prefix[MAX_LINE_LEN];
-    strncpy(prefix, line + word_start, MAX_LINE_LEN - 1);
-    prefix[MAX_LINE_LEN - 1] = '\0';
-    
-    if (strlen(prefix) == 0) return;
-    
-    char **matches = NULL;
-    int match_count = 0;
-    get_files_starting_with(prefix, &matches, &match_count);
-    
-    if (match_count == 0) {
-        // No matches - do nothing
-        if (matches) free(matches);
-        return;
+}
+
+static void ingest_output(Tab *tab, const char *output) {
+    if (output) ingest_text(tab, output, strlen(output));
+}
+
+// Output between commands (job notices and the like) goes straight to the scrollback
+static void tab_flush_idle_output(Tab *tab) {
+    if (!tab->busy && (tab->screen.used > 1 || screen_row_len(&tab->screen, 0) > 0)) {
+        tab->busy = 1;
+        screen_finish(tab);
     }
-    else if (match_count == 1) {
-        // Single match - complete it
-        int prefix_len = strlen(prefix);
-        int match_len = strlen(matches[0]);
+}
+
+static void draw_output(Window win, GC gc, Tab *tab, const char *output) {
+    ingest_output(tab, output);
+    request_frame(win, gc, tab);
+}
+
+static unsigned long output_read = 0; // bytes taken in by ingest_fd (see script_report)
+
+// Feed up to budget bytes of what is readable from fd to the tab's screen; the
+// rest waits for the next wakeup. Returns the last read() result.
+static ssize_t ingest_fd(Tab *tab, int fd, size_t budget) {
+    unsigned char buf[65536];
+    ssize_t n;
+    size_t done = 0;
+    while ((n = read(fd, buf, budget - done < sizeof(buf) ? budget - done : sizeof(buf))) > 0) {
+        vt_feed(tab, buf, n);
+        // Between commands, a line is passed on once it is complete
+        if (!tab->busy && screen_row_len(&tab->screen, tab->screen.cy) == 0)
+            tab_flush_idle_output(tab);
+        done += n;
+        output_read += n;
+        if (done >= budget) break;
+    }
+    return n;
+}
+
+/* ---- Launcher ----
+ * Shells are forked by a small helper process started at the top of main(),
+ * before the X connection, history and tab state exist.  Forking from the GUI
+ * means copying the page tables of everything it has touched; the launcher
+ * stays a few hundred KB.  A spawn request carries the window size, the reply
+ * carries the shell's pid with the pty master attached via SCM_RIGHTS.
+ * Without a launcher (it failed to start or died) the GUI forks itself.
+ * The launcher also compacts the history file, so the GUI never waits for it.
+ */
+enum { LAUNCH_SHELL, LAUNCH_COMPACT_HISTORY }; // the second one gets no reply
+
+typedef struct {
+    int kind;
+    int rows, cols;
+} LaunchRequest;
+
+typedef struct {
+    pid_t pid;
+    int err;
+} LaunchReply;
+
+static int launcher_fd = -1;
+
+static void history_compact(void);
+
+// Open a pty sized rows x cols with echo off and fork an interactive sh on it.
+// Returns the master fd and sets *pid, or -1 with errno set.
+static int pty_spawn_shell(int rows, int cols, pid_t *pid) {
+    int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (master < 0) return -1;
+    const char *name = grantpt(master) == 0 && unlockpt(master) == 0 ? ptsname(master) : NULL;
+    if (!name) {
+        close(master);
+        return -1;
+    }
+    struct winsize ws = {0};
+    ws.ws_row = rows;
+    ws.ws_col = cols;
+    ioctl(master, TIOCSWINSZ, &ws);
+    struct termios t;
+    if (tcgetattr(master, &t) == 0) {
+        t.c_lflag &= ~ECHO;
+        tcsetattr(master, TCSANOW, &t);
+    }
+
+    *pid = fork();
+    if (*pid == 0) {
+        // New session whose controlling terminal is the pty, so job control works
+        setsid();
+        int slave = open(name, O_RDWR);
+        if (slave < 0) _exit(127);
+        ioctl(slave, TIOCSCTTY, 0);
+        dup2(slave, STDIN_FILENO);
+        dup2(slave, STDOUT_FILENO);
+        dup2(slave, STDERR_FILENO);
+        if (slave > STDERR_FILENO) close(slave);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL); // ignored in the launcher, and SIG_IGN survives exec
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL); // the GUI blocks SIGCHLD/SIGINT
+        setenv("TERM", "xterm-256color", 1);
+        setenv("PS1", "\033]" PROMPT_OSC "\007", 1);
+        setenv("PS2", "", 1);
+        unsetenv("ENV"); // a startup file could replace PS1
+        // Lines are edited in the GUI; a shell's own editor (readline when sh
+        // is bash) would echo its redraws ahead of every command's output
+        execlp("sh", "sh", "+o", "emacs", "+o", "vi", "-i", NULL);
+        _exit(127);
+    }
+    if (*pid < 0) {
+        int e = errno;
+        close(master);
+        errno = e;
+        return -1;
+    }
+    return master;
+}
+
+static void launcher_main(int sock) {
+    // Shells are reaped by the kernel; the GUI only sees the pty hang up
+    signal(SIGCHLD, SIG_IGN);
+    LaunchRequest req;
+    while (recv(sock, &req, sizeof(req), 0) == sizeof(req)) {
+        if (req.kind == LAUNCH_COMPACT_HISTORY) {
+            history_compact();
+            continue;
+        }
+        LaunchReply reply = {0};
+        int master = pty_spawn_shell(req.rows, req.cols, &reply.pid);
+        if (master < 0) reply.err = errno ? errno : EIO;
+
+        struct iovec iov = { &reply, sizeof(reply) };
+        union {
+            struct cmsghdr hdr;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } ctrl;
+        struct msghdr msg = {0};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if (master >= 0) {
+            msg.msg_control = ctrl.buf;
+            msg.msg_controllen = sizeof(ctrl.buf);
+            struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+            c->cmsg_level = SOL_SOCKET;
+            c->cmsg_type = SCM_RIGHTS;
+            c->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(c), &master, sizeof(int));
+        }
+        sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (master >= 0) close(master);
+    }
+    _exit(0); // the GUI closed its end
+}
+
+static void launcher_start(void) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) return;
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(sv[0]);
+        launcher_main(sv[1]);
+    }
+    close(sv[1]);
+    if (pid < 0) {
+        close(sv[0]);
+        return;
+    }
+    launcher_fd = sv[0];
+}
+
+// Ask the launcher for a shell. Returns the pty master, or -1 if the launcher is gone.
+static int launcher_spawn(int rows, int cols, pid_t *pid) {
+    LaunchRequest req = { LAUNCH_SHELL, rows, cols };
+    if (send(launcher_fd, &req, sizeof(req), MSG_NOSIGNAL) != sizeof(req)) goto dead;
+
+    LaunchReply reply;
+    struct iovec iov = { &reply, sizeof(reply) };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctrl;
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+    ssize_t n;
+    while ((n = recvmsg(launcher_fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+        ;
+    if (n != sizeof(reply)) goto dead;
+
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    if (reply.err || !c || c->cmsg_type != SCM_RIGHTS) {
+        errno = reply.err ? reply.err : EIO;
+        return -1;
+    }
+    int master;
+    memcpy(&master, CMSG_DATA(c), sizeof(int));
+    *pid = reply.pid;
+    return master;
+
+dead:
+    close(launcher_fd);
+    launcher_fd = -1;
+    return -1;
+}
+
+/* ---- Tab / Shell initialization ----
+ * Each tab runs one interactive sh on a pseudo-terminal for its whole life,
+ * so cd, exports, variables and jobs persist between commands.  Line editing
+ * stays in the GUI: a finished line is written to the shell with terminal
+ * echo off, and keys go to the pty only while a command is running.  The
+ * shell's PS1 is an OSC sequence that tells us the command has finished.
+ */
+static void tab_set_winsize(Tab *tab) {
+    struct winsize ws = {0};
+    ws.ws_row = tab->screen.rows;
+    ws.ws_col = tab->screen.cols;
+    if (tab->pty >= 0) ioctl(tab->pty, TIOCSWINSZ, &ws);
+}
+
+static void tab_set_echo(Tab *tab, int on) {
+    struct termios t;
+    if (tab->pty < 0 || tcgetattr(tab->pty, &t) < 0) return;
+    if (on) t.c_lflag |= ECHO;
+    else t.c_lflag &= ~ECHO;
+    tcsetattr(tab->pty, TCSANOW, &t);
+    tab->echo = on;
+}
+
+static int tab_spawn_shell(Tab *tab) {
+    pid_t pid = -1;
+    int master = launcher_fd >= 0 ? launcher_spawn(tab->screen.rows, tab->screen.cols, &pid) : -1;
+    if (master < 0 && launcher_fd < 0) master = pty_spawn_shell(tab->screen.rows, tab->screen.cols, &pid);
+    if (master < 0) return -1;
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+    tab->pty = master;
+    tab->echo = 0;
+    tab->shell_pid = pid;
+    tab->pty_src.kind = SRC_PTY;
+    tab->pty_src.tab = tab;
+    reactor_add(master, &tab->pty_src);
+    return 0;
+}
+
+// Write what the pty takes of the queued input; the rest waits for EPOLLOUT,
+// so a shell that is not reading (a long paste, a stopped job) never holds
+// up the window
+static void tab_pty_send(Tab *tab) {
+    size_t sent = 0;
+    while (tab->pty >= 0 && sent < tab->pty_out_len) {
+        ssize_t n = write(tab->pty, tab->pty_out + sent, tab->pty_out_len - sent);
+        if (n > 0) {
+            sent += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EAGAIN) {
+            break;
+        } else {
+            sent = tab->pty_out_len; // the shell is gone; reading the pty tells us so
+            break;
+        }
+    }
+    memmove(tab->pty_out, tab->pty_out + sent, tab->pty_out_len - sent);
+    tab->pty_out_len -= sent;
+
+    int waiting = tab->pty_out_len > 0;
+    if (tab->pty >= 0 && waiting != tab->pty_waiting) {
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN | (waiting ? EPOLLOUT : 0);
+        ev.data.ptr = &tab->pty_src;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, tab->pty, &ev);
+        tab->pty_waiting = waiting;
+    }
+}
+
+// Queue input for the shell behind whatever it has not taken yet
+static void tab_pty_write(Tab *tab, const char *buf, size_t len) {
+    if (tab->pty < 0) return;
+    if (tab->pty_out_len + len > tab->pty_out_cap) {
+        size_t cap = tab->pty_out_cap ? tab->pty_out_cap : 4096;
+        while (tab->pty_out_len + len > cap) cap *= 2;
+        char *grown = realloc(tab->pty_out, cap);
+        if (!grown) return;
+        tab->pty_out = grown;
+        tab->pty_out_cap = cap;
+    }
+    memcpy(tab->pty_out + tab->pty_out_len, buf, len);
+    tab->pty_out_len += len;
+    tab_pty_send(tab);
+}
+
+// The shell printed its prompt: whatever was running has finished
+static void tab_prompt(Tab *tab) {
+    tab_flush_idle_output(tab);
+    screen_finish(tab);
+    if (tab->echo) tab_set_echo(tab, 0);
+}
+
+// Shells that hung up before they exited; SIGCHLD reaps them (see shells_reap)
+static pid_t *shells_exiting = NULL;
+static int shells_exiting_count = 0, shells_exiting_cap = 0;
+
+// Reap a shell we forked without waiting for it; one that is still running
+// is left for SIGCHLD.  A shell the launcher forked is not our child (ECHILD).
+static void shell_reap(pid_t pid) {
+    if (pid <= 0 || waitpid(pid, NULL, WNOHANG) != 0) return;
+    if (shells_exiting_count == shells_exiting_cap) {
+        int cap = shells_exiting_cap ? shells_exiting_cap * 2 : 4;
+        pid_t *grown = realloc(shells_exiting, cap * sizeof(pid_t));
+        if (!grown) return;
+        shells_exiting = grown;
+        shells_exiting_cap = cap;
+    }
+    shells_exiting[shells_exiting_count++] = pid;
+}
+
+// SIGCHLD: collect the shells that have exited since
+static void shells_reap(void) {
+    for (int i = 0; i < shells_exiting_count; i++)
+        if (waitpid(shells_exiting[i], NULL, WNOHANG) != 0)
+            shells_exiting[i--] = shells_exiting[--shells_exiting_count];
+}
+
+// The shell went away (EOF or EIO on the pty); a new one starts with the next command
+static void tab_shell_exited(Tab *tab) {
+    close(tab->pty);
+    tab->pty = -1;
+    tab->pty_out_len = 0;
+    tab->pty_waiting = 0;
+    shell_reap(tab->shell_pid);
+    tab->shell_pid = 0;
+    tab_flush_idle_output(tab);
+    screen_finish(tab);
+    ingest_output(tab, "[shell exited]");
+}
+
+// Hand a finished command line to the shell; its output replaces the input row until the next prompt
+static void tab_run_command(Tab *tab, const char *command) {
+    if (tab->pty < 0 && tab_spawn_shell(tab) < 0) {
+        ingest_output(tab, "Cannot start sh");
+        return;
+    }
+    tab_pty_write(tab, command, strlen(command));
+    tab_pty_write(tab, "\n", 1);
+    tab_flush_idle_output(tab);
+    screen_begin(tab);
+}
+
+// Send a key to the running program, encoded as a terminal would
+static void tab_send_key(Tab *tab, KeySym ks, const char *buf, int len) {
+    const char *seq = NULL;
+    switch (ks) {
+    case XK_Return: case XK_KP_Enter: seq = "\r"; break;
+    case XK_BackSpace: seq = "\177"; break;
+    case XK_Up: seq = "\033[A"; break;
+    case XK_Down: seq = "\033[B"; break;
+    case XK_Right: seq = "\033[C"; break;
+    case XK_Left: seq = "\033[D"; break;
+    case XK_Home: seq = "\033[H"; break;
+    case XK_End: seq = "\033[F"; break;
+    case XK_Delete: seq = "\033[3~"; break;
+    case XK_Prior: seq = "\033[5~"; break;
+    case XK_Next: seq = "\033[6~"; break;
+    }
+    if (seq) {
+        buf = seq;
+        len = strlen(seq);
+    }
+    if (len <= 0 || tab->pty < 0) return;
+    // Programs reading the terminal line by line expect to see what is typed
+    if (!tab->echo) tab_set_echo(tab, 1);
+    tab_pty_write(tab, buf, len);
+}
+
+static void init_tab(Tab *tab) {
+    memset(tab, 0, sizeof(Tab));
+    sb_init(&tab->sb, scrollback_lines);
+    screen_init(tab);
+    tab->input_is_command = 1;
+    tab_clear_damage(tab);
+    tab->drawn_input_row = NO_ROW;
+    tab->pty = -1;
+    if (tab_spawn_shell(tab) < 0) ingest_output(tab, "Cannot start sh");
+    tab->scroll_y = 0;
+    tab->scroll_x = 0;
+    
+    // Initialize selection state
+    tab->selection_input[0] = '\0';
+    tab->selection_input_pos = 0;
+}
+
+// Open a tab after the others and make it current.  Tabs are allocated one
+// at a time and tabs[] only holds pointers, so a Tab never moves while event
+// sources point into it.
+static Tab *create_new_tab(void) {
+    if (total_tabs == tabs_cap) {
+        int cap = tabs_cap ? tabs_cap * 2 : 4;
+        Tab **grown = realloc(tabs, cap * sizeof(Tab *));
+        if (!grown) return NULL;
+        tabs = grown;
+        tabs_cap = cap;
+    }
+    Tab *tab = malloc(sizeof(Tab));
+    if (!tab) return NULL;
+    init_tab(tab);
+    tab->command[0] = '\0';
+    tabs[total_tabs++] = tab;
+    current_tab = total_tabs - 1;
+    return tab;
+}
+
+static void watch_free(Watch *w);
+
+// Hang up the tab's shell and free everything the tab holds
+static void close_tab(int i) {
+    Tab *tab = tabs[i];
+    if (tab->watch) watch_free(tab->watch);
+    if (tab->shell_pid > 0) kill(tab->shell_pid, SIGHUP);
+    if (tab->pty >= 0) close(tab->pty);   // also drops it from the epoll set
+    shell_reap(tab->shell_pid);
+    free(tab->pty_out);
+    sb_free(&tab->sb);
+    screen_free(&tab->screen);
+    surface_free(&tab->surface);
+    if (shared_surface.tab == tab) shared_surface.tab = NULL;
+    free(tab);
+
+    memmove(tabs + i, tabs + i + 1, (total_tabs - i - 1) * sizeof(Tab *));
+    total_tabs--;
+    if (current_tab > i || current_tab == total_tabs) current_tab--;
+}
+/* ---- Pipelines ----
+ * A command line made of words, quotes, pipes and redirections is run
+ * without a shell: each stage is exec'd directly with posix_spawnp() and
+ * connected with close-on-exec pipes, all in one process group.  Anything
+ * else (variables, globs, lists, builtins, ...) goes to a single `sh -c`.
+ */
+#define MAX_STAGES 20
+#define MAX_ARGS 64
+#define MAX_REDIRS 8
+
+typedef struct {
+    int fd;          // descriptor being redirected
+    int dup_of;      // n>&m: copy of this descriptor, or -1 to open path
+    int flags;       // open() flags
+    const char *path;
+} Redirect;
+
+typedef struct {
+    char *argv[MAX_ARGS + 1];
+    int argc;
+    Redirect redirs[MAX_REDIRS];
+    int nredirs;
+} Stage;
+
+typedef struct {
+    Stage stages[MAX_STAGES];
+    int count;
+    char *words; // storage for every word
+} Pipeline;
+
+// Builtins that have no executable of their own
+static int is_shell_builtin(const char *word) {
+    static const char *const builtins[] = {
+        "cd", "export", "unset", "set", "alias", "unalias", "source", ".", "exit", "exec", "eval",
+        "read", "ulimit", "umask", "wait", "jobs", "fg", "bg", "trap", "type", "command", "shift",
+        "local", "return", "break", "continue", "readonly", "hash", "times", "getopts", NULL,
+    };
+    for (int i = 0; builtins[i]; i++)
+        if (strcmp(word, builtins[i]) == 0) return 1;
+    return 0;
+}
+
+static const char *pathindex_lookup(const char *name);
+
+// Split a command line into stages.  Returns 0, or -1 if it needs a shell.
+static int parse_pipeline(const char *line, Pipeline *pl) {
+    memset(pl, 0, sizeof(*pl));
+    pl->words = malloc(2 * strlen(line) + 2);
+    if (!pl->words) return -1;
+    char *out = pl->words;
+    Stage *st = &pl->stages[0];
+    pl->count = 1;
+    int redir_fd = -1, redir_flags = 0; // a redirection waiting for its file name
+    const char *p = line;
+
+    while (1) {
+        while (*p == ' ' || *p == '\t') p++;
+        if (!*p) break;
+
+        if (*p == '|') {
+            if (p[1] == '|' || st->argc == 0 || redir_fd >= 0 || pl->count == MAX_STAGES) return -1;
+            st = &pl->stages[pl->count++];
+            p++;
+            continue;
+        }
+
+        // Redirection operators: [n]<, [n]>, [n]>>, [n]>&m
+        int fd = -1;
+        const char *q = p;
+        if (*q >= '0' && *q <= '2' && (q[1] == '<' || q[1] == '>')) fd = *q++ - '0';
+        if (*q == '<' || *q == '>') {
+            if (redir_fd >= 0 || st->nredirs == MAX_REDIRS) return -1;
+            int in = *q == '<';
+            if (fd < 0) fd = in ? 0 : 1;
+            q++;
+            if (in) {
+                redir_flags = O_RDONLY;
+            } else if (*q == '>') {
+                redir_flags = O_WRONLY | O_CREAT | O_APPEND;
+                q++;
+            } else {
+                redir_flags = O_WRONLY | O_CREAT | O_TRUNC;
+            }
+            if (!in && *q == '&') {
+                if (q[1] < '0' || q[1] > '2' || (q[2] && q[2] != ' ' && q[2] != '\t' && q[2] != '|'))
+                    return -1;
+                st->redirs[st->nredirs++] = (Redirect){fd, q[1] - '0', 0, NULL};
+                p = q + 2;
+                continue;
+            }
+            if (*q == '<' || *q == '>' || *q == '&' || *q == '|') return -1; // <<, <>, &>, >|
+            redir_fd = fd;
+            p = q;
+            continue;
+        }
+
+        // A word, with quoting removed
+        char *word = out;
+        while (*p && *p != ' ' && *p != '\t' && *p != '|' && *p != '<' && *p != '>') {
+            if (*p == '\'') {
+                const char *end = strchr(p + 1, '\'');
+                if (!end) return -1;
+                memcpy(out, p + 1, end - p - 1);
+                out += end - p - 1;
+                p = end + 1;
+            } else if (*p == '"') {
+                for (p++; *p != '"'; p++) {
+                    if (!*p || *p == '$' || *p == '`') return -1;
+                    if (*p == '\\' && (p[1] == '"' || p[1] == '\\')) p++;
+                    *out++ = *p;
+                }
+                p++;
+            } else if (*p == '\\') {
+                if (!p[1]) return -1;
+                *out++ = p[1];
+                p += 2;
+            } else if (strchr(";&()$`*?[]{}\n", *p) || (out == word && (*p == '~' || *p == '#'))) {
+                return -1;
+            } else {
+                *out++ = *p++;
+            }
+        }
+        *out++ = '\0';
+
+        if (redir_fd >= 0) {
+            st->redirs[st->nredirs++] = (Redirect){redir_fd, -1, redir_flags, word};
+            redir_fd = -1;
+        } else {
+            if (st->argc == MAX_ARGS) return -1;
+            if (st->argc == 0 && (is_shell_builtin(word) || strchr(word, '='))) return -1;
+            st->argv[st->argc++] = word;
+        }
+    }
+    if (st->argc == 0 || redir_fd >= 0) return -1;
+    return 0;
+}
+
+// Start every stage of pl.  The last stage's stdout and every stage's stderr
+// go to out_fd unless redirected; in_fd (or -1) feeds the first stage.
+// pids[i] is -1 for a stage that could not be started.
+static void spawn_pipeline(Pipeline *pl, int in_fd, int out_fd, pid_t pids[]) {
+    int pipes[MAX_STAGES][2];
+    for (int i = 0; i < pl->count - 1; i++) {
+        if (pipe2(pipes[i], O_CLOEXEC) < 0) pipes[i][0] = pipes[i][1] = -1;
+    }
+
+    sigset_t defaults, none;
+    sigemptyset(&none);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGTSTP);
+    sigaddset(&defaults, SIGPIPE);
+
+    pid_t pgid = 0;
+    for (int i = 0; i < pl->count; i++) {
+        Stage *st = &pl->stages[i];
+        posix_spawn_file_actions_t fa;
+        posix_spawnattr_t attr;
+        posix_spawn_file_actions_init(&fa);
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+        posix_spawnattr_setpgroup(&attr, pgid);
+        posix_spawnattr_setsigdefault(&attr, &defaults);
+        posix_spawnattr_setsigmask(&attr, &none);
+
+        int in = i > 0 ? pipes[i - 1][0] : in_fd;
+        int out = i < pl->count - 1 ? pipes[i][1] : out_fd;
+        if (in >= 0) posix_spawn_file_actions_adddup2(&fa, in, STDIN_FILENO);
+        if (out >= 0) posix_spawn_file_actions_adddup2(&fa, out, STDOUT_FILENO);
+        if (out_fd >= 0) posix_spawn_file_actions_adddup2(&fa, out_fd, STDERR_FILENO);
+        for (int r = 0; r < st->nredirs; r++) {
+            Redirect *rd = &st->redirs[r];
+            if (rd->dup_of >= 0)
+                posix_spawn_file_actions_adddup2(&fa, rd->dup_of, rd->fd);
+            else
+                posix_spawn_file_actions_addopen(&fa, rd->fd, rd->path, rd->flags, 0644);
+        }
+
+        // A path from the PATH index saves posix_spawnp() trying each PATH
+        // directory in turn; if it has gone stale, fall back to the search
+        st->argv[st->argc] = NULL;
+        const char *exe = strchr(st->argv[0], '/') ? NULL : pathindex_lookup(st->argv[0]);
+        if ((!exe || posix_spawn(&pids[i], exe, &fa, &attr, st->argv, environ) != 0) &&
+            posix_spawnp(&pids[i], st->argv[0], &fa, &attr, st->argv, environ) != 0)
+            pids[i] = -1;
+        else if (pgid == 0)
+            pgid = pids[i];
+        posix_spawn_file_actions_destroy(&fa);
+        posix_spawnattr_destroy(&attr);
+    }
+
+    for (int i = 0; i < pl->count - 1; i++) {
+        if (pipes[i][0] >= 0) close(pipes[i][0]);
+        if (pipes[i][1] >= 0) close(pipes[i][1]);
+    }
+}
+
+// Run a command line like "ls | wc -l | sort" with its output on out_fd.
+// Returns the number of stages (their pids in pids[]), or -1 if nothing could be parsed.
+int execute_piped_command(const char *full_command, int out_fd, pid_t pids[MAX_STAGES])
+{
+    Pipeline pl;
+    if (parse_pipeline(full_command, &pl) < 0) {
+        // One shell for the whole line
+        free(pl.words);
+        memset(&pl, 0, sizeof(pl));
+        pl.count = 1;
+        pl.stages[0].argv[0] = "sh";
+        pl.stages[0].argv[1] = "-c";
+        pl.stages[0].argv[2] = (char *)full_command;
+        pl.stages[0].argc = 3;
+    }
+    spawn_pipeline(&pl, -1, out_fd, pids);
+    free(pl.words);
+    return pl.count;
+}
+
+static int exit_code(int wait_status) {
+    return WIFEXITED(wait_status) ? WEXITSTATUS(wait_status) : 128 + WTERMSIG(wait_status);
+}
+
+// Collect the exit status of every stage (127 if it never started).  With
+// stop set, stages still running are terminated first; returns 1 if any were.
+static int wait_pipeline(pid_t pids[], int count, int status[], int stop)
+{
+    int running = 0;
+    pid_t pgid = 0;
+    for (int i = 0; i < count; i++) {
+        int st = 127 << 8;
+        if (pids[i] > 0) {
+            if (!pgid) pgid = pids[i];
+            if (waitpid(pids[i], &st, stop ? WNOHANG : 0) == 0) {
+                running = 1;
+                continue;
+            }
+            pids[i] = 0;
+        }
+        status[i] = exit_code(st);
+    }
+    // Every stage is in the first one's process group
+    if (running) kill(-pgid, SIGTERM);
+    for (int i = 0; i < count; i++) {
+        int st;
+        if (pids[i] > 0 && waitpid(pids[i], &st, 0) > 0) status[i] = exit_code(st);
+        pids[i] = 0;
+    }
+    return running;
+}
+/* ---- multiWatch ----
+ * multiWatch ["cmd1", "cmd2"@10, ...] reruns every command on its own
+ * interval (WATCH_INTERVAL seconds unless "@seconds" follows it) and prints
+ * its output with a timestamp until Ctrl+C.  It lives in the event loop: one
+ * timerfd is armed for the earliest due command, output pipes are read as
+ * data arrives and SIGCHLD collects exit statuses as soon as a pipeline ends.
+ * First launches are spread over each command's interval so a long list never
+ * forks all at once, and a command still running when it is due again is
+ * left alone and that launch skipped.
+ *
+ * multiWatch -p [...] shows a grid of panes instead, one per command, each
+ * holding only the latest output (at most WATCH_PANE_BYTES), so memory stays
+ * flat however long it runs.  A finished run replaces the pane only if its
+ * hash differs, and only replaced panes are repainted.  -d does the same and
+ * also highlights lines that differ from the previous output.
+ */
+#define WATCH_INTERVAL 2    // default seconds between launches of a command
+#define WATCH_MIN_MS 100    // shortest interval accepted
+#define WATCH_PANE_BYTES 8192
+
+enum { WATCH_LOG, WATCH_PANES, WATCH_DIFF };
+
+typedef struct {
+    char *cmd;
+    long long interval_ms;
+    long long due_ms;       // next launch (now_ms() clock)
+    pid_t pids[MAX_STAGES]; // 0 once reaped
+    int status[MAX_STAGES];
+    int nstages;            // 0 when not running
+    int fd;                 // read end of the output pipe, or -1
+    EventSource src;
+    // Pane view: output of the run in progress, the one shown, and the one before it.
+    // The log view only has cur, holding output that has not been printed yet.
+    char *bufs;             // one allocation holding all three
+    char *cur, *shown, *prev;
+    size_t cur_len, shown_len, prev_len;
+    uint64_t hash;          // of shown and its exit status
+    char header[128];
+    int dirty;              // pane changed since it was painted
+} WatchCmd;
+
+struct Watch {
+    WatchCmd *cmds;
+    int n;
+    int mode;               // WATCH_LOG, WATCH_PANES or WATCH_DIFF
+    int timer;
+    EventSource timer_src;
+};
+
+static void watch_print(Tab *tab, const char *text) {
+    ingest_output(tab, text);
+    if (tab == tabs[current_tab]) frame_pending = 1;
+}
+
+// FNV-1a
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) h = (h ^ p[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+// A run finished: show it in the pane unless it matches what is already there
+static void watch_pane_commit(Tab *tab, WatchCmd *c, int failed) {
+    uint64_t h = hash_bytes(0xcbf29ce484222325ULL, c->cur, c->cur_len);
+    if (failed) h = hash_bytes(h, c->status, c->nstages * sizeof(int));
+    if (h == c->hash && c->header[0]) {
+        c->cur_len = 0;
+        return;
+    }
+
+    char *old = c->prev;
+    c->prev = c->shown;
+    c->prev_len = c->shown_len;
+    c->shown = c->cur;
+    c->shown_len = c->cur_len;
+    c->cur = old;
+    c->cur_len = 0;
+    c->hash = h;
+
+    time_t now = time(NULL);
+    char time_str[16];
+    strftime(time_str, sizeof(time_str), "%H:%M:%S", localtime(&now));
+    int off = snprintf(c->header, sizeof(c->header), "%s  [%s", c->cmd, time_str);
+    if (failed) {
+        off += snprintf(c->header + off, sizeof(c->header) - off, ", exit");
+        for (int j = 0; j < c->nstages && off < (int)sizeof(c->header) - 8; j++)
+            off += snprintf(c->header + off, sizeof(c->header) - off, " %d", c->status[j]);
+    }
+    if (off < (int)sizeof(c->header) - 1) snprintf(c->header + off, sizeof(c->header) - off, "]");
+    c->dirty = 1;
+    if (tab == tabs[current_tab]) frame_pending = 1;
+    else surfaces_stale = 1;
+}
+
+// Report failed stages once the pipeline has exited and its output is drained
+static void watch_finished(Tab *tab, WatchCmd *c) {
+    if (!c->nstages || c->fd >= 0) return;
+    for (int j = 0; j < c->nstages; j++)
+        if (c->pids[j] > 0) return;
+
+    int failed = 0;
+    for (int j = 0; j < c->nstages; j++) failed |= c->status[j] != 0;
+    if (tab->watch->mode != WATCH_LOG) {
+        watch_pane_commit(tab, c, failed);
+    } else if (failed) {
+        char formatted[700];
+        int off = snprintf(formatted, sizeof(formatted), "\"%s\" exit status:", c->cmd);
+        for (int j = 0; j < c->nstages && off < (int)sizeof(formatted) - 8; j++)
+            off += snprintf(formatted + off, sizeof(formatted) - off, " %d", c->status[j]);
+        snprintf(formatted + off, sizeof(formatted) - off, "\n");
+        watch_print(tab, formatted);
+    }
+    c->nstages = 0;
+}
+
+// SIGCHLD: collect whatever has exited without blocking
+static void watch_reap(Tab *tab) {
+    for (int i = 0; i < tab->watch->n; i++) {
+        WatchCmd *c = &tab->watch->cmds[i];
+        for (int j = 0; j < c->nstages; j++) {
+            int st;
+            if (c->pids[j] <= 0) continue;
+            pid_t r = waitpid(c->pids[j], &st, WNOHANG);
+            if (r == 0) continue;
+            if (r > 0) c->status[j] = exit_code(st);
+            c->pids[j] = 0;
+        }
+        watch_finished(tab, c);
+    }
+}
+
+// Print the first n bytes of a command's log output under its name and the time
+static void watch_log(Tab *tab, WatchCmd *c, size_t n) {
+    static const char rule[] = "----------------------------------------------------";
+    if (n == 0) return;
+
+    time_t now = time(NULL);
+    char time_str[64];
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", localtime(&now));
+
+    tab_push_line(tab, "", 0, 0);
+    char title[700];
+    int len = snprintf(title, sizeof(title), "\"%s\", %s:", c->cmd, time_str);
+    tab_push_line(tab, title, len < (int)sizeof(title) ? len : (int)sizeof(title) - 1, 0);
+    tab_push_line(tab, rule, sizeof(rule) - 1, 0);
+    ingest_text(tab, c->cur, n);
+    tab_push_line(tab, rule, sizeof(rule) - 1, 0);
+    if (tab == tabs[current_tab]) frame_pending = 1;
+
+    memmove(c->cur, c->cur + n, c->cur_len - n);
+    c->cur_len -= n;
+}
+
+// Output is read straight into the command's buffer.  A pane keeps the head
+// of it and drops the rest; the log prints whole lines and keeps an
+// unfinished one for the next read, unless it fills the buffer.
+static void watch_output(Tab *tab, int i) {
+    WatchCmd *c = &tab->watch->cmds[i];
+    if (c->fd < 0) return;
+
+    char discard[4096];
+    ssize_t bytes_read;
+    int reads = 0;
+    for (;;) {
+        size_t room = WATCH_PANE_BYTES - c->cur_len;
+        bytes_read = read(c->fd, room ? c->cur + c->cur_len : discard, room ? room : sizeof(discard));
+        if (bytes_read <= 0) break;
+        if (room) c->cur_len += bytes_read;
+        if (tab->watch->mode == WATCH_LOG) {
+            const char *nl = memrchr(c->cur, '\n', c->cur_len);
+            watch_log(tab, c, nl ? (size_t)(nl - c->cur) + 1 : c->cur_len == WATCH_PANE_BYTES ? c->cur_len : 0);
+        }
+        if (++reads == 16) return; // the rest is picked up on the next wakeup
+    }
+
+    if (bytes_read == 0 || (errno != EAGAIN && errno != EINTR)) {
+        // EOF - command finished (closing also drops it from the epoll set)
+        close(c->fd);
+        c->fd = -1;
+        if (tab->watch->mode == WATCH_LOG) watch_log(tab, c, c->cur_len);
+        watch_finished(tab, c);
+    }
+}
+
+static void watch_launch(Tab *tab, WatchCmd *c) {
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        watch_print(tab, "multiWatch: cannot create pipe\n");
+        return;
+    }
+    // Stages are spawned directly; only lines that need a shell get one
+    c->nstages = execute_piped_command(c->cmd, pipefd[1], c->pids);
+    close(pipefd[1]);
+    for (int j = 0; j < c->nstages; j++) c->status[j] = 127;
+    fcntl(pipefd[0], F_SETFL, fcntl(pipefd[0], F_GETFL) | O_NONBLOCK);
+    c->fd = pipefd[0];
+    reactor_add(c->fd, &c->src);
+}
+
+// Arm the timer for the earliest due command
+static void watch_arm(Watch *w) {
+    long long due = w->cmds[0].due_ms;
+    for (int i = 1; i < w->n; i++)
+        if (w->cmds[i].due_ms < due) due = w->cmds[i].due_ms;
+
+    struct itimerspec its = {0};
+    its.it_value.tv_sec = due / 1000;
+    its.it_value.tv_nsec = (due % 1000) * 1000000L + 1; // an all-zero value disarms
+    timerfd_settime(w->timer, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+// The timer fired: launch whatever is due, skipping commands whose last run is still going
+static void watch_tick(Tab *tab) {
+    Watch *w = tab->watch;
+    uint64_t expirations;
+    if (read(w->timer, &expirations, sizeof(expirations)) < 0) return;
+
+    long long now = now_ms();
+    for (int i = 0; i < w->n; i++) {
+        WatchCmd *c = &w->cmds[i];
+        if (c->due_ms > now) continue;
+        if (!c->nstages) watch_launch(tab, c);
+        // Keep the command's phase; launches missed while it ran are dropped
+        while (c->due_ms <= now) c->due_ms += c->interval_ms;
+    }
+    watch_arm(w);
+}
+
+static void watch_free(Watch *w) {
+    for (int i = 0; i < w->n; i++) {
+        WatchCmd *c = &w->cmds[i];
+        wait_pipeline(c->pids, c->nstages, c->status, 1);
+        if (c->fd >= 0) close(c->fd);
+    }
+    for (int i = 0; i < w->n; i++) {
+        free(w->cmds[i].cmd);
+        free(w->cmds[i].bufs);
+    }
+    if (w->timer >= 0) close(w->timer);
+    free(w->cmds);
+    free(w);
+}
+
+static void watch_stop(Tab *tab, Window win, GC gc) {
+    Watch *w = tab->watch;
+    // The last state of every pane stays in the scrollback
+    for (int i = 0; w->mode != WATCH_LOG && i < w->n; i++) {
+        WatchCmd *c = &w->cmds[i];
+        tab_push_line(tab, c->header[0] ? c->header : c->cmd, strlen(c->header[0] ? c->header : c->cmd), 0);
+        for (const char *p = c->shown, *e = c->shown + c->shown_len; p < e;) {
+            const char *nl = memchr(p, '\n', e - p);
+            size_t len = nl ? (size_t)(nl - p) : (size_t)(e - p);
+            tab_push_line(tab, p, len, 0);
+            p += len + 1;
+        }
+    }
+    tab_surface(tab)->tab = NULL;   // rows take the panes' place
+    watch_free(w);
+    tab->watch = NULL;
+    ingest_output(tab, "\nmultiWatch stopped.\n");
+
+    // Reset terminal state properly
+    tab->input[0] = '\0';
+    tab->input_is_command = 1;
+    tab->cursor_pos = 0;
+    tab->scroll_y = tab->sb.count; // Scroll to show the new prompt
+    tab->scroll_x = 0;
+
+    // Clear any partial command
+    tab->command[0] = '\0';
+
+    if (tab == tabs[current_tab]) draw_text(win, gc, tab);
+}
+
+static long long watch_interval(double sec) {
+    long long ms = (long long)(sec * 1000);
+    return ms < WATCH_MIN_MS ? WATCH_MIN_MS : ms;
+}
+
+// Read one list entry: "cmd" or a bare cmd up to the next comma, either one
+// optionally followed by @seconds. Returns the position after it, or NULL at the end.
+static const char *watch_parse_entry(const char *p, const char *end, char **cmd, long long *interval_ms) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+    if (p >= end) return NULL;
+
+    *interval_ms = WATCH_INTERVAL * 1000LL;
+    const char *from = p, *to;
+    char *num_end;
+    if (*p == '"') {
+        from = ++p;
+        while (p < end && *p != '"') p++;
+        to = p;
+        if (p < end) p++;
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        if (p < end && *p == '@') {
+            double sec = strtod(p + 1, &num_end);
+            if (sec > 0) *interval_ms = watch_interval(sec);
+        }
+        while (p < end && *p != ',') p++; // ignore anything else before the next entry
+    } else {
+        while (p < end && *p != ',') p++;
+        to = p;
+        while (to > from && (to[-1] == ' ' || to[-1] == '\t')) to--;
+        // A trailing @number is an interval; user@host is not
+        const char *at = memrchr(from, '@', to - from);
+        if (at) {
+            double sec = strtod(at + 1, &num_end);
+            if (num_end == to && num_end > at + 1 && sec > 0) {
+                *interval_ms = watch_interval(sec);
+                to = at;
+            }
+        }
+    }
+    *cmd = strndup(from, to - from);
+    return p;
+}
+
+// One pane: a frame, the header and as many output lines as fit
+static void draw_pane(Drawable d, GC gc, Watch *w, WatchCmd *c, int x, int y, int pw, int ph) {
+    paint_frame(d, gc, x + 2, y + 2, pw - 5, ph - 5);
+    int cols = (pw - 14) / fm.char_width;
+    int lines = (ph - 10) / fm.line_height - 1;
+    if (cols <= 0 || lines < 0) return;
+    if (cols > 1024) cols = 1024;
+
+    int base = y + 4 + fm.ascent;
+    const char *header = c->header[0] ? c->header : c->cmd;
+    int hlen = strlen(header);
+    draw_segment(d, gc, x + 7, base, header, hlen < cols ? hlen : cols, ATTR_BOLD);
+    paint_line(d, gc, x + 2, y + 5 + fm.line_height, x + pw - 4, y + 5 + fm.line_height);
+
+    const char *p = c->shown, *e = c->shown + c->shown_len;
+    const char *q = c->prev, *qe = c->prev + c->prev_len;
+    for (int k = 0; k < lines && p < e; k++) {
+        const char *nl = memchr(p, '\n', e - p);
+        size_t len = nl ? (size_t)(nl - p) : (size_t)(e - p);
+
+        // Diff against the same line of the previous output
+        int changed = 0;
+        if (w->mode == WATCH_DIFF) {
+            const char *qnl = q < qe ? memchr(q, '\n', qe - q) : NULL;
+            size_t qlen = q < qe ? (qnl ? (size_t)(qnl - q) : (size_t)(qe - q)) : 0;
+            changed = q >= qe || qlen != len || memcmp(p, q, len) != 0;
+            q += qlen + 1;
+        }
+
+        // Tabs become spaces up to the next stop, other control bytes a single space
+        char line[1024];
+        int n = 0;
+        for (size_t i = 0; i < len && n < cols; i++) {
+            unsigned char ch = p[i];
+            if (ch == '\t') {
+                do line[n++] = ' '; while (n % 8 && n < cols);
+            } else {
+                line[n++] = (ch < 0x20 || ch == 0x7f) ? ' ' : ch;
+            }
+        }
+        int ly = base + (k + 1) * fm.line_height + 4;
+        if (changed && n > 0) draw_segment(d, gc, x + 7, ly, line, n, ATTR_REVERSE);
+        else if (n > 0) draw_segment(d, gc, x + 7, ly, line, n, 0);
+        p += len + 1;
+    }
+}
+
+// Paint the tab's multiWatch panes, repainting only the ones that changed.
+// Returns 0 if the tab is not showing panes.
+static int draw_panes(Window win, GC gc, Tab *tab, Surface *s, int present) {
+    Watch *w = tab->watch;
+    if (!w || w->mode == WATCH_LOG) return 0;
+
+    int top = tab_bar_height();
+    int cols = 1;
+    while (cols * cols < w->n) cols++;
+    int rows = (w->n + cols - 1) / cols;
+    int pw = win_width / cols, ph = (win_height - top) / rows;
+
+    int full = tab != s->tab || w != s->watch;
+    if (full) {
+        paint_clear(0, 0, win_width, win_height);
+        draw_tabs(backbuf, gc);
+    } else if (total_tabs != s->total_tabs || current_tab != s->current_tab) {
+        paint_clear(0, 0, win_width, top);
+        draw_tabs(backbuf, gc);
+        if (present) paint_present(win, gc, 0, 0, win_width, top);
+    }
+
+    for (int i = 0; i < w->n; i++) {
+        WatchCmd *c = &w->cmds[i];
+        if (!full && !c->dirty) continue;
+        int x = (i % cols) * pw, y = top + (i / cols) * ph;
+        if (!full) paint_clear(x, y, pw, ph);
+        draw_pane(backbuf, gc, w, c, x, y, pw, ph);
+        if (present && !full) paint_present(win, gc, x, y, pw, ph);
+        c->dirty = 0;
+    }
+    if (present && full) paint_present(win, gc, 0, 0, win_width, win_height);
+
+    s->tab = tab;
+    s->watch = w;
+    s->total_tabs = total_tabs;
+    s->current_tab = current_tab;
+    return 1;
+}
+
+// Some pane has output it does not show yet
+static int watch_dirty(const Watch *w) {
+    for (int i = 0; w->mode != WATCH_LOG && i < w->n; i++)
+        if (w->cmds[i].dirty) return 1;
+    return 0;
+}
+
+void multiWatch(Tab *tab, Window win, GC gc, const char *input_line) {
+    // Parse commands from input: multiWatch [-p|-d] ["cmd1", "cmd2"@10]
+    const char *start = strchr(input_line, '[');
+    const char *end = strrchr(input_line, ']');
+    if (!start || !end || start >= end) {
+        draw_output(win, gc, tab, "Invalid format. Use: multiWatch [-p|-d] [\"cmd1\", \"cmd2\"@seconds]\n");
+        return;
+    }
+
+    Watch *w = calloc(1, sizeof(Watch));
+    if (!w) return;
+    w->timer = -1;
+    for (const char *o = input_line + 10; o + 1 < start; o++) {
+        if (o[0] == '-' && o[1] == 'p') w->mode = WATCH_PANES;
+        if (o[0] == '-' && o[1] == 'd') w->mode = WATCH_DIFF;
+    }
+    int cap = 0;
+    char *cmd;
+    long long interval_ms;
+    const char *p = start + 1;
+    while ((p = watch_parse_entry(p, end, &cmd, &interval_ms))) {
+        if (!cmd || !*cmd) {
+            free(cmd);
+            continue;
+        }
+        if (w->n == cap) {
+            cap = cap ? cap * 2 : 8;
+            WatchCmd *grown = realloc(w->cmds, cap * sizeof(WatchCmd));
+            if (!grown) {
+                free(cmd);
+                break;
+            }
+            w->cmds = grown;
+        }
+        WatchCmd *c = &w->cmds[w->n++];
+        memset(c, 0, sizeof(*c));
+        c->cmd = cmd;
+        c->interval_ms = interval_ms;
+        c->fd = -1;
+        c->bufs = malloc(w->mode != WATCH_LOG ? 3 * WATCH_PANE_BYTES : WATCH_PANE_BYTES);
+        if (!c->bufs) {
+            w->n--;
+            free(cmd);
+            break;
+        }
+        c->cur = c->bufs;
+        if (w->mode != WATCH_LOG) {
+            c->shown = c->bufs + WATCH_PANE_BYTES;
+            c->prev = c->bufs + 2 * WATCH_PANE_BYTES;
+            c->dirty = 1;
+        }
+    }
+
+    if (w->n == 0) {
+        draw_output(win, gc, tab, "No valid commands provided to multiWatch\n");
+        watch_free(w);
+        return;
+    }
+
+    // The array is final now, so the event sources can point into it.
+    // Command i starts i/n of the way into its interval.
+    long long now = now_ms();
+    for (int i = 0; i < w->n; i++) {
+        WatchCmd *c = &w->cmds[i];
+        c->src.kind = SRC_WATCH_OUT;
+        c->src.tab = tab;
+        c->src.index = i;
+        c->due_ms = now + c->interval_ms * i / w->n;
+    }
+
+    w->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    w->timer_src.kind = SRC_WATCH_TIMER;
+    w->timer_src.tab = tab;
+    if (w->timer < 0 || reactor_add(w->timer, &w->timer_src) < 0) {
+        draw_output(win, gc, tab, "multiWatch: cannot create timer\n");
+        watch_free(w);
+        return;
+    }
+    watch_arm(w);
+    tab->watch = w;
+    if (w->mode == WATCH_LOG)
+        draw_output(win, gc, tab, "Starting multiWatch. Press Ctrl+C to stop...\n");
+    else
+        request_frame(win, gc, tab);
+}
+
+/* ---- History storage ----
+ * Every distinct command is stored once.  Its text goes into an append-only
+ * arena of HISTORY_ARENA_BLOCK chunks (a longer command gets a chunk of its
+ * own, so there is no length cap) and an open-addressing table interns it by
+ * hash; the entry keeps how often the command was run and when it last was.
+ * Each run also takes the next use number: history_uses maps use numbers to
+ * entries, and a number counts only while it is its entry's latest, so
+ * walking history_uses backwards lists commands from the most recent.  Once
+ * superseded numbers outnumber the entries, the numbers are packed again and
+ * the search index rebuilt, so memory follows the number of distinct
+ * commands, not the number of runs.
+ */
+#define HISTORY_ARENA_BLOCK (64 * 1024)
+#define HISTORY_RENUMBER_MIN 1024   // superseded use numbers tolerated before packing
+
+typedef struct {
+    const char *text;    // NUL-terminated, in the arena
+    uint32_t len;
+    uint32_t count;      // times run
+    time_t last_used;
+    uint32_t use;        // latest use number
+    uint64_t hash;
+} HistEntry;
+
+static HistEntry *history_entries = NULL;   // history_count of them, in order of first use
+static uint32_t history_entries_cap = 0;
+static uint32_t *history_table = NULL;      // entry index + 1, 0 for an empty slot
+static uint32_t history_table_cap = 0;
+static uint32_t *history_uses = NULL;       // entry index of each use number, from 1
+static uint32_t history_last_use = 0, history_uses_cap = 0;
+static uint32_t history_version = 0;        // bumped on every change
+static char *history_arena = NULL;
+static size_t history_arena_left = 0;
+
+static void hindex_add(uint32_t use, const char *s, size_t len);
+static void hindex_rebuild(void);
+
+static char *history_arena_copy(const char *s, size_t len) {
+    char *p;
+    if (len + 1 > HISTORY_ARENA_BLOCK) {
+        p = malloc(len + 1);
+    } else {
+        if (len + 1 > history_arena_left) {
+            history_arena = malloc(HISTORY_ARENA_BLOCK);
+            history_arena_left = history_arena ? HISTORY_ARENA_BLOCK : 0;
+        }
+        p = history_arena_left ? history_arena : NULL;
+        if (p) {
+            history_arena += len + 1;
+            history_arena_left -= len + 1;
+        }
+    }
+    if (!p) return NULL;
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+static uint64_t history_hash(const char *s, size_t len) {
+    return hash_bytes(0xcbf29ce484222325ULL, s, len);
+}
+
+static HistEntry *history_find(const char *s, size_t len, uint64_t hash) {
+    if (!history_table_cap) return NULL;
+    for (uint32_t h = (uint32_t)hash & (history_table_cap - 1); history_table[h];
+         h = (h + 1) & (history_table_cap - 1)) {
+        HistEntry *e = &history_entries[history_table[h] - 1];
+        if (e->hash == hash && e->len == len && memcmp(e->text, s, len) == 0) return e;
+    }
+    return NULL;
+}
+
+static int history_table_grow(void) {
+    uint32_t cap = history_table_cap ? history_table_cap * 2 : 4096;
+    uint32_t *t = calloc(cap, sizeof(*t));
+    if (!t) return -1;
+    for (uint32_t i = 0; i < (uint32_t)history_count; i++) {
+        uint32_t h = (uint32_t)history_entries[i].hash & (cap - 1);
+        while (t[h]) h = (h + 1) & (cap - 1);
+        t[h] = i + 1;
+    }
+    free(history_table);
+    history_table = t;
+    history_table_cap = cap;
+    return 0;
+}
+
+// The entry whose latest run has use number use, or NULL if it has run since
+static HistEntry *history_current_use(uint32_t use) {
+    HistEntry *e = &history_entries[history_uses[use]];
+    return e->use == use ? e : NULL;
+}
+
+// Give every entry a use number again, oldest first, without the gaps
+static void history_renumber(void) {
+    uint32_t n = 0;
+    for (uint32_t u = 1; u <= history_last_use; u++) {
+        HistEntry *e = history_current_use(u);
+        if (!e) continue;
+        history_uses[++n] = history_uses[u];
+        e->use = n;
+    }
+    history_last_use = n;
+    hindex_rebuild();
+}
+
+// Record count runs of a command, the last at time when
+static HistEntry *history_store(const char *s, size_t len, uint32_t count, time_t when) {
+    uint64_t hash = history_hash(s, len);
+    HistEntry *e = history_find(s, len, hash);
+    if (!e) {
+        if ((uint32_t)history_count == history_entries_cap) {
+            uint32_t cap = history_entries_cap ? history_entries_cap * 2 : 1024;
+            HistEntry *t = realloc(history_entries, cap * sizeof(*t));
+            if (!t) return NULL;
+            history_entries = t;
+            history_entries_cap = cap;
+        }
+        if (((uint32_t)history_count + 1) * 2 > history_table_cap && history_table_grow() < 0)
+            return NULL;
+        const char *text = history_arena_copy(s, len);
+        if (!text) return NULL;
+        e = &history_entries[history_count++];
+        *e = (HistEntry){ text, len, 0, 0, 0, hash };
+        uint32_t h = (uint32_t)hash & (history_table_cap - 1);
+        while (history_table[h]) h = (h + 1) & (history_table_cap - 1);
+        history_table[h] = history_count;
+    }
+    if (history_last_use + 1 >= history_uses_cap) {
+        uint32_t cap = history_uses_cap ? history_uses_cap * 2 : 1024;
+        uint32_t *t = realloc(history_uses, cap * sizeof(*t));
+        if (!t) return NULL;
+        history_uses = t;
+        history_uses_cap = cap;
+    }
+    e->count += count;
+    if (when > e->last_used) e->last_used = when;
+    e->use = ++history_last_use;
+    history_uses[e->use] = e - history_entries;
+    history_version++;
+    if (history_last_use > 2 * (uint32_t)history_count + HISTORY_RENUMBER_MIN)
+        history_renumber();
+    else
+        hindex_add(e->use, e->text, e->len);
+    return e;
+}
+
+/* ---- History index ----
+ * Ctrl+R looks for the command sharing the longest substring with the search
+ * term, the most recently used one on ties.  Commands are indexed by
+ * trigram under their use numbers: an open-addressing table maps each
+ * trigram to the ascending use numbers of the commands that contain it.  To
+ * find the latest command holding a substring of the term, the lists of its
+ * trigrams are intersected from their newest ends, shortest list first, and
+ * each current number in the intersection is confirmed with memmem(), so
+ * the first real hit ends the walk.  Numbers superseded by a later run are
+ * skipped, and dropped when the history renumbers (hindex_rebuild).
+ */
+#define HINDEX_MIN 3          // shortest shared substring that counts as a match
+#define HINDEX_INITIAL 4096   // initial table size (a power of two)
+#define HINDEX_PREVIEW_STEPS 8192  // steps per index walk for the live preview
+
+typedef struct {
+    uint32_t key;             // trigram + 1, 0 for an empty slot
+    uint32_t len, cap;
+    uint32_t *ids;            // use numbers, ascending
+} HistPosting;
+
+static HistPosting *hindex_tri = NULL;
+static uint32_t hindex_tri_cap = 0, hindex_tri_used = 0;
+
+static uint32_t trigram_key(const char *s) {
+    return ((uint32_t)(unsigned char)s[0] << 16 | (uint32_t)(unsigned char)s[1] << 8 |
+            (unsigned char)s[2]) + 1;
+}
+
+static uint32_t hindex_slot(uint32_t key, uint32_t cap) {
+    uint32_t h = key * 0x9e3779b1u;
+    return (h ^ (h >> 15)) & (cap - 1);
+}
+
+static HistPosting *hindex_lookup(uint32_t key) {
+    if (!hindex_tri_cap) return NULL;
+    for (uint32_t h = hindex_slot(key, hindex_tri_cap);; h = (h + 1) & (hindex_tri_cap - 1)) {
+        if (hindex_tri[h].key == key) return &hindex_tri[h];
+        if (hindex_tri[h].key == 0) return NULL;
+    }
+}
+
+static HistPosting *hindex_insert(uint32_t key) {
+    if ((hindex_tri_used + 1) * 4 > hindex_tri_cap * 3) {
+        uint32_t cap = hindex_tri_cap ? hindex_tri_cap * 2 : HINDEX_INITIAL;
+        HistPosting *t = calloc(cap, sizeof(*t));
+        if (!t) return NULL;
+        for (uint32_t i = 0; i < hindex_tri_cap; i++) {
+            if (!hindex_tri[i].key) continue;
+            uint32_t h = hindex_slot(hindex_tri[i].key, cap);
+            while (t[h].key) h = (h + 1) & (cap - 1);
+            t[h] = hindex_tri[i];
+        }
+        free(hindex_tri);
+        hindex_tri = t;
+        hindex_tri_cap = cap;
+    }
+    uint32_t h = hindex_slot(key, hindex_tri_cap);
+    while (hindex_tri[h].key && hindex_tri[h].key != key) h = (h + 1) & (hindex_tri_cap - 1);
+    if (!hindex_tri[h].key) {
+        hindex_tri[h].key = key;
+        hindex_tri_used++;
+    }
+    return &hindex_tri[h];
+}
+
+// Position of the last number <= id in ids[0..hi), searching backwards from
+// hi with doubling steps; -1 if there is none
+static int64_t hindex_gallop(const uint32_t *ids, int64_t hi, uint32_t id) {
+    int64_t step = 1, top = hi;
+    while (top - step >= 0 && ids[top - step] > id) {
+        top -= step;
+        step *= 2;
+    }
+    int64_t low = top - step < 0 ? 0 : top - step;   // ids[top..hi) > id
+    while (low < top) {
+        int64_t mid = low + (top - low) / 2;
+        if (ids[mid] <= id) low = mid + 1;
+        else top = mid;
+    }
+    return low - 1;
+}
+
+// Index a command under use number use, the highest so far
+static void hindex_add(uint32_t use, const char *s, size_t len) {
+    for (size_t i = 0; i + HINDEX_MIN <= len; i++) {
+        HistPosting *p = hindex_insert(trigram_key(s + i));
+        if (!p) return;
+        if (p->len && p->ids[p->len - 1] == use) continue;   // repeated trigram
+        if (p->len == p->cap) {
+            uint32_t cap = p->cap ? p->cap * 2 : 4;
+            uint32_t *ids = realloc(p->ids, cap * sizeof(uint32_t));
+            if (!ids) continue;
+            p->ids = ids;
+            p->cap = cap;
+        }
+        p->ids[p->len++] = use;
+    }
+}
+
+// Index every command again under its renumbered use (lists keep their memory)
+static void hindex_rebuild(void) {
+    for (uint32_t i = 0; i < hindex_tri_cap; i++) hindex_tri[i].len = 0;
+    for (uint32_t u = 1; u <= history_last_use; u++) {
+        HistEntry *e = &history_entries[history_uses[u]];
+        hindex_add(u, e->text, e->len);
+    }
+}
+
+// Latest use number of a command containing term[from..from+len), or 0.
+// lists[] holds the posting list of the trigram starting at each position of
+// the term; the lists are intersected from their newest ends by
+// leapfrogging.  With limit set, the walk gives up (returns 0) after that
+// many steps.
+static uint32_t hindex_newest(const char *term, HistPosting **lists, int from, int len, uint32_t limit) {
+    int n = len - HINDEX_MIN + 1;
+    HistPosting *order[MAX_LINE_LEN];   // shortest list first: it rejects most
+    int64_t pos[MAX_LINE_LEN];          // cursor into each list, moving towards older numbers
+    for (int i = 0; i < n; i++) {
+        HistPosting *p = lists[from + i];
+        int j = i;
+        for (; j > 0 && order[j - 1]->len > p->len; j--)
+            order[j] = order[j - 1];
+        order[j] = p;
+    }
+    for (int i = 0; i < n; i++) pos[i] = (int64_t)order[i]->len - 1;
+    uint32_t steps = 0;
+    uint32_t id = order[0]->ids[pos[0]];
+    for (;;) {
+        int agree = 1;
+        for (int i = 0; i < n; i++) {
+            HistPosting *p = order[i];
+            if (limit && ++steps > limit) return 0;
+            pos[i] = hindex_gallop(p->ids, pos[i] + 1, id);
+            if (pos[i] < 0) return 0;
+            if (p->ids[pos[i]] != id) {
+                id = p->ids[pos[i]];   // the next candidate is this list's newest below
+                agree = 0;
+                break;
+            }
+        }
+        if (!agree) continue;
+        HistEntry *e = history_current_use(id);
+        if (e && memmem(e->text, e->len, term + from, len)) return id;
+        if (id <= 1) return 0;
+        id--;
+    }
+}
+
+// Per-position results of the last search, reused while the term only grows
+// or shrinks at its end and the history is unchanged
+static char hsearch_term[MAX_LINE_LEN];
+static int hsearch_len[MAX_LINE_LEN + 1];       // longest match ending at each position
+static uint32_t hsearch_id[MAX_LINE_LEN + 1];   // latest use number holding it
+static uint32_t hsearch_version = 0, hsearch_limit = 0;
+
+// Best match for a search term: the command equal to it, otherwise the most
+// recently used one sharing the longest substring (at least HINDEX_MIN) with
+// it, or NULL; *match_len is the shared length.  limit bounds each index walk
+// (see hindex_newest); 0 gives the exact answer.
+static HistEntry *history_best_match(const char *term, int *match_len, uint32_t limit) {
+    int m = strlen(term);
+    if (m == 0) return NULL;
+
+    HistEntry *e = history_find(term, m, history_hash(term, m));
+    if (e) {
+        *match_len = m;
+        return e;
+    }
+
+    // The longest match ending at one position is at most one longer than
+    // the one ending at the previous position, and every shorter substring
+    // ending there matches too, so each new position costs a binary search
+    // over lengths.  Positions inside the part of the term unchanged since
+    // the last call are taken from the cache.
+    int keep = 0;
+    if (hsearch_version == history_version && hsearch_limit == limit)
+        while (keep < m && term[keep] == hsearch_term[keep]) keep++;
+    HistPosting *lists[MAX_LINE_LEN];
+    int run = 0;
+    for (int end = HINDEX_MIN; end <= m; end++) {
+        HistPosting *p = hindex_lookup(trigram_key(term + end - HINDEX_MIN));
+        lists[end - HINDEX_MIN] = p;
+        run = (p && p->len) ? run + 1 : 0;   // indexed trigrams ending here
+        if (end <= keep) continue;
+        int prev = end > HINDEX_MIN && hsearch_len[end - 1] ? hsearch_len[end - 1] : HINDEX_MIN - 1;
+        int lo = HINDEX_MIN, hi = prev + 1, len = 0;
+        if (hi > run + HINDEX_MIN - 1) hi = run + HINDEX_MIN - 1;
+        uint32_t id = 0;
+        if (hi >= lo && (id = hindex_newest(term, lists, end - hi, hi, limit))) {
+            len = hi;
+        } else {
+            for (hi--; lo <= hi;) {
+                int mid = (lo + hi) / 2;
+                uint32_t found = hindex_newest(term, lists, end - mid, mid, limit);
+                if (found) {
+                    id = found;
+                    len = mid;
+                    lo = mid + 1;
+                } else {
+                    hi = mid - 1;
+                }
+            }
+        }
+        hsearch_len[end] = len;
+        hsearch_id[end] = id;
+    }
+    memcpy(hsearch_term, term, m + 1);
+    hsearch_version = history_version;
+    hsearch_limit = limit;
+
+    uint32_t best = 0;
+    int best_len = 0;
+    for (int end = HINDEX_MIN; end <= m; end++) {
+        if (hsearch_len[end] > best_len || (hsearch_len[end] == best_len && hsearch_id[end] > best)) {
+            best = hsearch_id[end];
+            best_len = hsearch_len[end];
+        }
+    }
+    if (!best) return NULL;
+    *match_len = best_len;
+    return history_current_use(best);
+}
+
+/* ---- History file handling ----
+ * The history file is an append-only log: each run of a command is one
+ * record, HISTORY_RS + time + HISTORY_US + text + '\n', added with a single
+ * O_APPEND write, so several MyTerm instances can append at once and a
+ * multi-line command stays one record.  A torn record (no '\n' before the
+ * next HISTORY_RS) is skipped on load; plain lines before the first record,
+ * and records without the time header, are read as one run each.  Once the
+ * file holds twice as many records as there are distinct commands, the
+ * launcher rewrites it with one record per command, HISTORY_RS + time +
+ * ' ' + count + HISTORY_US + text + '\n', in order of last use; appenders
+ * take a shared flock and reopen the file if compaction has replaced it.
+ */
+#define HISTORY_RS '\x1e'
+#define HISTORY_US '\x1f'
+#define HISTORY_COMPACT_MIN 1000   // records before compaction is worth it
+
+static int history_fd = -1;
+static uint32_t history_file_records = 0; // records in the file, as far as we know
+
+// Call fn for every complete record of a history file image
+static void history_records(const char *buf, size_t len, void (*fn)(const char *, size_t, void *), void *arg) {
+    const char *p = buf, *end = buf + len;
+    while (p < end && *p != HISTORY_RS) {
+        const char *nl = memchr(p, '\n', end - p);
+        if (!nl) return;
+        if (nl > p) fn(p, nl - p, arg);
+        p = nl + 1;
+    }
+    while (p < end) {
+        const char *next = memchr(p + 1, HISTORY_RS, end - p - 1);
+        const char *rec_end = next ? next : end;
+        if (rec_end[-1] == '\n' && rec_end - 1 > p + 1) fn(p + 1, rec_end - 1 - (p + 1), arg);
+        p = rec_end;
+    }
+}
+
+// Split a record into its "time[ count]" header, if any, and the command
+static void history_parse(const char **s, size_t *n, time_t *when, uint32_t *count) {
+    const char *p = *s, *end = *s + *n;
+    long long t = 0, c = 0;
+    *when = 0;
+    *count = 1;
+    if (p == end || *p < '0' || *p > '9') return;
+    while (p < end && *p >= '0' && *p <= '9') t = t * 10 + (*p++ - '0');
+    if (p < end && *p == ' ') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++) c = c * 10 + (*p - '0');
+        if (c == 0) return;
+    }
+    if (p + 1 >= end || *p != HISTORY_US) return;
+    *when = t;
+    if (c) *count = c;
+    *n = end - (p + 1);
+    *s = p + 1;
+}
+
+static char *read_file(int fd, size_t *len) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) return NULL;
+    char *buf = malloc(st.st_size + 1);
+    if (!buf) return NULL;
+    size_t got = 0;
+    ssize_t n;
+    while (got < (size_t)st.st_size && (n = read(fd, buf + got, st.st_size - got)) > 0) got += n;
+    *len = got;
+    return buf;
+}
+
+static void load_record(const char *s, size_t n, void *arg) {
+    (void)arg;
+    time_t when;
+    uint32_t count;
+    history_parse(&s, &n, &when, &count);
+    history_store(s, n, count, when);
+    history_file_records++;
+}
+
+static void load_history() {
+    history_fd = open(HISTORY_FILE, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (history_fd < 0) return;
+    size_t len = 0;
+    char *buf = read_file(history_fd, &len);
+    if (buf) {
+        history_records(buf, len, load_record, NULL);
+        free(buf);
+    }
+    history_current = history_count;
+}
+
+// One distinct command of the file being compacted
+typedef struct {
+    const char *text;
+    size_t len;
+    uint64_t hash;
+    uint32_t count;
+    time_t when;
+    int last;             // its last record
+} CompactCmd;
+
+typedef struct {
+    CompactCmd *cmds;
+    int ncmds;
+    int *rec_cmd;         // command of each record
+    int nrecs;
+    int *table;           // command index + 1, 0 for an empty slot
+    size_t table_cap;
+} CompactState;
+
+static void collect_record(const char *s, size_t n, void *arg) {
+    CompactState *c = arg;
+    time_t when;
+    uint32_t count;
+    history_parse(&s, &n, &when, &count);
+    uint64_t hash = history_hash(s, n);
+    size_t h = hash & (c->table_cap - 1);
+    for (; c->table[h]; h = (h + 1) & (c->table_cap - 1)) {
+        CompactCmd *cmd = &c->cmds[c->table[h] - 1];
+        if (cmd->hash == hash && cmd->len == n && memcmp(cmd->text, s, n) == 0) break;
+    }
+    if (!c->table[h]) {
+        c->cmds[c->ncmds] = (CompactCmd){ s, n, hash, 0, 0, 0 };
+        c->table[h] = ++c->ncmds;
+    }
+    CompactCmd *cmd = &c->cmds[c->table[h] - 1];
+    cmd->count += count;
+    if (when > cmd->when) cmd->when = when;
+    cmd->last = c->nrecs;
+    c->rec_cmd[c->nrecs++] = c->table[h] - 1;
+}
+
+// Rewrite the history file with one record per distinct command (runs in the launcher)
+static void history_compact(void) {
+    int fd = -1;
+    for (int tries = 0; tries < 3 && fd < 0; tries++) {
+        fd = open(HISTORY_FILE, O_RDWR | O_CLOEXEC);
+        if (fd < 0) return;
+        // Another compaction may have replaced the file while we waited
+        struct stat open_st, path_st;
+        if (flock(fd, LOCK_EX) < 0 || fstat(fd, &open_st) < 0 || stat(HISTORY_FILE, &path_st) < 0 ||
+            open_st.st_ino != path_st.st_ino || open_st.st_dev != path_st.st_dev) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd < 0) return;
+    size_t len;
+    char *buf = read_file(fd, &len);
+    CompactState c = {0};
+    if (buf) {
+        // Every record is at least two bytes, so this bounds the count
+        size_t max = len / 2 + 1;
+        c.table_cap = 16;
+        while (c.table_cap < max * 2) c.table_cap *= 2;
+        c.cmds = malloc(max * sizeof(*c.cmds));
+        c.rec_cmd = malloc(max * sizeof(*c.rec_cmd));
+        c.table = calloc(c.table_cap, sizeof(*c.table));
+    }
+    if (c.cmds && c.rec_cmd && c.table) {
+        history_records(buf, len, collect_record, &c);
+        int tmp = open(HISTORY_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        FILE *out = tmp >= 0 ? fdopen(tmp, "w") : NULL;
+        if (out) {
+            for (int i = 0; i < c.nrecs; i++) {
+                CompactCmd *cmd = &c.cmds[c.rec_cmd[i]];
+                if (cmd->last != i) continue;
+                fprintf(out, "%c%lld %u%c", HISTORY_RS, (long long)cmd->when, cmd->count, HISTORY_US);
+                fwrite(cmd->text, 1, cmd->len, out);
+                fputc('\n', out);
+            }
+            if (fflush(out) == 0 && fsync(tmp) == 0) rename(HISTORY_FILE ".tmp", HISTORY_FILE);
+            fclose(out);
+        } else if (tmp >= 0) {
+            close(tmp);
+        }
+    }
+    free(c.cmds);
+    free(c.rec_cmd);
+    free(c.table);
+    free(buf);
+    close(fd); // releases the lock
+}
+
+// Append one record; if compaction replaced the file meanwhile, append to the new one
+static void history_append(const HistEntry *e) {
+    char head[32];
+    int n = snprintf(head, sizeof(head), "%c%lld%c", HISTORY_RS, (long long)e->last_used, HISTORY_US);
+    struct iovec iov[3] = {
+        { head, n },
+        { (char *)e->text, e->len },
+        { "\n", 1 },
+    };
+    ssize_t total = n + e->len + 1;
+    // Each retry means another compaction finished, so this ends
+    for (;;) {
+        if (history_fd < 0)
+            history_fd = open(HISTORY_FILE, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (history_fd < 0) return;
+        struct stat open_st, path_st;
+        flock(history_fd, LOCK_SH);
+        if (fstat(history_fd, &open_st) == 0 && stat(HISTORY_FILE, &path_st) == 0 &&
+            open_st.st_ino == path_st.st_ino && open_st.st_dev == path_st.st_dev) {
+            if (writev(history_fd, iov, 3) == total) history_file_records++;
+            flock(history_fd, LOCK_UN);
+            return;
+        }
+        close(history_fd);
+        history_fd = -1;
+    }
+}
+
+static void add_to_history(const char *command) {
+    // Don't add empty commands, or ones that would break the file's framing
+    if (strlen(command) == 0 || strchr(command, HISTORY_RS)) {
+        return;
+    }
+
+    HistEntry *e = history_store(command, strlen(command), 1, time(NULL));
+    if (!e) return;
+    history_current = history_count;
+    history_append(e);
+
+    if (history_file_records >= HISTORY_COMPACT_MIN && history_file_records >= 2 * (uint32_t)history_count) {
+        history_file_records = history_count;
+        LaunchRequest req = { LAUNCH_COMPACT_HISTORY, 0, 0 };
+        if (launcher_fd < 0 || send(launcher_fd, &req, sizeof(req), MSG_NOSIGNAL) != sizeof(req))
+            history_compact();
+    }
+}
+
+// Everything is already on disk; just let go of the file
+static void close_history() {
+    if (history_fd >= 0) close(history_fd);
+    history_fd = -1;
+}
+
+/* ---- History search functions ---- */
+static void search_history(Tab *tab, Window win, GC gc) {
+    if (strlen(search_term) == 0) {
+        draw_output(win, gc, tab, "No search term entered\n");
+        return;
+    }
+
+    int match_len;
+    HistEntry *e = history_best_match(search_term, &match_len, 0);
+    char *result = NULL;
+    if (e && strcmp(e->text, search_term) == 0) {
+        if (asprintf(&result, "Found: %s\n", e->text) < 0) result = NULL;
+    } else if (e) {
+        if (asprintf(&result, "Closest match (substring length %d): %s\n", match_len, e->text) < 0)
+            result = NULL;
+    } else {
+        draw_output(win, gc, tab, "No match for search term in history\n");
+    }
+    if (result) {
+        draw_output(win, gc, tab, result);
+        free(result);
+    }
+}
+
+// Show the search prompt; with preview, the best match so far follows the term
+static void search_prompt(Tab *tab, int preview) {
+    int n = snprintf(tab->input, sizeof(tab->input), "Enter search term: %s", search_term);
+    tab->cursor_pos = n;
+    int match_len;
+    HistEntry *e = preview ? history_best_match(search_term, &match_len, HINDEX_PREVIEW_STEPS) : NULL;
+    if (e) {
+        snprintf(tab->input + n, sizeof(tab->input) - n, "   [%.*s]", (int)strcspn(e->text, "\n"), e->text);
+    }
+    // Ensure cursor is visible horizontally
+    if (tab->cursor_pos > tab->scroll_x + text_columns())
+    {
+        tab->scroll_x = tab->cursor_pos - text_columns();
+    }
+    else if (tab->cursor_pos < tab->scroll_x)
+    {
+        tab->scroll_x = tab->cursor_pos;
+    }
+}
+
+/* ---- History command ---- */
+// The last 1000 distinct commands, least recently used first, with run counts
+static void show_history(Tab *tab, Window win, GC gc) {
+    uint32_t pick[1000];
+    int n = 0;
+    for (uint32_t u = history_last_use; u >= 1 && n < 1000; u--)
+        if (history_current_use(u)) pick[n++] = u;
+
+    for (int i = n - 1; i >= 0; i--) {
+        HistEntry *e = history_current_use(pick[i]);
+        char *line;
+        if (asprintf(&line, "%5d  %5u  %s\n", n - i, e->count, e->text) < 0) continue;
+        draw_output(win, gc, tab, line);
+        free(line);
+    }
+}
+/* ---- Auto-complete functions ---- */
+static char* find_common_prefix(char **strings, int count) {
+    if (count == 0) return NULL;
+    
+    static char prefix[MAX_LINE_LEN];
+    strncpy(prefix, strings[0], MAX_LINE_LEN - 1);
+    prefix[MAX_LINE_LEN - 1] = '\0';
+    
+    for (int i = 1; i < count; i++) {
+        int j = 0;
+        while (prefix[j] && strings[i][j] && prefix[j] == strings[i][j]) {
+            j++;
+        }
+        prefix[j] = '\0';
+        if (j == 0) break;
+    }
+    return prefix;
+}
+
+/* ---- Directory cache ----
+ * Completion looks names up in cached, sorted directory listings, so a Tab
+ * press costs one stat() and a binary search instead of a readdir() of the
+ * whole directory.  Listings are keyed by device and inode and kept for the
+ * DIRCACHE_SIZE most recently used directories.  Each is watched with
+ * inotify (one more source in the event loop): created, deleted and renamed
+ * names are inserted into or removed from the sorted array as the events
+ * arrive, so a busy directory is never re-read; only a lost event queue
+ * marks listings stale.  A directory that cannot be watched is re-read
+ * whenever its mtime changes.  Subdirectories are listed with a trailing
+ * '/' (a symlink to a directory only when it existed at the last read).
+ */
+#define DIRCACHE_SIZE 16
+#define DIRCACHE_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF)
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;   // checked only when wd < 0
+    int wd;                  // inotify watch, or -1
+    int valid;
+    unsigned long used;      // for evicting the least recently used
+    char **names;            // sorted; read names point into block, added ones are malloc'd
+    int count, cap;
+    char *block;
+    size_t block_len;
+} DirListing;
+
+static DirListing dircache[DIRCACHE_SIZE];
+static unsigned long dircache_clock = 0;
+static int inotify_fd = -1;
+static EventSource inotify_src = { .kind = SRC_INOTIFY };
+
+static void dircache_free_name(DirListing *d, char *name) {
+    if (name < d->block || name >= d->block + d->block_len) free(name);
+}
+
+static void dircache_drop(DirListing *d) {
+    if (d->wd >= 0 && inotify_fd >= 0) inotify_rm_watch(inotify_fd, d->wd);
+    for (int i = 0; i < d->count; i++) dircache_free_name(d, d->names[i]);
+    free(d->names);
+    free(d->block);
+    memset(d, 0, sizeof(*d));
+    d->wd = -1;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Read a directory into d; names are kept NUL-separated in one block
+static int dircache_read(DirListing *d, const char *path) {
+    DIR *dir = opendir(path);
+    if (!dir) return -1;
+    size_t used = 0, cap = 4096;
+    char *block = malloc(cap);
+    int count = 0;
+    struct dirent *entry;
+    while (block && (entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+        int is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+            struct stat st;
+            is_dir = fstatat(dirfd(dir), name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+        }
+        size_t len = strlen(name);
+        if (used + len + 2 > cap) {
+            char *grown = realloc(block, cap * 2);
+            if (!grown) {
+                free(block);
+                block = NULL;
+                break;
+            }
+            block = grown;
+            cap *= 2;
+        }
+        memcpy(block + used, name, len);
+        if (is_dir) block[used + len++] = '/';
+        block[used + len] = '\0';
+        used += len + 1;
+        count++;
+    }
+    closedir(dir);
+    int names_cap = count > 16 ? count : 16;
+    char **names = block ? malloc(names_cap * sizeof(char *)) : NULL;
+    if (!names) {
+        free(block);
+        return -1;
+    }
+    char *p = block;
+    for (int i = 0; i < count; i++) {
+        names[i] = p;
+        p += strlen(p) + 1;
+    }
+    qsort(names, count, sizeof(char *), compare_names);
+    for (int i = 0; i < d->count; i++) dircache_free_name(d, d->names[i]);
+    free(d->names);
+    free(d->block);
+    d->names = names;
+    d->count = count;
+    d->cap = names_cap;
+    d->block = block;
+    d->block_len = used;
+    return 0;
+}
+
+// Index of the first of the sorted names >= key
+static int names_lower_bound(char *const *names, int count, const char *key) {
+    int a = 0, b = count;
+    while (a < b) {
+        int mid = a + (b - a) / 2;
+        if (strcmp(names[mid], key) < 0) a = mid + 1;
+        else b = mid;
+    }
+    return a;
+}
+
+// Apply one inotify event for name to a listing
+static void dircache_update(DirListing *d, uint32_t mask, const char *name) {
+    char key[NAME_MAX + 2];
+    snprintf(key, sizeof(key), "%s%s", name, (mask & IN_ISDIR) ? "/" : "");
+    int i = names_lower_bound(d->names, d->count, key);
+    int found = i < d->count && strcmp(d->names[i], key) == 0;
+    if (!found && !(mask & (IN_ISDIR | IN_CREATE | IN_MOVED_TO))) {
+        // A symlink to a directory was read as "name/", but its removal
+        // carries no IN_ISDIR
+        strcat(key, "/");
+        i = names_lower_bound(d->names, d->count, key);
+        found = i < d->count && strcmp(d->names[i], key) == 0;
+    }
+    if (mask & (IN_CREATE | IN_MOVED_TO)) {
+        if (found) return;
+        if (d->count == d->cap) {
+            char **grown = realloc(d->names, d->cap * 2 * sizeof(char *));
+            if (!grown) {
+                d->valid = 0;   // read it again rather than show a wrong list
+                return;
+            }
+            d->names = grown;
+            d->cap *= 2;
+        }
+        char *copy = strdup(key);
+        if (!copy) {
+            d->valid = 0;
+            return;
+        }
+        memmove(d->names + i + 1, d->names + i, (d->count - i) * sizeof(char *));
+        d->names[i] = copy;
+        d->count++;
+    } else if (found) {
+        dircache_free_name(d, d->names[i]);
+        memmove(d->names + i, d->names + i + 1, (d->count - i - 1) * sizeof(char *));
+        d->count--;
+    }
+}
+
+// Bring the listings up to date with what inotify has reported
+static void dircache_events(void) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            for (int i = 0; i < DIRCACHE_SIZE; i++) {
+                DirListing *d = &dircache[i];
+                if (!d->names) continue;
+                if (ev->mask & IN_Q_OVERFLOW) {
+                    d->valid = 0;
+                } else if (d->wd == ev->wd) {
+                    if (ev->mask & (IN_DELETE_SELF | IN_IGNORED)) {
+                        d->valid = 0;
+                        if (ev->mask & IN_IGNORED) d->wd = -1;
+                    } else if (d->valid && ev->len) {
+                        dircache_update(d, ev->mask, ev->name);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// The listing of path, from the cache when it is still current
+static DirListing *dircache_get(const char *path) {
+    struct stat st;
+    if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) return NULL;
+    if (inotify_fd >= 0) dircache_events();   // changes made just before this Tab
+
+    DirListing *d = NULL, *lru = &dircache[0];
+    for (int i = 0; i < DIRCACHE_SIZE; i++) {
+        DirListing *c = &dircache[i];
+        if (c->names && c->dev == st.st_dev && c->ino == st.st_ino) {
+            d = c;
+            break;
+        }
+        if (!c->names || (lru->names && c->used < lru->used)) lru = c;
+    }
+    if (d && d->valid && (d->wd >= 0 || (d->mtime.tv_sec == st.st_mtim.tv_sec &&
+                                         d->mtime.tv_nsec == st.st_mtim.tv_nsec))) {
+        d->used = ++dircache_clock;
+        return d;
+    }
+
+    if (!d) {
+        d = lru;
+        dircache_drop(d);
+    }
+    if (inotify_fd < 0) {
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd >= 0 && epfd >= 0) reactor_add(inotify_fd, &inotify_src);
+    }
+    // Watch before reading, so nothing changed meanwhile is missed; events
+    // already queued for the old listing are drained first
+    if (d->wd >= 0) dircache_events();
+    if (d->wd < 0 && inotify_fd >= 0) d->wd = inotify_add_watch(inotify_fd, path, DIRCACHE_EVENTS);
+    if (dircache_read(d, path) < 0) {
+        dircache_drop(d);
+        return NULL;
+    }
+    d->valid = 1;
+    d->dev = st.st_dev;
+    d->ino = st.st_ino;
+    d->mtime = st.st_mtim;
+    d->used = ++dircache_clock;
+    return d;
+}
+
+// The sorted names starting with prefix are names[*lo..*hi)
+static void names_range(char *const *names, int count, const char *prefix, int *lo, int *hi) {
+    size_t len = strlen(prefix);
+    int a = names_lower_bound(names, count, prefix), b = count;
+    *lo = a;
+    while (a < b) {
+        int mid = a + (b - a) / 2;
+        if (strncmp(names[mid], prefix, len) <= 0) a = mid + 1;
+        else b = mid;
+    }
+    *hi = a;
+}
+
+// Completions of word (which may include a directory part) relative to dir_path
+static void get_files_starting_with(const char *dir_path, const char *word, char ***matches, int *match_count) {
+    *matches = NULL;
+    *match_count = 0;
+
+    const char *slash = strrchr(word, '/');
+    const char *base = slash ? slash + 1 : word;
+    int dir_len = base - word;
+    char path[PATH_MAX];
+    if (word[0] == '/')
+        snprintf(path, sizeof(path), "%.*s", dir_len, word);
+    else
+        snprintf(path, sizeof(path), "%s/%.*s", dir_path, dir_len, word);
+
+    DirListing *d = dircache_get(path);
+    if (!d) return;
+    int lo, hi;
+    names_range(d->names, d->count, base, &lo, &hi);
+
+    // Hidden names only when the word asks for them
+    int count = 0;
+    for (int i = lo; i < hi; i++)
+        count += base[0] == '.' || d->names[i][0] != '.';
+    if (count == 0) return;
+    *matches = malloc(count * sizeof(char *));
+    if (!*matches) return;
+    for (int i = lo; i < hi; i++) {
+        if (base[0] != '.' && d->names[i][0] == '.') continue;
+        char *m = malloc(dir_len + strlen(d->names[i]) + 1);
+        if (!m) continue;
+        memcpy(m, word, dir_len);
+        strcpy(m + dir_len, d->names[i]);
+        (*matches)[(*match_count)++] = m;
+    }
+}
+
+/* ---- PATH index ----
+ * The executables on $PATH, kept per PATH directory as sorted name arrays.
+ * They are read one directory per idle wakeup of the event loop after
+ * startup, so the window never waits for them.  Each directory is watched
+ * through an inotify instance of its own (a second watch on an inode in the
+ * directory cache's instance would share its wd); any change marks the
+ * directory stale and it is read again on a later idle wakeup.  The index
+ * answers command-name completion and lets spawn_pipeline() exec a known
+ * path instead of probing every PATH directory.  A directory that is an
+ * alias of an earlier one (/bin -> /usr/bin) is listed empty.
+ */
+#define PATHINDEX_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | \
+                          IN_DELETE_SELF | IN_MOVE_SELF)
+
+typedef struct {
+    char *path;
+    int wd;            // inotify watch, or -1
+    int current;       // names match the directory
+    dev_t dev;
+    ino_t ino;
+    char **names;      // sorted, pointing into block
+    int count;
+    char *block;
+} PathDir;
+
+static PathDir *path_dirs = NULL;
+static int path_dir_count = 0;
+static int path_lookup_dirs = 0;   // dirs before the first relative PATH entry
+static int path_stale = 0;         // dirs waiting to be read
+static int path_inotify_fd = -1;
+static EventSource path_src = { .kind = SRC_PATHINDEX };
+
+// Split $PATH; nothing is read yet
+static void pathindex_init(void) {
+    const char *env = getenv("PATH");
+    if (!env || !*env) return;
+    int n = 1;
+    for (const char *p = env; *p; p++) n += *p == ':';
+    path_dirs = calloc(n, sizeof(PathDir));
+    if (!path_dirs) return;
+    path_lookup_dirs = -1;
+    for (const char *p = env; ; ) {
+        const char *end = strchrnul(p, ':');
+        if (*p != '/') {
+            // Relative entries ("", ".") depend on the shell's cwd; leave
+            // lookups after one to posix_spawnp()
+            if (path_lookup_dirs < 0) path_lookup_dirs = path_dir_count;
+        } else {
+            int dup = 0;
+            for (int i = 0; i < path_dir_count; i++)
+                dup |= strlen(path_dirs[i].path) == (size_t)(end - p) &&
+                       strncmp(path_dirs[i].path, p, end - p) == 0;
+            if (!dup && (path_dirs[path_dir_count].path = strndup(p, end - p)) != NULL) {
+                path_dirs[path_dir_count].wd = -1;
+                path_dir_count++;
+            }
+        }
+        if (!*end) break;
+        p = end + 1;
+    }
+    if (path_lookup_dirs < 0) path_lookup_dirs = path_dir_count;
+    path_stale = path_dir_count;
+
+    path_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (path_inotify_fd >= 0 && epfd >= 0) reactor_add(path_inotify_fd, &path_src);
+}
+
+// Read the executables of one directory
+static void pathindex_read(PathDir *pd) {
+    free(pd->names);
+    free(pd->block);
+    pd->names = NULL;
+    pd->block = NULL;
+    pd->count = 0;
+    pd->current = 1;
+    path_stale--;
+
+    if (pd->wd < 0 && path_inotify_fd >= 0)
+        pd->wd = inotify_add_watch(path_inotify_fd, pd->path, PATHINDEX_EVENTS);
+    struct stat st;
+    if (stat(pd->path, &st) < 0) return;
+    pd->dev = st.st_dev;
+    pd->ino = st.st_ino;
+    for (PathDir *o = path_dirs; o < pd; o++)
+        if (o->names && o->dev == pd->dev && o->ino == pd->ino) return;
+
+    DIR *dir = opendir(pd->path);
+    if (!dir) return;
+    size_t used = 0, cap = 4096;
+    char *block = malloc(cap);
+    int count = 0;
+    struct dirent *entry;
+    while (block && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.' || entry->d_type == DT_DIR) continue;
+        if (fstatat(dirfd(dir), entry->d_name, &st, 0) < 0 ||
+            !S_ISREG(st.st_mode) || !(st.st_mode & 0111))
+            continue;
+        size_t len = strlen(entry->d_name) + 1;
+        if (used + len > cap) {
+            char *grown = realloc(block, cap * 2);
+            if (!grown) break;
+            block = grown;
+            cap *= 2;
+        }
+        memcpy(block + used, entry->d_name, len);
+        used += len;
+        count++;
+    }
+    closedir(dir);
+    char **names = block ? malloc((count ? count : 1) * sizeof(char *)) : NULL;
+    if (!names) {
+        free(block);
+        return;
+    }
+    char *p = block;
+    for (int i = 0; i < count; i++) {
+        names[i] = p;
+        p += strlen(p) + 1;
+    }
+    qsort(names, count, sizeof(char *), compare_names);
+    pd->names = names;
+    pd->count = count;
+    pd->block = block;
+}
+
+// Idle work: read the next stale directory.  Returns 1 while more remain.
+static int pathindex_step(void) {
+    for (int i = 0; i < path_dir_count && path_stale > 0; i++) {
+        if (!path_dirs[i].current) {
+            pathindex_read(&path_dirs[i]);
+            break;
+        }
+    }
+    return path_stale > 0;
+}
+
+// Any change in a directory makes it stale; it is read again when idle
+static void pathindex_events(void) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(path_inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            for (int i = 0; i < path_dir_count; i++) {
+                PathDir *pd = &path_dirs[i];
+                if (!(ev->mask & IN_Q_OVERFLOW) && pd->wd != ev->wd) continue;
+                if (ev->mask & IN_IGNORED) pd->wd = -1;
+                if (pd->current) {
+                    pd->current = 0;
+                    path_stale++;
+                }
+            }
+        }
+    }
+}
+
+// Full path of the executable name would run as, or NULL when the index
+// cannot tell (not read yet, stale, or not found); the caller then falls
+// back to searching PATH itself
+static const char *pathindex_lookup(const char *name) {
+    static char path[PATH_MAX];
+    if (path_inotify_fd >= 0) pathindex_events();
+    for (int i = 0; i < path_lookup_dirs; i++) {
+        PathDir *pd = &path_dirs[i];
+        if (!pd->current) return NULL;
+        int j = names_lower_bound(pd->names, pd->count, name);
+        if (j < pd->count && strcmp(pd->names[j], name) == 0) {
+            snprintf(path, sizeof(path), "%s/%s", pd->path, name);
+            return path;
+        }
+    }
+    return NULL;
+}
+
+// Command names starting with prefix, sorted and without duplicates
+static void get_commands_starting_with(const char *prefix, char ***matches, int *match_count) {
+    *matches = NULL;
+    *match_count = 0;
+    if (path_inotify_fd >= 0) pathindex_events();
+    while (pathindex_step()) ;   // Tab before the idle reads finished
+
+    int total = 0;
+    for (int i = 0; i < path_dir_count; i++) {
+        int lo, hi;
+        names_range(path_dirs[i].names, path_dirs[i].count, prefix, &lo, &hi);
+        total += hi - lo;
+    }
+    if (total == 0) return;
+    char **found = malloc(total * sizeof(char *));
+    if (!found) return;
+    int n = 0;
+    for (int i = 0; i < path_dir_count; i++) {
+        int lo, hi;
+        names_range(path_dirs[i].names, path_dirs[i].count, prefix, &lo, &hi);
+        for (int j = lo; j < hi; j++) found[n++] = path_dirs[i].names[j];
+    }
+    qsort(found, n, sizeof(char *), compare_names);
+    // Copies replace the borrowed names in place, skipping repeats
+    *matches = found;
+    for (int i = 0; i < n; i++) {
+        if (*match_count > 0 && strcmp(found[i], (*matches)[*match_count - 1]) == 0) continue;
+        char *m = strdup(found[i]);
+        if (m) (*matches)[(*match_count)++] = m;
+    }
+}
+
+static void auto_complete(Tab *tab, Window win, GC gc) {
+    // If we're already in selection mode, don't auto-complete again
+    if (selection_mode) return;
+    
+    char *line = tab->input;
+    int line_len = strlen(line);
+    
+    // Find the last word in the line (for completion)
+    int word_start = line_len - 1;
+    while (word_start >= 0 && line[word_start] != ' ' && line[word_start] != '\t') {
+        word_start--;
+    }
+    word_start++; // Move to start of word
+    
+    char prefix[MAX_LINE_LEN];
+    strncpy(prefix, line + word_start, MAX_LINE_LEN - 1);
+    prefix[MAX_LINE_LEN - 1] = '\0';
+    
+    if (strlen(prefix) == 0) return;
+    
+    char **matches = NULL;
+    int match_count = 0;
+    // A word in command position (first, or after | ; & or '(') without a
+    // slash names a program on PATH
+    int before = word_start - 1;
+    while (before >= 0 && (line[before] == ' ' || line[before] == '\t')) before--;
+    if ((before < 0 || strchr("|;&(", line[before])) && !strchr(prefix, '/')) {
+        get_commands_starting_with(prefix, &matches, &match_count);
+    } else {
+        // Complete in the shell's working directory, which follows its cd commands
+        char cwd[64];
+        snprintf(cwd, sizeof(cwd), "/proc/%d/cwd", (int)tab->shell_pid);
+        get_files_starting_with(tab->shell_pid > 0 ? cwd : ".", prefix, &matches, &match_count);
+    }
+    
+    if (match_count == 0) {
+        // No matches - do nothing
+        if (matches) free(matches);
+        return;
+    }
+    else if (match_count == 1) {
+        // Single match - complete it
+        int prefix_len = strlen(prefix);
+        int match_len = strlen(matches[0]);
         
         // Append the remaining part of the filename
         if (match_len > prefix_len) {
@@ -909,9 +4776,10 @@ static void auto_complete(Tab *tab, Window win, GC gc) {
         selection_mode = 1;
         selection_matches = matches;
         selection_match_count = match_count;
-        original_line = tab->current_line;
+        original_line = sb_end(&tab->sb);
         strncpy(original_command, line, MAX_LINE_LEN - 1);
         original_command[MAX_LINE_LEN - 1] = '\0';
+        commit_input(tab);
         
         // Initialize selection input
         tab->selection_input[0] = '\0';
@@ -930,738 +4798,1434 @@ static void auto_complete(Tab *tab, Window win, GC gc) {
             }
         }
 
-        char prompt[100];
-        snprintf(prompt, sizeof(prompt), "\nEnter selection number (1-%d) and press Enter: ", match_count);
-        strncat(match_list, prompt, sizeof(match_list) - strlen(match_list) - 1);
-        draw_output(win, gc, tab, match_list);
+        char prompt[100];
+        snprintf(prompt, sizeof(prompt), "\nEnter selection number (1-%d) and press Enter: ", match_count);
+        strncat(match_list, prompt, sizeof(match_list) - strlen(match_list) - 1);
+        draw_output(win, gc, tab, match_list);
+
+        // Move to new line for selection input
+        strcpy(tab->input, "Selection: ");
+        tab->input_is_command = 0;
+        tab->cursor_pos = strlen(tab->input);
+        return; // Don't cleanup matches yet - we need them for selection
+    }
+    
+    draw_text(win, gc, tab);
+}
+
+// Drop the match list and put the command being completed back on the input line
+static void restore_original_command(Tab *tab) {
+    tab_damage(tab, original_line, sb_end(&tab->sb));
+    sb_truncate(&tab->sb, original_line);
+    if (tab->scroll_y > (int)tab->sb.count) tab->scroll_y = tab->sb.count;
+    strcpy(tab->input, original_command);
+    tab->input_is_command = 1;
+    tab->cursor_pos = strlen(original_command);
+}
+
+static void handle_selection_mode(Tab *tab, Window win, GC gc, KeySym ks, char buf) {
+    if (!selection_mode) return;
+    
+    if (ks == XK_Return) {
+        if (tab->selection_input_pos > 0) {
+            int selection = atoi(tab->selection_input) - 1; // Convert to 0-based index
+            
+            if (selection >= 0 && selection < selection_match_count) {
+                // Apply the selection - go back to original line and append the selected match
+                restore_original_command(tab);
+                
+                // Find where the partial word ends in the original command
+                char *line = tab->input;
+                int line_len = strlen(line);
+                int word_start = line_len - 1;
+                while (word_start >= 0 && line[word_start] != ' ' && line[word_start] != '\t') {
+                    word_start--;
+                }
+                word_start++;
+                
+                // Replace the partial word with the selected match
+                snprintf(line + word_start, MAX_LINE_LEN - word_start, "%s", selection_matches[selection]);
+                tab->cursor_pos = strlen(line);
+                
+                // Add space after completion, unless a directory's names come next
+                if (strlen(line) < MAX_LINE_LEN - 1 && line[strlen(line) - 1] != '/') {
+                    strcat(line, " ");
+                    tab->cursor_pos++;
+                }
+            } else {
+                // Invalid selection number - restore original command
+                restore_original_command(tab);
+                draw_output(win, gc, tab, "Invalid selection number\n");
+            }
+        } else {
+            // No input - restore original command
+            restore_original_command(tab);
+        }
+        
+        // Cleanup and exit selection mode
+        selection_mode = 0;
+        for (int i = 0; i < selection_match_count; i++) {
+            free(selection_matches[i]);
+        }
+        free(selection_matches);
+        selection_matches = NULL;
+        
+        draw_text(win, gc, tab);
+        return;
+    }
+    else if (ks == XK_BackSpace) {
+        // Handle backspace in selection input
+        if (tab->selection_input_pos > 0) {
+            tab->selection_input[--tab->selection_input_pos] = '\0';
+            
+            // Update the selection line display
+            char display_line[MAX_LINE_LEN];
+            snprintf(display_line, sizeof(display_line), "Selection: %s", tab->selection_input);
+            strcpy(tab->input, display_line);
+            tab->cursor_pos = strlen(display_line);
+            draw_text(win, gc, tab);
+        }
+    }
+    else if (ks == XK_Escape) {
+        // Cancel selection on Escape
+        selection_mode = 0;
+        for (int i = 0; i < selection_match_count; i++) {
+            free(selection_matches[i]);
+        }
+        free(selection_matches);
+        selection_matches = NULL;
+        
+        // Restore original command
+        restore_original_command(tab);
+        draw_text(win, gc, tab);
+    }
+    else if (buf >= '0' && buf <= '9' && tab->selection_input_pos < 9) { // Limit to reasonable length
+        // Accept digits for selection input
+        tab->selection_input[tab->selection_input_pos++] = buf;
+        tab->selection_input[tab->selection_input_pos] = '\0';
+        
+        // Update the selection line display
+        char display_line[MAX_LINE_LEN];
+        snprintf(display_line, sizeof(display_line), "Selection: %s", tab->selection_input);
+        strcpy(tab->input, display_line);
+        tab->cursor_pos = strlen(display_line);
+        draw_text(win, gc, tab);
+    }
+    // Ignore other keys in selection mode
+}
+
+
+// Wait for X events or output from any tab's shell.  Output is taken in as it
+// arrives; the current tab is repainted when its frame is due.
+// SIGINT stops multiWatch (as Ctrl+C in the window does); SIGCHLD reaps its
+// pipelines and shells that hung up before exiting
+static void handle_signals(Window win, GC gc) {
+    struct signalfd_siginfo si;
+    int sigint = 0;
+    while (read(signal_fd, &si, sizeof(si)) == sizeof(si))
+        if (si.ssi_signo == SIGINT) sigint = 1;
+    shells_reap();
+
+    for (int i = 0; i < total_tabs; i++) {
+        if (!tabs[i]->watch) continue;
+        if (sigint) watch_stop(tabs[i], win, gc);
+        else watch_reap(tabs[i]);
+    }
+}
+
+static void session_accept(void);
+static void session_input(Window win, GC gc, uint32_t events);
+
+static long long wake_by_ms = 0;   // a headless script wants control back by then
+static unsigned long wakeups = 0;  // returns from epoll_wait (see script_report)
+
+// Sleep until X events, child output, a signal or a timer need attention;
+// returns the number of wakeups handled
+static int wait_for_input(Window win, GC gc) {
+    struct epoll_event evs[64];
+    int signalled = 0;
+    uint32_t session_events = 0;
+
+    paint_flush();
+    frame_arm();
+    int timeout = frame_timer < 0 ? frame_timeout() : -1;
+    if (path_stale > 0 || sb_cooling || surfaces_stale) timeout = 0;   // idle work is waiting
+    if (wake_by_ms) {
+        long long left = wake_by_ms - now_ms();
+        if (left < 0) left = 0;
+        if (timeout < 0 || left < timeout) timeout = left;
+    }
+    int n = epoll_wait(epfd, evs, 64, timeout);
+    wakeups++;
+    if (n == 0 && path_stale > 0) pathindex_step();
+    if (n == 0 && sb_cooling) sb_cooling = scrollback_step();
+    if (n == 0 && surfaces_stale) surfaces_stale = surface_step(win, gc);
+
+    // Tabs producing output share one parsing budget per wakeup, so any number
+    // of busy tabs cannot hold off X events for more than a few milliseconds
+    int ready = 0;
+    for (int k = 0; k < n; k++)
+        ready += ((EventSource *)evs[k].data.ptr)->kind == SRC_PTY;
+    size_t share = ready ? INGEST_BUDGET / ready : 0;
+    if (share < INGEST_MIN) share = INGEST_MIN;
+
+    for (int k = 0; k < n; k++) {
+        EventSource *src = evs[k].data.ptr;
+        Tab *tab = src->tab;
+        switch (src->kind) {
+            case SRC_PTY: {
+                if (evs[k].events & EPOLLOUT) tab_pty_send(tab);
+                ssize_t r = ingest_fd(tab, tab->pty, share);
+                if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR))
+                    tab_shell_exited(tab);
+                // Output that never pauses must not keep all of itself plain
+                while (tab->sb.plain_bytes > SB_HOT_BYTES && tab_cool(tab)) {}
+                if (tab == tabs[current_tab]) frame_pending = 1;
+                break;
+            }
+            case SRC_WATCH_OUT:
+                watch_output(tab, src->index);
+                break;
+            case SRC_WATCH_TIMER:
+                watch_tick(tab);
+                break;
+            case SRC_INOTIFY:
+                dircache_events();
+                break;
+            case SRC_PATHINDEX:
+                pathindex_events();
+                break;
+            case SRC_SESSION_LISTEN:
+                session_accept();
+                break;
+            case SRC_SESSION:
+                session_events = evs[k].events; // after the batch: keys may close tabs
+                break;
+            case SRC_SIGNAL:
+                signalled = 1; // after the batch: stopping a watch frees its sources
+                break;
+            case SRC_FRAME: {
+                uint64_t expirations;
+                if (read(frame_timer, &expirations, sizeof(expirations)) < 0) break;
+                break;
+            }
+            case SRC_X:
+                break; // run() reads the events
+        }
+    }
+    if (signalled) handle_signals(win, gc);
+    if (session_events) session_input(win, gc, session_events);
+    if (total_tabs) frame_tick(win, gc, tabs[current_tab]);
+    return n;
+}
+
+/* ---- Input handling ----
+ * What keys, clicks and resizes do, apart from how they arrive: run() reads
+ * them from X or a script (see Headless mode), a session daemon from its
+ * front end.
+ */
+static void session_end(void);
+
+// The "exit" command: hang up every shell and quit
+static void terminal_exit(Window win, GC gc) {
+    close_history();
+
+    // Hang up all shell processes in all tabs (interactive sh ignores SIGTERM)
+    for (int i = 0; i < total_tabs; i++)
+    {
+        if (tabs[i]->watch)
+            watch_free(tabs[i]->watch);
+        if (tabs[i]->shell_pid > 0)
+        {
+            kill(tabs[i]->shell_pid, SIGHUP);
+        }
+    }
+
+    if (headless == HEADLESS_SESSION) {
+        session_end();
+    } else if (!headless) {
+        // Cleanup X11 resources
+        XUngrabKeyboard(dpy, CurrentTime);
+        XUnmapWindow(dpy, win);
+        XDestroyWindow(dpy, win);
+        XFreeGC(dpy, gc);
+        XCloseDisplay(dpy);
+    }
+    exit(0);
+}
+
+// Take a new window size and fit every tab to it.  old_view is view_lines()
+// before the size (or the font) changed, which decides the tabs that follow
+// their output.
+static void resize_window(int width, int height, int old_view) {
+    win_width = width;
+    win_height = height;
+    for (int i = 0; i < total_tabs; i++) {
+        screen_resize(tabs[i], old_view);
+        tab_set_winsize(tabs[i]);
+    }
+}
+
+static void handle_resize(Window win, GC gc, int width, int height) {
+    if (width == win_width && height == win_height) return;
+    resize_window(width, height, view_lines());
+    draw_text(win, gc, tabs[current_tab]); // Redraw with new dimensions
+}
+
+static void handle_click(Window win, GC gc, int x, int y) {
+    int clicked = tab_at(x, y);
+    if (clicked >= 0) {
+        current_tab = clicked;
+        draw_text(win, gc, tabs[current_tab]);
+    }
+}
+
+// A key pressed in the window (or sent by a session front end); buf holds
+// the len bytes it types
+static void handle_key(Window win, GC gc, KeySym ks, unsigned int state, const char *buf, int len) {
+    char temp[4];
+    Tab *tab = tabs[current_tab];
+
+    // A watched tab only takes Ctrl+C (stop), scrolling and opening, closing and switching tabs
+    if (tab->watch) {
+        if ((state & ControlMask) && (ks == XK_c || ks == XK_C)) {
+            watch_stop(tab, win, gc);
+            return;
+        }
+        if (ks != XK_Up && ks != XK_Down && ks != XK_Left && ks != XK_Right &&
+            !((state & ControlMask) && (ks == XK_Tab || ks == XK_t || ks == XK_T || ks == XK_w || ks == XK_W)))
+            return;
+    }
+
+    // While a command runs the keyboard belongs to it, except for
+    // tab switching and Shift+Up/Down scrolling
+    if (tab->busy && !((state & ShiftMask) && (ks == XK_Up || ks == XK_Down)) &&
+        !((state & ControlMask) && (ks == XK_Tab || ks == XK_t || ks == XK_T)))
+    {
+        tab_send_key(tab, ks, buf, len);
+        return;
+    }
+
+    // ---------- SCROLLING ----------
+    if (ks == XK_Up)
+    {
+        if (tab->scroll_y > 0)
+            tab->scroll_y--;
+        draw_text(win, gc, tab);
+        return;
+    }
+    else if (ks == XK_Down)
+    {
+        if (tab->scroll_y < tab_rows(tab) - 1)
+            tab->scroll_y++;
+        draw_text(win, gc, tab);
+        return;
+    }
+    else if (ks == XK_Left)
+    {
+        if (tab->scroll_x > 0)
+            tab->scroll_x--;
+        draw_text(win, gc, tab);
+        return;
+    }
+    else if (ks == XK_Right)
+    {
+        tab->scroll_x++;
+        draw_text(win, gc, tab);
+        return;
+    }
+
+    // Handling search mode
+    if (search_mode)
+    {
+        if (ks == XK_Return)
+        {
+            search_mode = 0;
+            // Keep the search prompt line (without the preview) and show results below it
+            search_prompt(tab, 0);
+            commit_input(tab);
+            search_history(tab, win, gc);
+            // Reset for next command
+            tab->command[0] = '\0';
+            // Ensure the current line is visible
+            if ((int)tab->sb.count > tab->scroll_y + view_lines())
+            {
+                tab->scroll_y = tab->sb.count - view_lines();
+            }
+            draw_text(win, gc, tab);
+        }
+        else if (ks == XK_BackSpace)
+        {
+            if (search_cursor > 0)
+            {
+                search_term[--search_cursor] = '\0';
+            }
+            // Results follow the term as it is edited
+            search_prompt(tab, 1);
+            draw_text(win, gc, tab);
+        }
+        else if (ks == XK_Escape)
+        {
+            search_mode = 0;
+            // Clear search and return to normal prompt
+            search_prompt(tab, 0);
+            commit_input(tab);
+            tab->command[0] = '\0';
+            draw_text(win, gc, tab);
+        }
+        else if (len > 0 && search_cursor < MAX_LINE_LEN - 20)
+        { // Reserve 20 chars for prompt
+            search_term[search_cursor++] = buf[0];
+            search_term[search_cursor] = '\0';
+            search_prompt(tab, 1);
+            draw_text(win, gc, tab);
+        }
+        return; // Important: skip all other key handling in search mode
+    }
+    
+    // Selection mode handling for autocomplete
+    if (selection_mode && len > 0)
+    {
+        handle_selection_mode(tab, win, gc, ks, buf[0]);
+        return;
+    }
+
+    // Tab key handling
+    if (ks == XK_Tab)
+    {
+        if (selection_mode)
+        {
+            // Ignore Tab in selection mode
+        }
+        else if (state & ControlMask)
+        {
+            // Ctrl+Tab for tab switching
+            current_tab = (current_tab + 1) % total_tabs;
+            draw_text(win, gc, tabs[current_tab]);
+        }
+        else
+        {
+            // Regular Tab for auto-complete
+            auto_complete(tab, win, gc);
+        }
+        return;
+    }
+    // CTRL+R for history search (this activates search mode)
+    if ((state & ControlMask) && (ks == XK_R || ks == XK_r))
+    {
+        search_mode = 1;
+        search_term[0] = '\0';
+        search_cursor = 0;
+        // Set up the search prompt on the current line (safe version)
+        strcpy(tab->input, "Enter search term: ");
+        tab->cursor_pos = strlen(tab->input);
+        tab->input_is_command = 0; // This is not a regular command input
+        draw_text(win, gc, tab);
+        return;
+    }
+    //CTRL+C and CTRL+Z reach a running command through its pty; at the prompt they do nothing
+    if ((state & ControlMask) && (ks == XK_C || ks == XK_c))
+    {
+        draw_text(win, gc,tab);
+        return;
+    }
+    if ((state & ControlMask) && (ks == XK_Z || ks == XK_z))
+    {
+        return;
+    }
+    // CTRL+A and CTRL+E line navigation
+    if ((state & ControlMask) && (ks == XK_A || ks == XK_a))
+    {
+        tab->cursor_pos = 0; // Move to start of line
+        draw_text(win, gc, tab);
+        return;
+    }
+    if ((state & ControlMask) && (ks == XK_E || ks == XK_e))
+    {
+        int cur_len = strlen(tab->input);
+        tab->cursor_pos = (cur_len < MAX_LINE_LEN) ? cur_len : MAX_LINE_LEN - 1;
+        draw_text(win, gc, tab);
+        return;
+    }
+
+    // ---------- TAB SHORTCUTS ----------
+    if ((state & ControlMask) && (ks == XK_t || ks == XK_T)) {
+        if (create_new_tab())
+            draw_text(win, gc, tabs[current_tab]);
+        return;
+    }
+    // Ctrl+W closes the tab, unless it is the last one
+    if ((state & ControlMask) && (ks == XK_w || ks == XK_W)) {
+        if (total_tabs > 1) {
+            close_tab(current_tab);
+            draw_text(win, gc, tabs[current_tab]);
+        }
+        return;
+    }
+
+    /*
+    if ((state & ControlMask) && ks == XK_Tab) {
+        current_tab = (current_tab + 1) % total_tabs;
+        draw_text(win, gc, tabs[current_tab]);
+        break;
+    }
+    */
+
+    // ---------- COMMAND EXECUTION ----------
+    if (ks == XK_Return) {
+        int l = strlen(tab->input);
+        if (l >= 3)
+            strncpy(temp, tab->input + l - 3, 3);
+        else
+            strncpy(temp, tab->input, l);
+        temp[(l >= 3) ? 3 : l] = '\0';
+
+        if (strcmp(temp, "\\n\\") != 0)
+        { // last line of multi-line or single-line input
+            // Append current line to tab->command (without the trailing \n\ if present)
+            if (strlen(tab->command) > 0)
+            {
+                strcat(tab->command, tab->input);
+            }
+            else
+            {
+                strncpy(tab->command, tab->input, sizeof(tab->command) - 1);
+                tab->command[sizeof(tab->command) - 1] = '\0';
+            }
+
+            // Adding command to history
+            add_to_history(tab->command);
+
+            // The typed line stays in the scrollback above any output
+            commit_input(tab);
+
+            // Handle built-in history command
+            if (strcmp(tab->command, "history") == 0)
+            {
+                show_history(tab, win, gc);
+                tab->command[0] = '\0';
+                return;
+            }
+            // Handle multiWatch command
+            else if (strncmp(tab->command, "multiWatch", 10) == 0)
+            {
+                multiWatch(tab, win, gc, tab->command);
+
+                // The watch runs in the background; its output lands below a fresh line
+                tab->input_is_command = 1;
+                tab->cursor_pos = 0;
+                tab->command[0] = '\0';
+                tab->input[0] = '\0'; // Clear the line
+
+                // Make sure the prompt is visible
+                tab->scroll_y = tab->sb.count;
+                tab->scroll_x = 0;
+
+                draw_text(win, gc, tab);
+                return;
+            }
+
+            // Handling the "exit" command
+            if (strcmp(tab->command, "exit") == 0)
+                terminal_exit(win, gc);
+
+            // ---- everything else goes to the tab's shell ----
+            tab_run_command(tab, tab->command);
+
+            // Reset tab->command for next command
+            tab->command[0] = '\0';
+        }
+        else
+        { // multi-line continuation
+            strcat(tab->command, tab->input);
+            strcat(tab->command, "\n"); // preserve the new line
+            commit_input(tab);
+            tab->input_is_command = 0;
+        }
+    }
+    else if (ks == XK_BackSpace) {
+        if (tab->cursor_pos > 0)
+        {
+            int line_len = strlen(tab->input);
+            // shift characters left
+            for (int i = tab->cursor_pos - 1; i < line_len; i++)
+            {
+                tab->input[i] = tab->input[i + 1];
+            }
+            tab->cursor_pos--;
+        }
+    }
+    else if (len > 0 && tab->cursor_pos < MAX_LINE_LEN - 1) {
+        int line_len = strlen(tab->input);
+        if (line_len >= MAX_LINE_LEN - 1)
+            line_len = MAX_LINE_LEN - 2;
+
+        // shift characters right
+        for (int i = line_len; i >= tab->cursor_pos; i--)
+        {
+            tab->input[i + 1] = tab->input[i];
+        }
 
-        // Move to new line for selection input
-        tab->current_line++;
-        strcpy(tab->lines[tab->current_line], "Selection: ");
-        tab->isCommand[tab->current_line] = 0;
-        tab->cursor_pos = strlen(tab->lines[tab->current_line]);
-        return; // Don't cleanup matches yet - we need them for selection
+        // insert new character
+        tab->input[tab->cursor_pos] = buf[0];
+        tab->cursor_pos++;
     }
     
     draw_text(win, gc, tab);
 }
 
-static void handle_selection_mode(Tab *tab, Window win, GC gc, KeySym ks, char buf) {
-    if (!selection_mode) return;
-    
-    if (ks == XK_Return) {
-        if (tab->selection_input_pos > 0) {
-            int selection = atoi(tab->selection_input) - 1; // Convert to 0-based index
-            
-            if (selection >= 0 && selection < selection_match_count) {
-                // Apply the selection - go back to original line and append the selected match
-                tab->current_line = original_line;
-                
-                // Find where the partial word ends in the original command
-                char *line = tab->lines[tab->current_line];
-                int line_len = strlen(line);
-                int word_start = line_len - 1;
-                while (word_start >= 0 && line[word_start] != ' ' && line[word_start] != '\t') {
-                    word_start--;
-                }
-                word_start++;
-                
-                // Replace the partial word with the selected match
-                strcpy(line + word_start, selection_matches[selection]);
-                tab->cursor_pos = strlen(line);
-                
-                // Add space after completion
-                if (strlen(line) < MAX_LINE_LEN - 1) {
-                    strcat(line, " ");
-                    tab->cursor_pos++;
-                }
-                
-                tab->isCommand[tab->current_line] = 1;
-            } else {
-                // Invalid selection number - restore original command
-                tab->current_line = original_line;
-                strcpy(tab->lines[tab->current_line], original_command);
-                tab->cursor_pos = strlen(original_command);
-                tab->isCommand[tab->current_line] = 1;
-                draw_output(win, gc, tab, "Invalid selection number\n");
+
+/* ---- Headless mode ----
+ * `myTerm -H [script]` runs without a display, for benchmarks and CI.  The
+ * paint ops go to text grids in place of pixmaps: one row of character cells
+ * per pixel row of the window, where the text of a line lands on the row of
+ * its top edge.  That is exact for the fixed-width metrics used without a
+ * font.  Each tab's Surface has one, and presenting copies from it to the
+ * grid that stands for the window.  Input comes
+ * from the script (stdin if none is given), one command per line:
+ *
+ *   type TEXT        type TEXT, one key per character
+ *   key NAME...      press keys by keysym name: Return, Tab, ctrl+c, shift+Up
+ *   wait MS          run the event loop for MS milliseconds
+ *   idle [MS]        run it until the current tab's command has finished and
+ *                    nothing has happened for MS milliseconds (default 100)
+ *   resize W H       resize the window
+ *   click X Y        click at (X, Y)
+ *   feed FILE        pass FILE through the current tab's output handling, as
+ *                    if a command printed it, and print the rate
+ *   parse FILE       pass FILE through the escape-sequence parser alone, into
+ *                    a scratch screen with no scrollback, and print the rate
+ *   ingest FILE      split FILE into lines into a scratch scrollback, as
+ *                    multiWatch output is, and print the rate
+ *   spawn N          start N shells through the launcher and N with fork(),
+ *                    and print the average time to each one's first byte
+ *   dump             print the surface to stdout
+ *   report [LABEL]   print the time, frames and paint ops since the last report,
+ *                    the output read and its rate if there was any, and the
+ *                    event loop's wakeups and the CPU time used
+ *
+ * Lines starting with # are comments.  The end of the script is "exit".
+ * run() drives the same handlers as with X; only the events come from here.
+ * The keys of one type or key line arrive as one batch, like keys already
+ * queued in the X connection (see input_begin).
+ */
+#define SCRIPT_IDLE_MS 100
+#define SCRIPT_LIMIT_MS (600 * 1000)   // longest idle before the script gives up
+
+static FILE *script = NULL;
+static int script_line = 0;
+static Surface script_window;   // what the window would show
+static unsigned long surface_frames = 0, surface_ops = 0, surface_bytes = 0;
+static struct timespec report_start, report_cpu;
+
+// Match a text grid to the window; a new size starts out blank
+static int surface_fit(Surface *s) {
+    int cols = win_width / fm.char_width + 1, rows = win_height;
+    if (s->cells && cols == s->cols && rows == s->rows) return 0;
+    char *grown = realloc(s->cells, (size_t)cols * rows);
+    if (!grown) return -1;
+    s->cells = grown;
+    s->cols = cols;
+    s->rows = rows;
+    memset(s->cells, 0, (size_t)cols * rows);
+    return 0;
+}
+
+// Clip a pixel rectangle to a grid: rows [*y0, *y1), columns [*c0, *c1)
+static int surface_clip(const Surface *s, int x, int y, int w, int h, int *c0, int *c1, int *y0, int *y1) {
+    *c0 = x < 0 ? 0 : x / fm.char_width;
+    *c1 = (x + w + fm.char_width - 1) / fm.char_width;
+    if (*c1 > s->cols) *c1 = s->cols;
+    *y0 = y < 0 ? 0 : y;
+    *y1 = y + h < s->rows ? y + h : s->rows;
+    return *c0 < *c1 && *y0 < *y1;
+}
+
+static void surface_apply(const PaintOp *m, const char *data) {
+    surface_ops++;
+    surface_bytes += sizeof(*m) + m->len;
+    Surface *s = target;
+    if (surface_fit(s) < 0) return;
+
+    int c0, c1, y0, y1;
+    switch (m->op) {
+        case PAINT_TEXT: {
+            int row = m->a[1] - fm.ascent, col = m->a[0] / fm.char_width;
+            int n = m->len < s->cols - col ? m->len : s->cols - col;
+            if (row >= 0 && row < s->rows && col >= 0 && n > 0)
+                memcpy(s->cells + (size_t)row * s->cols + col, data, n);
+            break;
+        }
+        case PAINT_CLEAR:
+            if (!surface_clip(s, m->a[0], m->a[1], m->a[2], m->a[3], &c0, &c1, &y0, &y1)) break;
+            for (int y = y0; y < y1; y++)
+                memset(s->cells + (size_t)y * s->cols + c0, 0, c1 - c0);
+            break;
+        case PAINT_COPY: {
+            // Rows move whole; copying away from the destination keeps overlaps intact
+            int dy = m->a[5] - m->a[1];
+            if (!surface_clip(s, m->a[0], m->a[1], m->a[2], m->a[3], &c0, &c1, &y0, &y1)) break;
+            int down = dy > 0;
+            for (int k = 0; k < y1 - y0; k++) {
+                int y = down ? y1 - 1 - k : y0 + k;
+                if (y + dy < 0 || y + dy >= s->rows) continue;
+                memmove(s->cells + (size_t)(y + dy) * s->cols + c0,
+                        s->cells + (size_t)y * s->cols + c0, c1 - c0);
             }
-        } else {
-            // No input - restore original command
-            tab->current_line = original_line;
-            strcpy(tab->lines[tab->current_line], original_command);
-            tab->cursor_pos = strlen(original_command);
-            tab->isCommand[tab->current_line] = 1;
+            break;
         }
-        
-        // Cleanup and exit selection mode
-        selection_mode = 0;
-        for (int i = 0; i < selection_match_count; i++) {
-            free(selection_matches[i]);
+        case PAINT_PRESENT:
+            surface_frames++;
+            if (surface_fit(&script_window) < 0) break;
+            if (!surface_clip(s, m->a[0], m->a[1], m->a[2], m->a[3], &c0, &c1, &y0, &y1)) break;
+            for (int y = y0; y < y1; y++)
+                memcpy(script_window.cells + (size_t)y * s->cols + c0, s->cells + (size_t)y * s->cols + c0, c1 - c0);
+            break;
+    }
+}
+
+// Print the rows that hold text, as they would appear in the window; a gap
+// of whole lines between them is printed as empty lines
+static void surface_dump(void) {
+    const Surface *s = &script_window;
+    int last = -1;
+    for (int y = 0; y < s->rows; y++) {
+        const char *row = s->cells + (size_t)y * s->cols;
+        int len = s->cols;
+        while (len > 0 && !row[len - 1]) len--;
+        if (len == 0) continue;
+        if (last >= 0)
+            for (int k = (y - last) / fm.line_height; k > 1; k--) putchar('\n');
+        last = y;
+        for (int c = 0; c < len; c++) putchar(row[c] ? row[c] : ' ');
+        putchar('\n');
+    }
+    fflush(stdout);
+}
+
+// Wall time, CPU time and event-loop wakeups go with the paint counts, so
+// idle cost and command-completion latency show up in the same line
+static void script_report(const char *label) {
+    struct timespec t, cpu;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+    double ms = (t.tv_sec - report_start.tv_sec) * 1e3 + (t.tv_nsec - report_start.tv_nsec) / 1e6;
+    double cpu_ms = (cpu.tv_sec - report_cpu.tv_sec) * 1e3 + (cpu.tv_nsec - report_cpu.tv_nsec) / 1e6;
+    printf("%s: %.3f ms, %lu frames, %lu paint ops, %lu bytes",
+           *label ? label : "report", ms, surface_frames, surface_ops, surface_bytes);
+    if (output_read) printf(", %lu bytes of output at %.1f MB/s", output_read, ms > 0 ? output_read / ms / 1e3 : 0.0);
+    printf(", %lu wakeups, %.3f ms CPU\n", wakeups, cpu_ms);
+    fflush(stdout);
+    surface_frames = surface_ops = surface_bytes = output_read = wakeups = 0;
+    report_start = t;
+    report_cpu = cpu;
+}
+
+// A keysym name with optional ctrl+, shift+ and alt+ in front, and the bytes
+// XLookupString would give for it
+static int script_key(Window win, GC gc, const char *spec) {
+    unsigned int state = 0;
+    for (;;) {
+        if (strncmp(spec, "ctrl+", 5) == 0) state |= ControlMask, spec += 5;
+        else if (strncmp(spec, "shift+", 6) == 0) state |= ShiftMask, spec += 6;
+        else if (strncmp(spec, "alt+", 4) == 0) state |= Mod1Mask, spec += 4;
+        else break;
+    }
+    KeySym ks = XStringToKeysym(spec);
+    if (ks == NoSymbol) return -1;
+
+    char buf[1];
+    int len = 0;
+    if (ks >= 0x20 && ks < 0x100) {
+        buf[0] = (state & ControlMask) && ks >= '@' && ks <= '~' ? ks & 0x1f : ks;
+        len = 1;
+    } else if ((ks >= XK_BackSpace && ks <= XK_Escape) || ks == XK_Delete) {
+        buf[0] = ks & 0x7f;
+        len = 1;
+    }
+    handle_key(win, gc, ks, state, buf, len);
+    return 0;
+}
+
+// Run the event loop until the current tab is idle and has been for quiet_ms
+static void script_idle(Window win, GC gc, int quiet_ms) {
+    long long limit = now_ms() + SCRIPT_LIMIT_MS, quiet_since = now_ms();
+    for (;;) {
+        long long now = now_ms();
+        int busy = tabs[current_tab]->busy || frame_pending;
+        if (!busy && now - quiet_since >= quiet_ms) break;
+        if (now >= limit) errx(1, "script line %d: no idle within %d s", script_line, SCRIPT_LIMIT_MS / 1000);
+        wake_by_ms = busy ? limit : quiet_since + quiet_ms;
+        if (wait_for_input(win, gc) != 0) quiet_since = now_ms();
+    }
+    wake_by_ms = 0;
+}
+
+// Measures the ingestion stage alone: read(), the escape-sequence parser and
+// the scrollback, with no shell, pty or painting in between
+static void script_feed(const char *path) {
+    Tab *tab = tabs[current_tab];
+    if (tab->busy) errx(1, "script line %d: a command is running", script_line);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) err(1, "script line %d: %s", script_line, path);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    screen_begin(tab);
+    int lnm = tab->screen.newline_mode;
+    tab->screen.newline_mode = 1;   // the pty would have turned "\n" into "\r\n"
+    while (ingest_fd(tab, fd, INGEST_BUDGET) > 0) {}
+    tab->screen.newline_mode = lnm;
+    screen_finish(tab);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    close(fd);
+
+    double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    printf("feed %s: %lld bytes in %.3f ms, %.1f MB/s\n", path, (long long)st.st_size, ms,
+           ms > 0 ? st.st_size / ms / 1e3 : 0.0);
+    fflush(stdout);
+    frame_pending = 1;
+}
+
+// Measures the escape-sequence parser alone: the file goes through vt_feed()
+// into a scratch screen of the window's size, and rows scrolled off its top
+// are dropped instead of being encoded for the scrollback
+static void script_parse(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) err(1, "script line %d: %s", script_line, path);
+    Tab *tab = calloc(1, sizeof(Tab));
+    if (!tab) errx(1, "Out of memory");
+    sb_init(&tab->sb, 1);
+    screen_init(tab);
+    tab->pty = -1;
+    tab->busy = 1;
+    tab->screen.discard = 1;
+    tab->screen.newline_mode = 1;
+
+    unsigned char buf[65536];
+    ssize_t n;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while ((n = read(fd, buf, sizeof(buf))) > 0) vt_feed(tab, buf, n);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    close(fd);
+    screen_free(&tab->screen);
+    sb_free(&tab->sb);
+    free(tab);
+
+    double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    printf("parse %s: %lld bytes in %.3f ms, %.1f MB/s\n", path, (long long)st.st_size, ms,
+           ms > 0 ? st.st_size / ms / 1e3 : 0.0);
+    fflush(stdout);
+}
+
+// Measures ingest_text() alone: the file is read into memory first and handed
+// over in 64 KB pieces that end at a line break, the way multiWatch passes on
+// its output, into a scratch tab with the usual scrollback
+static void script_ingest(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) err(1, "script line %d: %s", script_line, path);
+    char *text = malloc(st.st_size > 0 ? st.st_size : 1);
+    Tab *tab = calloc(1, sizeof(Tab));
+    if (!text || !tab) errx(1, "Out of memory");
+    size_t len = 0;
+    ssize_t n;
+    while (len < (size_t)st.st_size && (n = read(fd, text + len, st.st_size - len)) > 0) len += n;
+    close(fd);
+    sb_init(&tab->sb, scrollback_lines);
+    screen_init(tab);
+    tab->pty = -1;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t at = 0; at < len;) {
+        size_t piece = len - at < 65536 ? len - at : 65536;
+        const char *nl = memrchr(text + at, '\n', piece);
+        if (nl && at + piece < len) piece = nl + 1 - (text + at);
+        ingest_text(tab, text + at, piece);
+        at += piece;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    screen_free(&tab->screen);
+    sb_free(&tab->sb);
+    free(tab);
+    free(text);
+
+    double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    printf("ingest %s: %zu bytes in %.3f ms, %.1f MB/s\n", path, len, ms, ms > 0 ? len / ms / 1e3 : 0.0);
+    fflush(stdout);
+}
+
+// Start count shells each way, alternating between the launcher and a fork()
+// of this process, and time each from the request to the first byte of its
+// prompt; the time the spawn call itself blocks the event loop is given too
+static void script_spawn(int count) {
+    if (launcher_fd < 0) errx(1, "script line %d: the launcher is not running", script_line);
+    const char *way[2] = { "launcher", "fork" };
+    double first[2] = { 0, 0 }, worst[2] = { 0, 0 }, call[2] = { 0, 0 };
+    for (int i = 0; i < count; i++) {
+        for (int w = 0; w < 2; w++) {
+            pid_t pid;
+            struct timespec t0, t1, t2;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            int master = w == 0 ? launcher_spawn(25, 80, &pid) : pty_spawn_shell(25, 80, &pid);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            if (master < 0) err(1, "script line %d: %s", script_line, way[w]);
+            struct pollfd pfd = { .fd = master, .events = POLLIN };
+            char buf[256];
+            if (poll(&pfd, 1, 5000) != 1 || read(master, buf, sizeof(buf)) <= 0)
+                errx(1, "script line %d: no prompt from a shell started by %s", script_line, way[w]);
+            clock_gettime(CLOCK_MONOTONIC, &t2);
+            close(master);
+            kill(pid, SIGHUP);
+            if (w == 1) shell_reap(pid);   // the launcher reaps its own
+
+            double c = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+            double f = (t2.tv_sec - t0.tv_sec) * 1e3 + (t2.tv_nsec - t0.tv_nsec) / 1e6;
+            call[w] += c;
+            first[w] += f;
+            if (f > worst[w]) worst[w] = f;
         }
-        free(selection_matches);
-        selection_matches = NULL;
-        
-        draw_text(win, gc, tab);
+    }
+    for (int w = 0; w < 2; w++)
+        printf("spawn %s: %d shells, first byte in %.3f ms (worst %.3f), %.3f ms in the call\n",
+               way[w], count, first[w] / count, worst[w], call[w] / count);
+    fflush(stdout);
+}
+
+static void script_open(const char *path) {
+    script = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!script) err(1, "%s", path);
+    clock_gettime(CLOCK_MONOTONIC, &report_start);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &report_cpu);
+}
+
+// Carry out the next line of the script; its end is the "exit" command
+static void script_step(Window win, GC gc) {
+    char line[MAX_LINE_LEN + 16];
+    if (!fgets(line, sizeof(line), script)) terminal_exit(win, gc);
+    script_line++;
+    line[strcspn(line, "\n")] = '\0';
+
+    char *arg = line + strcspn(line, " ");
+    if (*arg) *arg++ = '\0';
+    int a, b;
+    if (line[0] == '\0' || line[0] == '#') {
         return;
+    } else if (strcmp(line, "type") == 0) {
+        input_begin();
+        for (char *c = arg; *c; c++) handle_key(win, gc, (unsigned char)*c, 0, c, 1);
+        input_end(win, gc);
+    } else if (strcmp(line, "key") == 0) {
+        input_begin();
+        for (char *k = strtok(arg, " "); k; k = strtok(NULL, " "))
+            if (script_key(win, gc, k) < 0) errx(1, "script line %d: unknown key %s", script_line, k);
+        input_end(win, gc);
+    } else if (strcmp(line, "wait") == 0 && sscanf(arg, "%d", &a) == 1) {
+        wake_by_ms = now_ms() + a;
+        while (now_ms() < wake_by_ms) wait_for_input(win, gc);
+        wake_by_ms = 0;
+    } else if (strcmp(line, "idle") == 0) {
+        script_idle(win, gc, sscanf(arg, "%d", &a) == 1 ? a : SCRIPT_IDLE_MS);
+    } else if (strcmp(line, "resize") == 0 && sscanf(arg, "%d %d", &a, &b) == 2) {
+        handle_resize(win, gc, a, b);
+    } else if (strcmp(line, "click") == 0 && sscanf(arg, "%d %d", &a, &b) == 2) {
+        handle_click(win, gc, a, b);
+    } else if (strcmp(line, "feed") == 0 && *arg) {
+        script_feed(arg);
+    } else if (strcmp(line, "parse") == 0 && *arg) {
+        script_parse(arg);
+    } else if (strcmp(line, "ingest") == 0 && *arg) {
+        script_ingest(arg);
+    } else if (strcmp(line, "spawn") == 0 && sscanf(arg, "%d", &a) == 1 && a > 0) {
+        script_spawn(a);
+    } else if (strcmp(line, "dump") == 0) {
+        surface_dump();
+    } else if (strcmp(line, "report") == 0) {
+        script_report(arg);
+    } else {
+        errx(1, "script line %d: cannot run \"%s\"", script_line, line);
     }
-    else if (ks == XK_BackSpace) {
-        // Handle backspace in selection input
-        if (tab->selection_input_pos > 0) {
-            tab->selection_input[--tab->selection_input_pos] = '\0';
-            
-            // Update the selection line display
-            char display_line[MAX_LINE_LEN];
-            snprintf(display_line, sizeof(display_line), "Selection: %s", tab->selection_input);
-            strcpy(tab->lines[tab->current_line], display_line);
-            tab->cursor_pos = strlen(display_line);
-            draw_text(win, gc, tab);
+}
+
+/* ---- Sessions ----
+ * `myTerm -s [name]` keeps its tabs in a session daemon, so shells and
+ * scrollback outlive the window.  The first front end for a name forks the
+ * daemon before it opens the X connection.  The daemon runs the terminal
+ * headless (tabs, shells, scrollback, history, multiWatch) and listens on a
+ * Unix socket that only its own user may use.  A front end sends
+ * SESSION_HELLO with its window size and font metrics, then its keys, clicks
+ * and resizes; the daemon answers with paint ops for its back buffer.
+ * Attaching repaints the current view from scratch, so it costs one
+ * screenful however long the scrollback is.  A new front end takes over
+ * from the attached one, and losing the X connection only detaches.
+ */
+#define SESSION_DEFAULT "default"
+
+static int session_listen_fd = -1;
+static char session_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static char *session_in = NULL;     // partial messages from the front end
+static size_t session_in_len = 0, session_in_cap = 0;
+static int session_waiting = 0;     // EPOLLOUT is armed
+static EventSource session_listen_src = { .kind = SRC_SESSION_LISTEN }, session_src = { .kind = SRC_SESSION };
+
+// $XDG_RUNTIME_DIR/myterm-<uid>-<name>, or under /tmp
+static int session_set_path(const char *name) {
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    if (!dir || !*dir) dir = "/tmp";
+    int n = snprintf(session_path, sizeof(session_path), "%s/myterm-%u-%s", dir, (unsigned)getuid(), name);
+    return n > 0 && (size_t)n < sizeof(session_path) && !strchr(name, '/') ? 0 : -1;
+}
+
+// Both ends check that the other runs as the same user
+static int session_peer_ok(int fd) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+}
+
+static void session_detach(void) {
+    if (session_fd < 0) return;
+    close(session_fd);
+    session_fd = -1;
+    session_out_len = 0;
+    session_in_len = 0;
+    session_waiting = 0;
+}
+
+// Send what the socket takes; the rest waits for EPOLLOUT
+static void session_send(void) {
+    size_t sent = 0;
+    while (session_fd >= 0 && sent < session_out_len) {
+        ssize_t n = send(session_fd, session_out + sent, session_out_len - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n > 0) {
+            sent += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EAGAIN) {
+            break;
+        } else {
+            session_detach();
+            return;
         }
     }
-    else if (ks == XK_Escape) {
-        // Cancel selection on Escape
-        selection_mode = 0;
-        for (int i = 0; i < selection_match_count; i++) {
-            free(selection_matches[i]);
+    memmove(session_out, session_out + sent, session_out_len - sent);
+    session_out_len -= sent;
+
+    int waiting = session_out_len > 0;
+    if (waiting != session_waiting) {
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN | (waiting ? EPOLLOUT : 0);
+        ev.data.ptr = &session_src;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, session_fd, &ev);
+        session_waiting = waiting;
+        if (!waiting) frame_pending = 1;   // paint what was held back meanwhile
+    }
+}
+
+// A front end attached: take its metrics and paint everything for it
+static void session_hello(Window win, GC gc, const PaintOp *m, const int16_t *advance, size_t n) {
+    int old_view = view_lines();
+    fm.line_height = m->a[2];
+    fm.ascent = m->a[3];
+    fm.descent = m->a[4];
+    fm.char_width = m->a[5] > 0 ? m->a[5] : 1;
+    for (int c = 0; c < 256; c++) fm.advance[c] = (size_t)c < n ? advance[c] : fm.char_width;
+    fm.tab_width = text_width("[Tab 00]", 8);
+
+    if (total_tabs == 0) {
+        // The first front end decides the size of the first shell
+        win_width = m->a[0];
+        win_height = m->a[1];
+        if (!create_new_tab()) return;
+    } else {
+        // This window's size and font may differ from the last one's
+        resize_window(m->a[0], m->a[1], old_view);
+    }
+    invalidate_window();
+    draw_text(win, gc, tabs[current_tab]);
+}
+
+static void session_message(Window win, GC gc, const PaintOp *m, const char *data) {
+    switch (m->op) {
+        case SESSION_HELLO:
+            session_hello(win, gc, m, (const int16_t *)data, m->len / sizeof(int16_t));
+            break;
+        case SESSION_KEY:
+            if (total_tabs) handle_key(win, gc, m->attr, (uint16_t)m->a[0], data, m->len);
+            break;
+        case SESSION_BUTTON:
+            if (total_tabs) handle_click(win, gc, m->a[0], m->a[1]);
+            break;
+        case SESSION_RESIZE:
+            if (total_tabs) handle_resize(win, gc, m->a[0], m->a[1]);
+            break;
+    }
+}
+
+// A front end connected; it replaces the one attached, which is told so
+static void session_accept(void) {
+    int fd = accept4(session_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) return;
+    if (!session_peer_ok(fd)) {
+        close(fd);
+        return;
+    }
+    if (session_fd >= 0) {
+        session_op(SESSION_DETACH, 0, 0, 0, 0, 0, 0, 0, NULL, 0);
+        session_send();
+        session_detach();
+    }
+    session_fd = fd;
+    reactor_add(fd, &session_src);
+}
+
+static void session_input(Window win, GC gc, uint32_t events) {
+    if (events & EPOLLOUT) session_send();
+    if (session_fd < 0 || !(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) return;
+
+    for (;;) {
+        if (session_in_cap - session_in_len < 4096) {
+            size_t cap = session_in_cap ? session_in_cap * 2 : 16 * 1024;
+            char *grown = realloc(session_in, cap);
+            if (!grown) return;
+            session_in = grown;
+            session_in_cap = cap;
         }
-        free(selection_matches);
-        selection_matches = NULL;
-        
-        // Restore original command
-        tab->current_line = original_line;
-        strcpy(tab->lines[tab->current_line], original_command);
-        tab->cursor_pos = strlen(original_command);
-        tab->isCommand[tab->current_line] = 1;
-        draw_text(win, gc, tab);
+        ssize_t n = read(session_fd, session_in + session_in_len, session_in_cap - session_in_len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) break;
+        if (n <= 0) {
+            session_detach();   // the window went away; the session stays
+            return;
+        }
+        session_in_len += n;
     }
-    else if (buf >= '0' && buf <= '9' && tab->selection_input_pos < 9) { // Limit to reasonable length
-        // Accept digits for selection input
-        tab->selection_input[tab->selection_input_pos++] = buf;
-        tab->selection_input[tab->selection_input_pos] = '\0';
-        
-        // Update the selection line display
-        char display_line[MAX_LINE_LEN];
-        snprintf(display_line, sizeof(display_line), "Selection: %s", tab->selection_input);
-        strcpy(tab->lines[tab->current_line], display_line);
-        tab->cursor_pos = strlen(display_line);
-        draw_text(win, gc, tab);
+
+    size_t pos = 0;
+    input_begin();
+    while (session_fd >= 0 && session_in_len - pos >= sizeof(PaintOp)) {
+        PaintOp m;
+        memcpy(&m, session_in + pos, sizeof(m));
+        if (session_in_len - pos < sizeof(m) + m.len) break;
+        const char *data = session_in + pos + sizeof(m);
+        pos += sizeof(m) + m.len;
+        session_message(win, gc, &m, data);
+    }
+    input_end(win, gc);
+    if (session_fd >= 0) {
+        memmove(session_in, session_in + pos, session_in_len - pos);
+        session_in_len -= pos;
     }
-    // Ignore other keys in selection mode
 }
 
+// The session is over ("exit"): let the front end go and remove the socket
+static void session_end(void) {
+    if (session_fd >= 0) {
+        // A front end that has stopped reading must not keep the daemon from
+        // exiting: what the socket does not take is dropped, and the front
+        // end sees the connection close instead of SESSION_EXIT
+        session_op(SESSION_EXIT, 0, 0, 0, 0, 0, 0, 0, NULL, 0);
+        send(session_fd, session_out, session_out_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+    unlink(session_path);
+}
 
-static void run(Window win, GC gc) {
-    XEvent ev;
-    pid_t child;
-    int pipefd[2];
-    int readend = 0, writeend = 1, l;
-    char output[1000], temp[4], t1[1000];
-    int output_bytes;
+static void session_daemon(void) {
+    headless = HEADLESS_SESSION;
+    int null = open("/dev/null", O_RDWR);
+    if (null >= 0) {
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        if (null > STDERR_FILENO) close(null);
+    }
+    launcher_start();
+    vt_init_table();
+    load_history();
 
+    fixed_metrics();   // until a front end says otherwise
+    reactor_init(-1);
+    reactor_add(session_listen_fd, &session_listen_src);
+    pathindex_init();
+    for (;;) wait_for_input(None, NULL);
+}
 
-    total_tabs = 1;
-    current_tab = 0;
-    init_tab(&tabs[0]);
-    tabs[0].command[0] = '\0';
+static int session_connect(void) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strcpy(addr.sun_path, session_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || !session_peer_ok(fd)) {
+        int e = errno;
+        close(fd);
+        errno = e;
+        return -1;
+    }
+    return fd;
+}
 
-    while (1) {
-        XNextEvent(dpy, &ev);
-        Tab *tab = &tabs[current_tab];
-
-        switch (ev.type) {
-            case ConfigureNotify:
-                // Window resize
-                if (ev.xconfigure.width != win_width || ev.xconfigure.height != win_height) {
-                    win_width = ev.xconfigure.width;
-                    win_height = ev.xconfigure.height;
-                    draw_text(win, gc, tab); // Redraw with new dimensions
-                }
-                break;
+// Connect to the session called name, starting its daemon if there is none.
+// Runs before the X connection is opened, so the daemon never shares it.
+static int session_open(const char *name) {
+    if (session_set_path(name) < 0) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = session_connect();
+    if (fd >= 0) return fd;
+    if (errno == ECONNREFUSED) unlink(session_path);   // left by a daemon that died
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strcpy(addr.sun_path, session_path);
+    session_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (session_listen_fd < 0) return -1;
+    mode_t old = umask(077);
+    int bound = bind(session_listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old);
+    if (bound < 0 || listen(session_listen_fd, 8) < 0) return -1;
+
+    // Double fork: the daemon belongs to no terminal and is nobody's child
+    pid_t pid = fork();
+    if (pid == 0) {
+        setsid();
+        if (fork() == 0) session_daemon();
+        _exit(0);
+    }
+    if (pid > 0) waitpid(pid, NULL, 0);
+    close(session_listen_fd);
+    session_listen_fd = -1;
+    return session_connect();
+}
 
-            case Expose:
-                draw_text(win, gc, tab);
-                break;
+static void session_write(int fd, int op, int a0, int a1, uint32_t attr, const void *data, size_t len) {
+    PaintOp m = { op, len, { a0, a1 }, attr };
+    struct iovec iov[2] = { { &m, sizeof(m) }, { (void *)data, len } };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = len ? 2 : 1 };
+    sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
 
-            case KeyPress: {
+// Replay the daemon's paint ops on this window and send it the input
+static void session_frontend(Window win, GC gc, int fd) {
+    use_surface(&shared_surface);
+    paint_clear(0, 0, win_width, win_height);
+
+    PaintOp hello = { SESSION_HELLO, 256 * sizeof(int16_t),
+                      { win_width, win_height, fm.line_height, fm.ascent, fm.descent, fm.char_width }, .attr = 0 };
+    int16_t advance[256];
+    for (int c = 0; c < 256; c++) advance[c] = fm.advance[c];
+    struct iovec iov[2] = { { &hello, sizeof(hello) }, { advance, sizeof(advance) } };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+    sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+    size_t cap = 256 * 1024, len = 0;
+    char *in = malloc(cap);
+    if (!in) err(1, "malloc");
+    const char *why = "session closed";
+    for (;;) {
+        while (XPending(dpy)) {
+            XEvent ev;
+            XNextEvent(dpy, &ev);
+            if (ev.type == KeyPress) {
                 KeySym ks;
                 char buf[32];
-                int len = XLookupString(&ev.xkey, buf, sizeof(buf), &ks, NULL);
-                tab = &tabs[current_tab];
-
-
-                // ---------- SCROLLING ----------
-                if (ks == XK_Up)
-                {
-                    if (tab->scroll_y > 0)
-                        tab->scroll_y--;
-                    draw_text(win, gc, tab);
-                    continue;
-                }
-                else if (ks == XK_Down)
-                {
-                    if (tab->scroll_y < tab->current_line)
-                        tab->scroll_y++;
-                    draw_text(win, gc, tab);
-                    continue;
-                }
-                else if (ks == XK_Left)
-                {
-                    if (tab->scroll_x > 0)
-                        tab->scroll_x--;
-                    draw_text(win, gc, tab);
-                    continue;
-                }
-                else if (ks == XK_Right)
-                {
-                    tab->scroll_x++;
-                    draw_text(win, gc, tab);
-                    continue;
-                }
+                int n = XLookupString(&ev.xkey, buf, sizeof(buf), &ks, NULL);
+                session_write(fd, SESSION_KEY, ev.xkey.state, 0, ks, buf, n > 0 ? n : 0);
+            } else if (ev.type == ButtonPress) {
+                session_write(fd, SESSION_BUTTON, ev.xbutton.x, ev.xbutton.y, 0, NULL, 0);
+            } else if (ev.type == ConfigureNotify &&
+                       (ev.xconfigure.width != win_width || ev.xconfigure.height != win_height)) {
+                win_width = ev.xconfigure.width;
+                win_height = ev.xconfigure.height;
+                use_surface(&shared_surface);
+                paint_clear(0, 0, win_width, win_height);
+                session_write(fd, SESSION_RESIZE, win_width, win_height, 0, NULL, 0);
+            } else if (ev.type == Expose) {
+                XCopyArea(dpy, backbuf, win, gc, ev.xexpose.x, ev.xexpose.y,
+                          ev.xexpose.width, ev.xexpose.height, ev.xexpose.x, ev.xexpose.y);
+                if (ev.xexpose.count == 0) XFlush(dpy);
+            }
+        }
+        XFlush(dpy);
+
+        struct pollfd pfd[2] = { { ConnectionNumber(dpy), POLLIN, 0 }, { fd, POLLIN, 0 } };
+        if (poll(pfd, 2, -1) < 0 && errno != EINTR) break;
+        if (!(pfd[1].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+        if (cap - len < 64 * 1024 + sizeof(PaintOp)) {
+            char *grown = realloc(in, cap * 2);
+            if (!grown) break;
+            in = grown;
+            cap *= 2;
+        }
+        ssize_t n = read(fd, in + len, cap - len);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            break;
+        }
+        len += n;
+
+        size_t pos = 0;
+        PaintOp m;
+        while (len - pos >= sizeof(m)) {
+            memcpy(&m, in + pos, sizeof(m));
+            if (len - pos < sizeof(m) + m.len) break;
+            const char *data = in + pos + sizeof(m);
+            pos += sizeof(m) + m.len;
+            switch (m.op) {
+                case PAINT_TEXT: draw_segment(backbuf, gc, m.a[0], m.a[1], data, m.len, m.attr); break;
+                case PAINT_CLEAR: paint_clear(m.a[0], m.a[1], m.a[2], m.a[3]); break;
+                case PAINT_COPY: paint_copy(gc, m.a[0], m.a[1], m.a[2], m.a[3], m.a[4], m.a[5]); break;
+                case PAINT_FRAME: paint_frame(backbuf, gc, m.a[0], m.a[1], m.a[2], m.a[3]); break;
+                case PAINT_LINE: paint_line(backbuf, gc, m.a[0], m.a[1], m.a[2], m.a[3]); break;
+                case PAINT_PRESENT: paint_present(win, gc, m.a[0], m.a[1], m.a[2], m.a[3]); break;
+                case PAINT_FLUSH: XFlush(dpy); break;
+                case SESSION_EXIT: why = NULL; goto done;
+                case SESSION_DETACH: why = "attached elsewhere"; goto done;
+            }
+        }
+        memmove(in, in + pos, len - pos);
+        len -= pos;
+    }
+done:
+    free(in);
+    XUngrabKeyboard(dpy, CurrentTime);
+    XUnmapWindow(dpy, win);
+    XDestroyWindow(dpy, win);
+    XFreeGC(dpy, gc);
+    XCloseDisplay(dpy);
+    if (why) errx(1, "%s", why);
+}
 
-                // Handling search mode
-                if (search_mode)
-                {
-                    if (ks == XK_Return)
-                    {
-                        search_mode = 0;
-                        // Clear the search prompt line and show results
-                        tab->current_line++;
-                        search_history(tab, win, gc);
-                        // Reset for next command
-                        tab->current_line++;
-                        tab->isCommand[tab->current_line] = 1;
-                        tab->cursor_pos = 0;
-                        tab->command[0] = '\0';
-                        // Ensure the current line is visible
-                        if (tab->current_line > tab->scroll_y + (HEIGHT - 40) / 20 - 1)
-                        {
-                            tab->scroll_y = tab->current_line - (HEIGHT - 40) / 20 + 1;
-                        }
-                        draw_text(win, gc, tab);
-                    }
-                    else if (ks == XK_BackSpace)
-                    {
-                        if (search_cursor > 0)
-                        {
-                            search_term[--search_cursor] = '\0';
-                        }
-                        // Update the current line with the search prompt (safe version)
-                        strncpy(tab->lines[tab->current_line], "Enter search term: ", MAX_LINE_LEN - 1);
-                        strncat(tab->lines[tab->current_line], search_term, MAX_LINE_LEN - strlen(tab->lines[tab->current_line]) - 1);
-                        tab->lines[tab->current_line][MAX_LINE_LEN - 1] = '\0';
-                        tab->cursor_pos = strlen(tab->lines[tab->current_line]);
-                        // Ensure cursor is visible horizontally
-                        if (tab->cursor_pos > tab->scroll_x + 80)
-                        { // Assuming ~80 chars visible
-                            tab->scroll_x = tab->cursor_pos - 80;
-                        }
-                        else if (tab->cursor_pos < tab->scroll_x)
-                        {
-                            tab->scroll_x = tab->cursor_pos;
-                        }
-                        draw_text(win, gc, tab);
-                    }
-                    else if (ks == XK_Escape)
-                    {
-                        search_mode = 0;
-                        // Clear search and return to normal prompt
-                        tab->current_line++;
-                        tab->isCommand[tab->current_line] = 1;
-                        tab->cursor_pos = 0;
-                        tab->command[0] = '\0';
-                        draw_text(win, gc, tab);
-                    }
-                    else if (len > 0 && search_cursor < MAX_LINE_LEN - 20)
-                    { // Reserve 20 chars for prompt
-                        search_term[search_cursor++] = buf[0];
-                        search_term[search_cursor] = '\0';
-                        // Update the current line with the search prompt (safe version)
-                        strncpy(tab->lines[tab->current_line], "Enter search term: ", MAX_LINE_LEN - 1);
-                        strncat(tab->lines[tab->current_line], search_term, MAX_LINE_LEN - strlen(tab->lines[tab->current_line]) - 1);
-                        tab->lines[tab->current_line][MAX_LINE_LEN - 1] = '\0';
-                        tab->cursor_pos = strlen(tab->lines[tab->current_line]);
-                        // Ensure cursor is visible horizontally
-                        if (tab->cursor_pos > tab->scroll_x + 80)
-                        { // Assuming ~80 chars visible
-                            tab->scroll_x = tab->cursor_pos - 80;
-                        }
-                        else if (tab->cursor_pos < tab->scroll_x)
-                        {
-                            tab->scroll_x = tab->cursor_pos;
-                        }
-                        draw_text(win, gc, tab);
-                    }
-                    continue; // Important: skip all other key handling in search mode
-                }
-                
-                // Selection mode handling for autocomplete
-                if (selection_mode && len > 0)
-                {
-                    handle_selection_mode(tab, win, gc, ks, buf[0]);
-                    for(int i=tab->current_line+1;i<MAX_LINES;i++)
-                    {
-                        if(tab->lines[i][0]!='\0')
-                            tab->lines[i][0]='\0';
-                        else
-                            break;
-                    }
-                    continue;
-                }
+static void run(Window win, GC gc) {
+    XEvent ev;
 
-                // Tab key handling
-                if (ks == XK_Tab)
-                {
-                    if (selection_mode)
-                    {
-                        // Ignore Tab in selection mode
-                    }
-                    else if (ev.xkey.state & ControlMask)
-                    {
-                        // Ctrl+Tab for tab switching
-                        current_tab = (current_tab + 1) % total_tabs;
-                        draw_text(win, gc, &tabs[current_tab]);
-                    }
-                    else
-                    {
-                        // Regular Tab for auto-complete
-                        if (current_child_pid > 0)
-                        {
-                            // Don't auto-complete while command is running
-                        }
-                        else
-                        {
-                            auto_complete(tab, win, gc);
-                        }
-                    }
-                    continue;
-                }
-                // CTRL+R for history search (this activates search mode)
-                if ((ev.xkey.state & ControlMask) && (ks == XK_R || ks == XK_r))
-                {
-                    if (current_child_pid > 0)
-                    {
-                        draw_output(win, gc, tab, "Cannot search history while command is running\n");
-                    }
-                    else
-                    {
-                        search_mode = 1;
-                        search_term[0] = '\0';
-                        search_cursor = 0;
-                        // Set up the search prompt on the current line (safe version)
-                        strncpy(tab->lines[tab->current_line], "Enter search term: ", MAX_LINE_LEN - 1);
-                        tab->lines[tab->current_line][MAX_LINE_LEN - 1] = '\0';
-                        tab->cursor_pos = strlen(tab->lines[tab->current_line]);
-                        tab->isCommand[tab->current_line] = 0; // This is not a regular command input
-                        draw_text(win, gc, tab);
-                    }
-                    continue;
-                }
-                //CTRL+C handling
-                if ((ev.xkey.state & ControlMask) && (ks == XK_C || ks == XK_c))
-                {
-                    if (current_child_pid > 0)
-                    {
-                        kill(-current_child_pid, SIGINT);
-                    } else {
-                        draw_text(win, gc,tab);
-                    }
-                    continue;
-                    // continue handling other
-                }
+    if (!create_new_tab()) errx(1, "Out of memory");
 
-                //CTRL+Z handling
-                if ((ev.xkey.state & ControlMask) && (ks == XK_Z || ks == XK_z))
-                {
-                    if (current_child_pid > 0)
-                    {
-                        // send SIGTSTP to the whole process group
-                        kill(-current_child_pid, SIGTSTP);
-                        // The monitoring loop will detect the stopped status and break
-                    }
-                    continue;
-                }
-                // CTRL+A and CTRL+E line navigation
-                if ((ev.xkey.state & ControlMask) && (ks == XK_A || ks == XK_a))
-                {
-                    tab->cursor_pos = 0; // Move to start of line
-                    draw_text(win, gc, tab);
-                    continue;
-                }
-                if ((ev.xkey.state & ControlMask) && (ks == XK_E || ks == XK_e))
-                {
-                    int cur_len = strlen(tab->lines[tab->current_line]);
-                    tab->cursor_pos = (cur_len < MAX_LINE_LEN) ? cur_len : MAX_LINE_LEN - 1;
-                    draw_text(win, gc, tab);
-                    continue;
-                }
+    while (1) {
+        if (headless) {
+            script_step(win, gc);   // input comes from the script instead of X
+            continue;
+        }
+        if (!XPending(dpy)) {
+            wait_for_input(win, gc);
+            if (!XPending(dpy)) continue;
+        }
 
-                // ---------- TAB SHORTCUTS ----------
-                if ((ev.xkey.state & ControlMask) && (ks == XK_t || ks == XK_T)) {
-                    if (total_tabs < MAX_TABS) {
-                        init_tab(&tabs[total_tabs]);
-                        tabs[total_tabs].command[0] = '\0';
-                        total_tabs++;
-                        current_tab = total_tabs - 1;
-                        draw_text(win, gc, &tabs[current_tab]);
-                    }
-                    continue;
-                }
+        // Take every queued event before painting: only the last size counts,
+        // exposed areas are merged into one, and keys and clicks share the
+        // repaint at input_end()
+        int width = 0, height = 0;
+        XExposeEvent exposed = {0};
+        int x1 = 0, y1 = 0;
+        input_begin();
+        for (int k = 0; k < EVENT_BATCH && XPending(dpy); k++) {
+            XNextEvent(dpy, &ev);
+            switch (ev.type) {
+                case ConfigureNotify:
+                    width = ev.xconfigure.width;
+                    height = ev.xconfigure.height;
+                    break;
 
-                /*
-                if ((ev.xkey.state & ControlMask) && ks == XK_Tab) {
-                    current_tab = (current_tab + 1) % total_tabs;
-                    draw_text(win, gc, &tabs[current_tab]);
+                case Expose: {
+                    const XExposeEvent *xe = &ev.xexpose;
+                    if (exposed.type == 0 || xe->x < exposed.x) exposed.x = xe->x;
+                    if (exposed.type == 0 || xe->y < exposed.y) exposed.y = xe->y;
+                    if (xe->x + xe->width > x1) x1 = xe->x + xe->width;
+                    if (xe->y + xe->height > y1) y1 = xe->y + xe->height;
+                    exposed.type = Expose;
                     break;
                 }
-                */
-
-                // ---------- COMMAND EXECUTION ----------
-                if (ks == XK_Return) {
-                    if (tab->current_line < MAX_LINES - 1)
-                    {
-                        int l = strlen(tab->lines[tab->current_line]);
-                        if (l >= 3)
-                            strncpy(temp, tab->lines[tab->current_line] + l - 3, 3);
-                        else
-                            strncpy(temp, tab->lines[tab->current_line], l);
-                        temp[(l >= 3) ? 3 : l] = '\0';
-
-                        if (strcmp(temp, "\\n\\") != 0)
-                        { // last line of multi-line or single-line input
-                            // Append current line to tab->command (without the trailing \n\ if present)
-                            if (strlen(tab->command) > 0)
-                            {
-                                strcat(tab->command, tab->lines[tab->current_line]);
-                            }
-                            else
-                            {
-                                strncpy(tab->command, tab->lines[tab->current_line], sizeof(tab->command) - 1);
-                                tab->command[sizeof(tab->command) - 1] = '\0';
-                            }
-
-                            // Adding command to history
-                            add_to_history(tab->command);
-
-                            // Handle built-in history command
-                            if (strcmp(tab->command, "history") == 0)
-                            {
-                                show_history(tab, win, gc);
-                                tab->current_line++;
-                                tab->isCommand[tab->current_line] = 1;
-                                tab->cursor_pos = 0;
-                                tab->command[0] = '\0';
-                                continue;
-                            }
-                            // Handle multiWatch command
-                            else if (strncmp(tab->command, "multiWatch", 10) == 0)
-                            {
-                                // Save current state
-                                int saved_line = tab->current_line;
-                                int saved_cursor = tab->cursor_pos;
-
-                                multiWatch(tab, win, gc, tab->command);
-
-                                // Ensure we're on a fresh command line
-                                if (tab->current_line <= saved_line)
-                                {
-                                    tab->current_line = saved_line + 1;
-                                }
-
-                                tab->isCommand[tab->current_line] = 1;
-                                tab->cursor_pos = 0;
-                                tab->command[0] = '\0';
-                                tab->lines[tab->current_line][0] = '\0'; // Clear the line
-
-                                // Make sure the prompt is visible
-                                tab->scroll_y = tab->current_line;
-                                tab->scroll_x = 0;
-
-                                draw_text(win, gc, tab);
-                                continue;
-                            }
-
-                            // Handling the "exit" command
-                            if (strcmp(tab->command, "exit") == 0)
-                            {
-                                // Clean up and exit
-                                save_history();
-
-                                // Kill all shell processes in all tabs
-                                for (int i = 0; i < total_tabs; i++)
-                                {
-                                    if (tabs[i].shell_pid > 0)
-                                    {
-                                        kill(tabs[i].shell_pid, SIGTERM);
-                                    }
-                                }
-
-                                // Cleanup X11 resources
-                                XUngrabKeyboard(dpy, CurrentTime);
-                                XUnmapWindow(dpy, win);
-                                XDestroyWindow(dpy, win);
-                                XFreeGC(dpy, gc);
-                                XCloseDisplay(dpy);
-
-                                exit(0);
-                            }
-
-                            // ---- normal command execution using tab->command ----
-                            pipe(pipefd);
-                            pid_t child = fork();
-
-                            if (child == 0)
-                            {
-                                setpgid(0, 0);
-                                signal(SIGINT, SIG_DFL);
-                                signal(SIGTSTP, SIG_DFL); 
-
-                                close(pipefd[0]);
-                                dup2(pipefd[1], STDOUT_FILENO);
-                                dup2(pipefd[1], STDERR_FILENO);
-                                close(pipefd[1]);
-
-                                if (strchr(tab->command, '|'))
-                                {
-                                    execute_piped_command(tab->command);
-                                    _exit(0);
-                                }
-
-                                // Handle redirection
-                                char *cmd_copy = strdup(tab->command);
-                                char *infile = NULL, *outfile = NULL;
-                                char *in_pos = strchr(cmd_copy, '<');
-                                char *out_pos = strchr(cmd_copy, '>');
-
-                                if (in_pos)
-                                {
-                                    *in_pos = '\0';
-                                    infile = strtok(in_pos + 1, " \t\n");
-                                }
-                                if (out_pos)
-                                {
-                                    *out_pos = '\0';
-                                    outfile = strtok(out_pos + 1, " \t\n");
-                                }
-
-                                char command_clean[1000];
-                                snprintf(command_clean, sizeof(command_clean), "%s", cmd_copy);
-
-                                if (infile)
-                                {
-                                    int fd_in = open(infile, O_RDONLY);
-                                    if (fd_in < 0)
-                                        _exit(1);
-                                    dup2(fd_in, STDIN_FILENO);
-                                    close(fd_in);
-                                }
-
-                                if (outfile)
-                                {
-                                    int fd_out = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                                    if (fd_out < 0)
-                                        _exit(1);
-                                    dup2(fd_out, STDOUT_FILENO);
-                                    close(fd_out);
-                                }
-                                
-                                execlp("sh", "sh", "-c", command_clean, NULL);
-                                _exit(1);
-                            }
-                            // ... inside the KeyPress case, where you fork and execute commands ...
-                            else if (child > 0)
-                            {
-                                setpgid(child, child);
-                                current_child_pid = child;
-                                close(pipefd[1]);
-
-                                // Set non-blocking mode for child's pipe read-end
-                                int flags = fcntl(pipefd[0], F_GETFL, 0);
-                                fcntl(pipefd[0], F_SETFL, flags | O_NONBLOCK);
-
-                                int xfd = ConnectionNumber(dpy);
-                                char buf[4096];
-                                int status;
-                                int child_stopped = 0;
-
-                                while (1)
-                                {
-                                    // 1. Check if child has exited or stopped
-                                    pid_t done = waitpid(child, &status, WUNTRACED | WNOHANG);
-                                    if (done > 0)
-                                    {
-                                        if (WIFSTOPPED(status))
-                                        {
-                                            background_jobs[bg_count++] = child;
-                                            child_stopped = 1;
-                                            current_child_pid = -1;
-                                            draw_output(win, gc, tab, "[Process moved to background]\n");
-                                            break;
-                                        }
-                                        else if (WIFEXITED(status) || WIFSIGNALED(status))
-                                        {
-                                            current_child_pid = -1;
-                                            break;
-                                        }
-                                    }
-
-                                    // 2. Prepare fd sets for select
-                                    fd_set rfds;
-                                    FD_ZERO(&rfds);
-                                    FD_SET(pipefd[0], &rfds);
-                                    FD_SET(xfd, &rfds);
-                                    int maxfd = (pipefd[0] > xfd ? pipefd[0] : xfd) + 1;
-
-                                    struct timeval tv = {0, 200000}; // 200ms timeout
-                                    int sel = select(maxfd, &rfds, NULL, NULL, &tv);
-                                    if (sel < 0 && errno != EINTR)
-                                        break;
-
-                                    // 3. Handle X events (detect Ctrl+C and Ctrl+Z)
-                                    if (FD_ISSET(xfd, &rfds))
-                                    {
-                                        while (XPending(dpy))
-                                        {
-                                            XEvent ev2;
-                                            XNextEvent(dpy, &ev2);
-                                            if (ev2.type == KeyPress)
-                                            {
-                                                KeySym ks2;
-                                                char kbuf[32];
-                                                XLookupString(&ev2.xkey, kbuf, sizeof(kbuf), &ks2, NULL);
-                                                if ((ev2.xkey.state & ControlMask) && (ks2 == XK_C || ks2 == XK_c))
-                                                {
-                                                    if (current_child_pid > 0)
-                                                        kill(-current_child_pid, SIGINT);
-                                                }
-                                                else if ((ev2.xkey.state & ControlMask) && (ks2 == XK_Z || ks2 == XK_z))
-                                                {
-                                                    if (current_child_pid > 0)
-                                                    {
-                                                        kill(-current_child_pid, SIGTSTP);
-                                                        // The WIFSTOPPED check above will handle this
-                                                    }
-                                                }
-                                            }
-                                        }
-                                    }
-
-                                    // 4. Read output from child if available
-                                    if (FD_ISSET(pipefd[0], &rfds))
-                                    {
-                                        ssize_t n = read(pipefd[0], buf, sizeof(buf) - 1);
-                                        if (n > 0)
-                                        {
-                                            buf[n] = '\0';
-                                            draw_output(win, gc, tab, buf);
-                                        }
-                                    }
-
-                                    // If child was stopped via Ctrl+Z, break out
-                                    if (child_stopped)
-                                        break;
-                                }
-
-                                // Only close pipe if child wasn't stopped (if stopped, we might want to resume later)
-                                if (!child_stopped)
-                                {
-                                    current_child_pid = -1;
-                                    close(pipefd[0]);
-                                }
-                            }
-
-                            // Reset tab->command for next command
-                            tab->command[0] = '\0';
-                            tab->current_line++;
-                            tab->isCommand[tab->current_line] = 1;
-                            tab->cursor_pos = 0;
-                        }
-                        else
-                        { // multi-line continuation
-                            strcat(tab->command, tab->lines[tab->current_line]);
-                            strcat(tab->command, "\n"); // preserve the new line
-                            tab->current_line++;
-                            tab->isCommand[tab->current_line] = 0;
-                            tab->cursor_pos = 0;
-                        }
-                    }
-                }
-                else if (ks == XK_BackSpace) {
-                    if (tab->cursor_pos > 0)
-                    {
-                        int line_len = strlen(tab->lines[tab->current_line]);
-                        // shift characters left
-                        for (int i = tab->cursor_pos - 1; i < line_len; i++)
-                        {
-                            tab->lines[tab->current_line][i] = tab->lines[tab->current_line][i + 1];
-                        }
-                        tab->cursor_pos--;
-                    }
-                }
-                else if (len > 0 && tab->cursor_pos < MAX_LINE_LEN - 1) {
-                    int line_len = strlen(tab->lines[tab->current_line]);
-                    if (line_len >= MAX_LINE_LEN - 1)
-                        line_len = MAX_LINE_LEN - 2;
-
-                    // shift characters right
-                    for (int i = line_len; i >= tab->cursor_pos; i--)
-                    {
-                        tab->lines[tab->current_line][i + 1] = tab->lines[tab->current_line][i];
-                    }
 
-                    // insert new character
-                    tab->lines[tab->current_line][tab->cursor_pos] = buf[0];
-                    tab->cursor_pos++;
+                case KeyPress: {
+                    KeySym ks;
+                    char buf[32];
+                    int len = XLookupString(&ev.xkey, buf, sizeof(buf), &ks, NULL);
+                    handle_key(win, gc, ks, ev.xkey.state, buf, len);
+                    break;
                 }
-                
-                draw_text(win, gc, tab);
-                break;
-            }
 
-            case ButtonPress: {
-                int x = ev.xbutton.x, y = ev.xbutton.y;
-                if (y < 30) {
-                    int clicked = x / 70;
-                    if (clicked < total_tabs) {
-                        current_tab = clicked;
-                        draw_text(win, gc, &tabs[current_tab]);
-                    }
-                }
-                break;
+                case ButtonPress:
+                    handle_click(win, gc, ev.xbutton.x, ev.xbutton.y);
+                    break;
             }
         }
+        if (width) handle_resize(win, gc, width, height);
+        input_end(win, gc);
+        if (exposed.type) {
+            exposed.width = x1 - exposed.x;
+            exposed.height = y1 - exposed.y;
+            expose_window(win, gc, tabs[current_tab], &exposed);
+        }
     }
 }
-int main() {
-    dpy = XOpenDisplay(NULL);
-    if (!dpy) errx(1, "Cannot open display");
+int main(int argc, char **argv) {
+    // Scrollback length per tab can be tuned with MYTERM_SCROLLBACK=<lines>,
+    // and the memory its compressed blocks take before they spill to a file
+    // with MYTERM_SCROLLBACK_RAM=<MB>
+    const char *sb_env = getenv("MYTERM_SCROLLBACK");
+    if (sb_env && atoi(sb_env) > 0) scrollback_lines = atoi(sb_env);
+    const char *ram_env = getenv("MYTERM_SCROLLBACK_RAM");
+    if (ram_env && *ram_env) scrollback_ram = strtoul(ram_env, NULL, 10) << 20;
+
+    // myTerm -s [name]: this window is a front end for a session daemon
+    int session = -1;
+    if (argc > 1 && strcmp(argv[1], "-s") == 0) {
+        session = session_open(argc > 2 ? argv[2] : SESSION_DEFAULT);
+        if (session < 0) err(1, "session %s", argc > 2 ? argv[2] : SESSION_DEFAULT);
+    } else {
+        // myTerm -H [script]: no display, input from the script
+        if (argc > 1 && strcmp(argv[1], "-H") == 0) {
+            script_open(argc > 2 ? argv[2] : "-");
+            headless = HEADLESS_SCRIPT;
+        }
+        // Fork the shell launcher while this process is still small
+        launcher_start();
+    }
+    vt_init_table();
 
-    screen = DefaultScreen(dpy);
-    root = RootWindow(dpy, screen);
+    Window win = None;
+    GC gc = NULL;
+    if (headless) {
+        fixed_metrics();
+    } else {
+        dpy = XOpenDisplay(NULL);
+        if (!dpy) errx(1, "Cannot open display");
 
-    // Get screen dimensions for better initial size
-    win_width = DisplayWidth(dpy, screen) / 2;
-    win_height = DisplayHeight(dpy, screen) / 2;
+        screen = DefaultScreen(dpy);
+        root = RootWindow(dpy, screen);
 
-    Window win = create_window();
-    GC gc = create_gc(win);
-    
-    XFontStruct *font = XLoadQueryFont(dpy, "10x20");
-    XSetFont(dpy, gc, font->fid);
+        // Get screen dimensions for better initial size
+        win_width = DisplayWidth(dpy, screen) / 2;
+        win_height = DisplayHeight(dpy, screen) / 2;
 
-    XMapWindow(dpy, win);
-    XFlush(dpy);
-    XGrabKeyboard(dpy, win, True, GrabModeAsync, GrabModeAsync, CurrentTime);
+        win = create_window();
+        gc = create_gc(win);
+
+        // The font can be changed with MYTERM_FONT=<X font name>
+        const char *font_name = getenv("MYTERM_FONT");
+        if (load_font(gc, font_name ? font_name : DEFAULT_FONT) < 0)
+            errx(1, "Cannot load font");
+
+        XMapWindow(dpy, win);
+        XFlush(dpy);
+        XGrabKeyboard(dpy, win, True, GrabModeAsync, GrabModeAsync, CurrentTime);
+
+        if (session >= 0) {
+            session_frontend(win, gc, session);
+            return 0;
+        }
+    }
 
-    init_tab(&tabs[0]);
-    
     load_history();
     
-    struct sigaction sa;
+    // X, ptys, SIGCHLD/SIGINT and timers all wake the one event loop
+    reactor_init(headless ? -1 : ConnectionNumber(dpy));
+    pathindex_init();
 
-    // SIGINT handler (Ctrl+C)
-    sa.sa_handler = sigint_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;
-    sigaction(SIGINT, &sa, NULL);
+    struct sigaction sa;
 
     // SIGTSTP handler (Ctrl+Z) → ignore in the shell
     sa.sa_handler = SIG_IGN;   // ignore Ctrl+Z in shell
@@ -1672,19 +6236,13 @@ int main() {
     run(win, gc);  // This will return when exit command is called
 
     // Cleanup after run() returns
-    save_history();
+    close_history();
 
-    // Kill all shell processes
+    // Hang up all shell processes; their jobs get SIGHUP from the shell
     for (int i = 0; i < total_tabs; i++) {
-        if (tabs[i].shell_pid > 0) {
-            kill(tabs[i].shell_pid, SIGTERM);
-        }
-    }
-    
-    // Kill any background jobs
-    for (int i = 0; i < bg_count; i++) {
-        if (background_jobs[i] > 0) {
-            kill(background_jobs[i], SIGTERM);
+        if (tabs[i]->watch) watch_free(tabs[i]->watch);
+        if (tabs[i]->shell_pid > 0) {
+            kill(tabs[i]->shell_pid, SIGHUP);
         }
     }
 